@@ -1,10 +1,30 @@
 #include <SDL2/SDL.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #define WIDTH 1280
 #define HEIGHT 720
 #define TILE_SIZE 20
 #define ROWS HEIGHT / TILE_SIZE
 #define COLS WIDTH / TILE_SIZE
+#define DEFAULT_MARGIN 256
+#define READ_BUFFER_SIZE 65536
+#define RLE_LINE_LENGTH 70
+#define SAVE_FILE "game_of_life.rle"
+#define DISPLAY_FPS 60
+#define DEFAULT_GENS_PER_SEC 10
+#define MAX_GENS_PER_SEC 65536
+#define MIN_ZOOM 1.0
+#define MAX_ZOOM 64.0
+#define ZOOM_STEP 1.25
+#define PAN_FRACTION 0.125
+#define COLOR_LIVE 0xffffffff
+#define COLOR_DEAD 0xff000000
+#define MAX_STATES 25
+#define MAX_NEIGHBOURS 8
+#define RULE_TEXT_SIZE 64
+#define DEFAULT_RULE "B3/S23"
 
 enum TILE_STATE
 {
@@ -12,24 +32,220 @@ enum TILE_STATE
     LIVE
 };
 
+enum PATTERN_FORMAT
+{
+    FORMAT_RLE,
+    FORMAT_PLAINTEXT
+};
+
+typedef struct
+{
+    const char *name;
+    void (*init)(int, int);
+    void (*destroy)();
+    int (*get)(int, int);
+    void (*set)(int, int, int);
+    void (*step)();
+    void (*expand)(int, int, int, Uint32 *);
+    int max_states;
+} ENGINE;
+
+// outer-totalistic rule: bit n of birth/survive is set when n live neighbours
+// cause a birth/let a live cell survive; states > 2 makes it a Generations rule
+typedef struct
+{
+    Uint16 birth, survive;
+    int states;
+} RULE;
+
+typedef struct
+{
+    FILE *file;
+    unsigned char buffer[READ_BUFFER_SIZE];
+    size_t len, pos;
+} READER;
+
+typedef struct
+{
+    FILE *file;
+    int line_len;
+} RLE_WRITER;
+
+int rows = ROWS, cols = COLS;
+
+RULE rule;
+// compiled rule: next state indexed by current state and live neighbour count
+Uint8 rule_lut[MAX_STATES][MAX_NEIGHBOURS + 1];
+Uint32 state_colors[MAX_STATES];
+// compiled rule for the bitwise engine: which counts matter and what they do
+int active_counts[MAX_NEIGHBOURS + 1], num_active_counts;
+Uint64 birth_masks[MAX_NEIGHBOURS + 1], survive_masks[MAX_NEIGHBOURS + 1];
+int rule_is_conway;
+
+const char *preset_rules[] = {
+    "B3/S23",       // Conway's Life
+    "B36/S23",      // HighLife
+    "B3678/S34678", // Day & Night
+    "B2/S",         // Seeds
+    "B3/S012345678", // Life without Death
+    "B2/S/C3",      // Brian's Brain
+    "B2/S345/C4",   // Star Wars
+};
+const int num_preset_rules = sizeof(preset_rules) / sizeof(preset_rules[0]);
+
+// naive engine: one int per cell, neighbours counted one by one
 int **tiles_curr;
 int **tiles_next;
 
+// bitwise engine: 64 cells per word, neighbours counted with a bit-sliced adder
+Uint64 *bits_curr;
+Uint64 *bits_next;
+int words_per_row;
+Uint32 expand_lut[256][8];
+
+// table engine: one byte per cell with a dead border, stepped through rule_lut
+Uint8 *cells_curr;
+Uint8 *cells_next;
+Uint8 *column_sums;
+int cells_stride;
+
+// view: board cell shown at the top left corner of the window, and pixels per cell
+double view_x, view_y, zoom = TILE_SIZE;
+int board_dirty = 1;
+
 void InitMatrix(int ***);
+void FreeMatrix(int **);
+void NaiveInit(int, int);
+void NaiveDestroy();
+int NaiveGet(int, int);
+void NaiveSet(int, int, int);
 void SimulateTiles();
-void FillTiles(SDL_Surface *);
 int GetLiveNeighbourCount(int **, int, int);
+void NaiveExpand(int, int, int, Uint32 *);
+void BitwiseInit(int, int);
+void BitwiseDestroy();
+int BitwiseGet(int, int);
+void BitwiseSet(int, int, int);
+void BitwiseStep();
+void BitwiseExpand(int, int, int, Uint32 *);
+void TableInit(int, int);
+void TableDestroy();
+int TableGet(int, int);
+void TableSet(int, int, int);
+void TableStep();
+void TableExpand(int, int, int, Uint32 *);
+void InitExpandLut();
+int ParseRule(const char *, RULE *);
+void FormatRule(const RULE *, char *);
+void CompileRule();
+const ENGINE *ApplyRule(const ENGINE *, const char *);
+const ENGINE *SwitchEngine(const ENGINE *, const ENGINE *);
+void UpdateTitle(SDL_Window *);
+void ClampView();
+void ZoomAt(double, int, int);
+void RenderBoard(SDL_Renderer *, SDL_Texture *, const ENGINE *);
+const ENGINE *FindEngine(const char *);
+int ReadChar(READER *);
+int OpenReader(READER *, const char *);
+int DetectFormat(READER *);
+int ReadPatternSize(const char *, int *, int *, char *);
+int LoadPattern(const char *, const ENGINE *, int, int);
+char StateTag(int);
+void WriteRleRun(RLE_WRITER *, int, char);
+int SavePattern(const char *, const ENGINE *);
+Uint64 CountPopulation(const ENGINE *);
+int RunBenchmark(const char *, int, const char *, int, int, const char *, const char *);
+int CheckPatterns();
 
-int main()
+const ENGINE engines[] = {
+    {"naive", NaiveInit, NaiveDestroy, NaiveGet, NaiveSet, SimulateTiles, NaiveExpand, MAX_STATES},
+    {"table", TableInit, TableDestroy, TableGet, TableSet, TableStep, TableExpand, MAX_STATES},
+    {"bitwise", BitwiseInit, BitwiseDestroy, BitwiseGet, BitwiseSet, BitwiseStep, BitwiseExpand, 2},
+};
+const int num_engines = sizeof(engines) / sizeof(engines[0]);
+
+int main(int argc, char **argv)
 {
+    const char *pattern_path = NULL, *engine_name = NULL, *save_path = NULL, *rule_text = NULL;
+    int gens = -1, board_w = 0, board_h = 0, check = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--pattern") && i + 1 < argc)
+            pattern_path = argv[++i];
+        else if (!strcmp(argv[i], "--gens") && i + 1 < argc)
+            gens = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--engine") && i + 1 < argc)
+            engine_name = argv[++i];
+        else if (!strcmp(argv[i], "--size") && i + 1 < argc)
+            sscanf(argv[++i], "%dx%d", &board_w, &board_h);
+        else if (!strcmp(argv[i], "--save") && i + 1 < argc)
+            save_path = argv[++i];
+        else if (!strcmp(argv[i], "--rule") && i + 1 < argc)
+            rule_text = argv[++i];
+        else if (!strcmp(argv[i], "--check"))
+            check = 1;
+        else
+        {
+            printf("Usage: ./game_of_life [--pattern <RLE or plaintext file>] [--gens N] [--engine naive|table|bitwise|all] [--rule B3/S23] [--size WxH] [--save <file>] [--check]\n");
+            return 0;
+        }
+    }
+
+    if (check)
+        return CheckPatterns();
+
+    // headless benchmark
+    if (gens >= 0)
+        return RunBenchmark(pattern_path, gens, engine_name ? engine_name : "all", board_w, board_h, save_path, rule_text);
+
+    const ENGINE *engine = FindEngine(engine_name ? engine_name : "bitwise");
+    if (!engine)
+    {
+        printf("Unknown engine: %s\n", engine_name);
+        return 1;
+    }
+
+    // a rule on the command line wins over the one in the pattern header
+    char pattern_rule[RULE_TEXT_SIZE] = DEFAULT_RULE;
+    int pattern_w = 0, pattern_h = 0;
+    if (pattern_path && ReadPatternSize(pattern_path, &pattern_w, &pattern_h, pattern_rule))
+        return 1;
+    if (ParseRule(rule_text ? rule_text : pattern_rule, &rule))
+    {
+        printf("Invalid rule: %s\n", rule_text ? rule_text : pattern_rule);
+        return 1;
+    }
+    CompileRule();
+    if (engine->max_states < rule.states)
+    {
+        printf("The %s engine only supports two-state rules, using the table engine\n", engine->name);
+        engine = FindEngine("table");
+    }
+
+    if (pattern_w > cols)
+        cols = pattern_w;
+    if (pattern_h > rows)
+        rows = pattern_h;
+    engine->init(rows, cols);
+    if (pattern_path && LoadPattern(pattern_path, engine, (rows - pattern_h) / 2, (cols - pattern_w) / 2))
+        return 1;
+
     SDL_Init(SDL_INIT_EVERYTHING);
     SDL_Window *window = SDL_CreateWindow("Conway's Game of Life", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, WIDTH, HEIGHT, 0);
-    SDL_Surface *surface = SDL_GetWindowSurface(window);
+    SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+    // one texel per visible cell, scaled up with nearest filtering on present
+    SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "0");
+    SDL_Texture *texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, WIDTH / MIN_ZOOM + 1, HEIGHT / MIN_ZOOM + 1);
+    InitExpandLut();
+    UpdateTitle(window);
 
-    InitMatrix(&tiles_curr);
-    InitMatrix(&tiles_next);
+    view_x = (cols - WIDTH / zoom) / 2;
+    view_y = (rows - HEIGHT / zoom) / 2;
+    ClampView();
 
-    int running = 1, paused = 1;
+    int running = 1, paused = 1, gens_per_sec = DEFAULT_GENS_PER_SEC, preset = 0;
+    double gens_due = 0;
+    Uint64 last_frame = SDL_GetPerformanceCounter();
     while (running)
     {
         SDL_Event event;
@@ -41,6 +257,54 @@ int main()
             case SDL_QUIT:
                 running = 0;
                 break;
+            case SDL_KEYDOWN:
+                switch (event.key.keysym.sym)
+                {
+                case SDLK_s:
+                    if (!SavePattern(save_path ? save_path : SAVE_FILE, engine))
+                        printf("Saved pattern to %s\n", save_path ? save_path : SAVE_FILE);
+                    break;
+                case SDLK_SPACE:
+                    paused = !paused;
+                    break;
+                case SDLK_r:
+                    preset = (preset + 1) % num_preset_rules;
+                    engine = ApplyRule(engine, preset_rules[preset]);
+                    UpdateTitle(window);
+                    break;
+                case SDLK_PLUS:
+                case SDLK_EQUALS:
+                    if (gens_per_sec < MAX_GENS_PER_SEC)
+                        gens_per_sec *= 2;
+                    printf("Generations per second: %d\n", gens_per_sec);
+                    break;
+                case SDLK_MINUS:
+                    if (gens_per_sec > 1)
+                        gens_per_sec /= 2;
+                    printf("Generations per second: %d\n", gens_per_sec);
+                    break;
+                case SDLK_LEFT:
+                    view_x -= WIDTH / zoom * PAN_FRACTION;
+                    break;
+                case SDLK_RIGHT:
+                    view_x += WIDTH / zoom * PAN_FRACTION;
+                    break;
+                case SDLK_UP:
+                    view_y -= HEIGHT / zoom * PAN_FRACTION;
+                    break;
+                case SDLK_DOWN:
+                    view_y += HEIGHT / zoom * PAN_FRACTION;
+                    break;
+                }
+                ClampView();
+                break;
+            case SDL_MOUSEWHEEL:
+                // horizontal scrolling reports y == 0 and should not zoom
+                if (event.wheel.y == 0)
+                    break;
+                SDL_GetMouseState(&x, &y);
+                ZoomAt(event.wheel.y > 0 ? zoom * ZOOM_STEP : zoom / ZOOM_STEP, x, y);
+                break;
             case SDL_MOUSEBUTTONDOWN:
                 if (event.button.button == SDL_BUTTON_RIGHT)
                     paused = !paused;
@@ -49,28 +313,46 @@ int main()
                 if (event.motion.state & SDL_BUTTON_RMASK)
                     break;
 
-                x = event.motion.x / TILE_SIZE * TILE_SIZE;
-                y = event.motion.y / TILE_SIZE * TILE_SIZE;
+                x = SDL_floor(view_x + event.motion.x / zoom);
+                y = SDL_floor(view_y + event.motion.y / zoom);
+                if (x < 0 || y < 0 || x >= cols || y >= rows)
+                    break;
 
                 if (event.motion.state & SDL_BUTTON_LMASK)
-                    tiles_curr[y / TILE_SIZE][x / TILE_SIZE] = LIVE;
+                    engine->set(y, x, LIVE);
                 else if (event.motion.state & SDL_BUTTON_MMASK)
-                    tiles_curr[y / TILE_SIZE][x / TILE_SIZE] = DEAD;
+                    engine->set(y, x, DEAD);
+                board_dirty = 1;
 
                 break;
             }
         }
 
-        SDL_FillRect(surface, NULL, 0);
-
+        // simulation runs at gens_per_sec regardless of the display rate, but never
+        // takes more than most of a frame so input and drawing stay responsive
+        Uint64 now = SDL_GetPerformanceCounter();
+        Uint64 frame_ticks = SDL_GetPerformanceFrequency() / DISPLAY_FPS;
         if (!paused)
-            SimulateTiles();
-        FillTiles(surface);
+        {
+            gens_due += (double)(now - last_frame) / SDL_GetPerformanceFrequency() * gens_per_sec;
+            while (gens_due >= 1 && SDL_GetPerformanceCounter() - now < frame_ticks * 3 / 4)
+            {
+                engine->step();
+                board_dirty = 1;
+                gens_due--;
+            }
+            if (gens_due >= 1)
+                gens_due = 0;
+        }
+        last_frame = now;
 
-        SDL_UpdateWindowSurface(window);
-        SDL_Delay(100);
+        RenderBoard(renderer, texture, engine);
+        SDL_RenderPresent(renderer);
     }
 
+    engine->destroy();
+    SDL_DestroyTexture(texture);
+    SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
     SDL_Quit();
     return 0;
@@ -78,24 +360,50 @@ int main()
 
 void InitMatrix(int ***matrix)
 {
-    *matrix = (int **)calloc(ROWS, sizeof(int *));
-    for (int i = 0; i < ROWS; i++)
-        (*matrix)[i] = (int *)calloc(COLS, sizeof(int));
+    *matrix = (int **)calloc(rows, sizeof(int *));
+    for (int i = 0; i < rows; i++)
+        (*matrix)[i] = (int *)calloc(cols, sizeof(int));
+}
+
+void FreeMatrix(int **matrix)
+{
+    for (int i = 0; i < rows; i++)
+        free(matrix[i]);
+    free(matrix);
+}
+
+void NaiveInit(int num_rows, int num_cols)
+{
+    rows = num_rows;
+    cols = num_cols;
+    InitMatrix(&tiles_curr);
+    InitMatrix(&tiles_next);
+}
+
+void NaiveDestroy()
+{
+    FreeMatrix(tiles_curr);
+    FreeMatrix(tiles_next);
+}
+
+int NaiveGet(int row, int col)
+{
+    return tiles_curr[row][col];
+}
+
+void NaiveSet(int row, int col, int state)
+{
+    tiles_curr[row][col] = state;
 }
 
 void SimulateTiles()
 {
-    for (int i = 0; i < ROWS; i++)
+    for (int i = 0; i < rows; i++)
     {
-        for (int j = 0; j < COLS; j++)
+        for (int j = 0; j < cols; j++)
         {
             int count = GetLiveNeighbourCount(tiles_curr, i, j);
-            if (tiles_curr[i][j] == LIVE && (count < 2 || count > 3))
-                tiles_next[i][j] = DEAD;
-            else if (tiles_curr[i][j] == DEAD && count == 3)
-                tiles_next[i][j] = LIVE;
-            else
-                tiles_next[i][j] = tiles_curr[i][j];
+            tiles_next[i][j] = rule_lut[tiles_curr[i][j]][count];
         }
     }
 
@@ -104,37 +412,871 @@ void SimulateTiles()
     tiles_next = temp;
 }
 
-void FillTiles(SDL_Surface *surface)
-{
-    for (int i = 0; i < ROWS; i++)
-    {
-        for (int j = 0; j < COLS; j++)
-        {
-            SDL_Rect rect = {j * TILE_SIZE, i * TILE_SIZE, TILE_SIZE, TILE_SIZE};
-            if (tiles_curr[i][j] == LIVE)
-                SDL_FillRect(surface, &rect, 0xffffffff);
-            else
-                SDL_FillRect(surface, &rect, 0);
-        }
-    }
-}
-
 int GetLiveNeighbourCount(int **tiles, int row, int col)
 {
     int count = 0;
     for (int i = row - 1; i <= row + 1; i++)
     {
-        if (i < 0 || i >= ROWS)
+        if (i < 0 || i >= rows)
             continue;
         for (int j = col - 1; j <= col + 1; j++)
         {
             if (i == row && j == col)
                 continue;
-            if (j < 0 || j >= COLS)
+            if (j < 0 || j >= cols)
                 continue;
             if (tiles[i][j] == LIVE)
                 count++;
         }
     }
     return count;
-}
\ No newline at end of file
+}
+
+void NaiveExpand(int row, int col, int len, Uint32 *pixels)
+{
+    for (int j = 0; j < len; j++)
+        pixels[j] = state_colors[tiles_curr[row][col + j]];
+}
+
+void BitwiseInit(int num_rows, int num_cols)
+{
+    rows = num_rows;
+    cols = num_cols;
+    words_per_row = (cols + 63) / 64;
+    bits_curr = (Uint64 *)calloc((size_t)rows * words_per_row, sizeof(Uint64));
+    bits_next = (Uint64 *)calloc((size_t)rows * words_per_row, sizeof(Uint64));
+}
+
+void BitwiseDestroy()
+{
+    free(bits_curr);
+    free(bits_next);
+}
+
+int BitwiseGet(int row, int col)
+{
+    return (bits_curr[(size_t)row * words_per_row + col / 64] >> (col % 64)) & 1;
+}
+
+void BitwiseSet(int row, int col, int state)
+{
+    Uint64 *word = bits_curr + (size_t)row * words_per_row + col / 64;
+    if (state == LIVE)
+        *word |= (Uint64)1 << (col % 64);
+    else
+        *word &= ~((Uint64)1 << (col % 64));
+}
+
+// inlined twice by BitwiseStep, so the Conway kernel carries no trace of the generic one
+static inline void BitwiseStepRows(int conway)
+{
+    Uint64 last_mask = cols % 64 ? ((Uint64)1 << (cols % 64)) - 1 : ~(Uint64)0;
+
+    for (int i = 0; i < rows; i++)
+    {
+        const Uint64 *above = i > 0 ? bits_curr + (size_t)(i - 1) * words_per_row : NULL;
+        const Uint64 *curr = bits_curr + (size_t)i * words_per_row;
+        const Uint64 *below = i < rows - 1 ? bits_curr + (size_t)(i + 1) * words_per_row : NULL;
+        Uint64 *next = bits_next + (size_t)i * words_per_row;
+
+        for (int k = 0; k < words_per_row; k++)
+        {
+            // bit x of each word holds column k * 64 + x, so a west neighbour is a shift left
+            // with the top bit of the previous word carried in, and east is the mirror image
+            Uint64 a = above ? above[k] : 0;
+            Uint64 b = curr[k];
+            Uint64 c = below ? below[k] : 0;
+            Uint64 a_prev = above && k > 0 ? above[k - 1] : 0, a_next = above && k < words_per_row - 1 ? above[k + 1] : 0;
+            Uint64 b_prev = k > 0 ? curr[k - 1] : 0, b_next = k < words_per_row - 1 ? curr[k + 1] : 0;
+            Uint64 c_prev = below && k > 0 ? below[k - 1] : 0, c_next = below && k < words_per_row - 1 ? below[k + 1] : 0;
+
+            Uint64 aw = a << 1 | a_prev >> 63, ae = a >> 1 | a_next << 63;
+            Uint64 bw = b << 1 | b_prev >> 63, be = b >> 1 | b_next << 63;
+            Uint64 cw = c << 1 | c_prev >> 63, ce = c >> 1 | c_next << 63;
+
+            // sum the eight neighbour planes into ones, twos, fours and eights bits
+            Uint64 s0 = aw ^ a ^ ae, c0 = (aw & a) | (ae & (aw ^ a));
+            Uint64 s1 = bw ^ be ^ cw, c1 = (bw & be) | (cw & (bw ^ be));
+            Uint64 s2 = c ^ ce, c2 = c & ce;
+            Uint64 ones = s0 ^ s1 ^ s2, c3 = (s0 & s1) | (s2 & (s0 ^ s1));
+            Uint64 t0 = c0 ^ c1 ^ c2, t1 = (c0 & c1) | (c2 & (c0 ^ c1));
+            Uint64 twos = t0 ^ c3, t2 = t0 & c3;
+            Uint64 fours = t1 ^ t2, eights = t1 & t2;
+
+            if (conway)
+            {
+                // B3/S23: exactly three neighbours, or exactly two and already alive
+                next[k] = ~fours & ~eights & twos & (ones | b);
+                continue;
+            }
+
+            // any other rule: select the cells whose count matches each count the rule uses
+            Uint64 result = 0;
+            for (int n = 0; n < num_active_counts; n++)
+            {
+                int count = active_counts[n];
+                Uint64 match = (count & 1 ? ones : ~ones) & (count & 2 ? twos : ~twos) & (count & 4 ? fours : ~fours) & (count & 8 ? eights : ~eights);
+                result |= match & ((birth_masks[count] & ~b) | (survive_masks[count] & b));
+            }
+            next[k] = result;
+        }
+        next[words_per_row - 1] &= last_mask;
+    }
+
+    Uint64 *temp = bits_curr;
+    bits_curr = bits_next;
+    bits_next = temp;
+}
+
+void BitwiseStep()
+{
+    if (rule_is_conway)
+        BitwiseStepRows(1);
+    else
+        BitwiseStepRows(0);
+}
+
+void TableInit(int num_rows, int num_cols)
+{
+    rows = num_rows;
+    cols = num_cols;
+    cells_stride = cols + 2;
+    cells_curr = (Uint8 *)calloc((size_t)(rows + 2) * cells_stride, sizeof(Uint8));
+    cells_next = (Uint8 *)calloc((size_t)(rows + 2) * cells_stride, sizeof(Uint8));
+    column_sums = (Uint8 *)calloc(cells_stride, sizeof(Uint8));
+}
+
+void TableDestroy()
+{
+    free(cells_curr);
+    free(cells_next);
+    free(column_sums);
+}
+
+int TableGet(int row, int col)
+{
+    return cells_curr[(size_t)(row + 1) * cells_stride + col + 1];
+}
+
+void TableSet(int row, int col, int state)
+{
+    cells_curr[(size_t)(row + 1) * cells_stride + col + 1] = state;
+}
+
+void TableStep()
+{
+    for (int i = 1; i <= rows; i++)
+    {
+        const Uint8 *above = cells_curr + (size_t)(i - 1) * cells_stride;
+        const Uint8 *curr = cells_curr + (size_t)i * cells_stride;
+        const Uint8 *below = cells_curr + (size_t)(i + 1) * cells_stride;
+        Uint8 *next = cells_next + (size_t)i * cells_stride;
+
+        // live cells per column of the 3-row window, then a 3-wide horizontal sum
+        for (int j = 0; j < cells_stride; j++)
+            column_sums[j] = (above[j] == LIVE) + (curr[j] == LIVE) + (below[j] == LIVE);
+        for (int j = 1; j <= cols; j++)
+        {
+            int count = column_sums[j - 1] + column_sums[j] + column_sums[j + 1] - (curr[j] == LIVE);
+            next[j] = rule_lut[curr[j]][count];
+        }
+    }
+
+    Uint8 *temp = cells_curr;
+    cells_curr = cells_next;
+    cells_next = temp;
+}
+
+void TableExpand(int row, int col, int len, Uint32 *pixels)
+{
+    const Uint8 *cells = cells_curr + (size_t)(row + 1) * cells_stride + col + 1;
+    for (int j = 0; j < len; j++)
+        pixels[j] = state_colors[cells[j]];
+}
+
+// eight pixels for every possible byte of cells, so rows expand a byte at a time
+void InitExpandLut()
+{
+    for (int b = 0; b < 256; b++)
+        for (int i = 0; i < 8; i++)
+            expand_lut[b][i] = (b >> i) & 1 ? COLOR_LIVE : COLOR_DEAD;
+}
+
+void BitwiseExpand(int row, int col, int len, Uint32 *pixels)
+{
+    const Uint64 *words = bits_curr + (size_t)row * words_per_row;
+    int end = col + len;
+    for (; col < end && col % 8; col++)
+        *pixels++ = BitwiseGet(row, col) ? COLOR_LIVE : COLOR_DEAD;
+    for (; col + 8 <= end; col += 8, pixels += 8)
+        memcpy(pixels, expand_lut[(words[col / 64] >> (col % 64)) & 0xff], sizeof(expand_lut[0]));
+    for (; col < end; col++)
+        *pixels++ = BitwiseGet(row, col) ? COLOR_LIVE : COLOR_DEAD;
+}
+
+// accepts B3/S23, S/B ("23/3") and Generations ("B2/S/C3", "B2/S/3" or S/B/C "/2/3");
+// a Golly bounded grid suffix like ":T64,64" is ignored, the board is always finite with dead edges
+int ParseRule(const char *text, RULE *parsed)
+{
+    RULE result = {0, 0, 2};
+    int field = 0, saw_letters = 0;
+    Uint16 *digits_target = &result.survive;
+    for (const char *c = text; *c; c++)
+    {
+        if (*c == 'B' || *c == 'b')
+        {
+            digits_target = &result.birth;
+            saw_letters = 1;
+        }
+        else if (*c == 'S' || *c == 's')
+        {
+            digits_target = &result.survive;
+            saw_letters = 1;
+        }
+        else if (*c == 'C' || *c == 'c' || *c == 'G' || *c == 'g')
+        {
+            result.states = atoi(c + 1);
+            while (c[1] >= '0' && c[1] <= '9')
+                c++;
+            saw_letters = 1;
+        }
+        else if (*c == '/')
+        {
+            field++;
+            // without letters the fields are survive, birth, states
+            if (!saw_letters)
+                digits_target = field == 1 ? &result.birth : NULL;
+            if (field == 2 && (c[1] >= '0' && c[1] <= '9'))
+            {
+                result.states = atoi(c + 1);
+                while (c[1] >= '0' && c[1] <= '9')
+                    c++;
+            }
+        }
+        else if (*c >= '0' && *c <= '8' && digits_target)
+            *digits_target |= 1 << (*c - '0');
+        else if (*c == ':')
+            break;
+        else if (*c != ' ')
+            return 1;
+    }
+    if (result.states < 2 || result.states > MAX_STATES)
+        return 1;
+    *parsed = result;
+    return 0;
+}
+
+void FormatRule(const RULE *format_rule, char *text)
+{
+    int len = sprintf(text, "B");
+    for (int n = 0; n <= MAX_NEIGHBOURS; n++)
+        if (format_rule->birth >> n & 1)
+            len += sprintf(text + len, "%d", n);
+    len += sprintf(text + len, "/S");
+    for (int n = 0; n <= MAX_NEIGHBOURS; n++)
+        if (format_rule->survive >> n & 1)
+            len += sprintf(text + len, "%d", n);
+    if (format_rule->states > 2)
+        sprintf(text + len, "/C%d", format_rule->states);
+}
+
+// turns the current rule into the lookup table and bitwise masks the engines step with
+void CompileRule()
+{
+    for (int n = 0; n <= MAX_NEIGHBOURS; n++)
+    {
+        rule_lut[DEAD][n] = rule.birth >> n & 1 ? LIVE : DEAD;
+        // a live cell that does not survive starts dying, or dies outright in a two-state rule
+        rule_lut[LIVE][n] = rule.survive >> n & 1 ? LIVE : (rule.states > 2 ? 2 : DEAD);
+        for (int state = 2; state < MAX_STATES; state++)
+            rule_lut[state][n] = state + 1 < rule.states ? state + 1 : DEAD;
+    }
+
+    num_active_counts = 0;
+    for (int n = 0; n <= MAX_NEIGHBOURS; n++)
+    {
+        birth_masks[n] = rule.birth >> n & 1 ? ~(Uint64)0 : 0;
+        survive_masks[n] = rule.survive >> n & 1 ? ~(Uint64)0 : 0;
+        if ((rule.birth | rule.survive) >> n & 1)
+            active_counts[num_active_counts++] = n;
+    }
+    rule_is_conway = rule.birth == 1 << 3 && rule.survive == (1 << 2 | 1 << 3) && rule.states == 2;
+
+    // dying states fade from orange towards the background
+    state_colors[DEAD] = COLOR_DEAD;
+    state_colors[LIVE] = COLOR_LIVE;
+    for (int state = 2; state < MAX_STATES; state++)
+    {
+        int level = state < rule.states ? 255 - 192 * (state - 2) / SDL_max(rule.states - 2, 1) : 0;
+        state_colors[state] = 0xff000000 | (Uint32)level << 16 | (Uint32)(level / 2) << 8;
+    }
+}
+
+// switches rule at runtime, moving to an engine that can hold the new number of states
+const ENGINE *ApplyRule(const ENGINE *engine, const char *text)
+{
+    RULE old_rule = rule;
+    if (ParseRule(text, &rule))
+        return engine;
+    CompileRule();
+
+    if (engine->max_states < rule.states)
+        engine = SwitchEngine(engine, FindEngine("table"));
+    else if (old_rule.states > rule.states)
+    {
+        // drop states the new rule does not have
+        for (int i = 0; i < rows; i++)
+            for (int j = 0; j < cols; j++)
+                if (engine->get(i, j) >= rule.states)
+                    engine->set(i, j, DEAD);
+    }
+    board_dirty = 1;
+    return engine;
+}
+
+const ENGINE *SwitchEngine(const ENGINE *from, const ENGINE *to)
+{
+    Uint8 *snapshot = (Uint8 *)malloc((size_t)rows * cols);
+    for (int i = 0; i < rows; i++)
+        for (int j = 0; j < cols; j++)
+            snapshot[(size_t)i * cols + j] = from->get(i, j);
+    from->destroy();
+    to->init(rows, cols);
+    for (int i = 0; i < rows; i++)
+        for (int j = 0; j < cols; j++)
+            if (snapshot[(size_t)i * cols + j] < rule.states)
+                to->set(i, j, snapshot[(size_t)i * cols + j]);
+    free(snapshot);
+    printf("Switched to the %s engine\n", to->name);
+    return to;
+}
+
+void UpdateTitle(SDL_Window *window)
+{
+    char rule_name[RULE_TEXT_SIZE], title[RULE_TEXT_SIZE + 32];
+    FormatRule(&rule, rule_name);
+    sprintf(title, "Game of Life - %s", rule_name);
+    SDL_SetWindowTitle(window, title);
+}
+
+void ClampView()
+{
+    double view_w = WIDTH / zoom, view_h = HEIGHT / zoom;
+    if (view_x > cols - view_w)
+        view_x = cols - view_w;
+    if (view_y > rows - view_h)
+        view_y = rows - view_h;
+    if (view_x < 0)
+        view_x = 0;
+    if (view_y < 0)
+        view_y = 0;
+}
+
+// keeps the cell under the cursor fixed while the zoom changes
+void ZoomAt(double new_zoom, int x, int y)
+{
+    if (new_zoom < MIN_ZOOM)
+        new_zoom = MIN_ZOOM;
+    if (new_zoom > MAX_ZOOM)
+        new_zoom = MAX_ZOOM;
+    view_x += x / zoom - x / new_zoom;
+    view_y += y / zoom - y / new_zoom;
+    zoom = new_zoom;
+    ClampView();
+    board_dirty = 1;
+}
+
+void RenderBoard(SDL_Renderer *renderer, SDL_Texture *texture, const ENGINE *engine)
+{
+    static double last_view_x = -1, last_view_y = -1;
+
+    // only the cells intersecting the window are expanded and uploaded
+    int col0 = SDL_floor(view_x), row0 = SDL_floor(view_y);
+    int visible_cols = SDL_min((int)SDL_ceil(view_x + WIDTH / zoom), cols) - col0;
+    int visible_rows = SDL_min((int)SDL_ceil(view_y + HEIGHT / zoom), rows) - row0;
+    SDL_Rect src = {0, 0, visible_cols, visible_rows};
+
+    if (board_dirty || view_x != last_view_x || view_y != last_view_y)
+    {
+        void *pixels;
+        int pitch;
+        if (!SDL_LockTexture(texture, &src, &pixels, &pitch))
+        {
+            for (int i = 0; i < visible_rows; i++)
+                engine->expand(row0 + i, col0, visible_cols, (Uint32 *)((Uint8 *)pixels + (size_t)i * pitch));
+            SDL_UnlockTexture(texture);
+        }
+        board_dirty = 0;
+        last_view_x = view_x;
+        last_view_y = view_y;
+    }
+
+    SDL_FRect dest = {(col0 - view_x) * zoom, (row0 - view_y) * zoom, visible_cols * zoom, visible_rows * zoom};
+    SDL_SetRenderDrawColor(renderer, 0, 0, 0, SDL_ALPHA_OPAQUE);
+    SDL_RenderClear(renderer);
+    SDL_RenderCopyF(renderer, texture, &src, &dest);
+}
+
+const ENGINE *FindEngine(const char *name)
+{
+    for (int i = 0; i < num_engines; i++)
+        if (!strcmp(engines[i].name, name))
+            return engines + i;
+    return NULL;
+}
+
+int ReadChar(READER *reader)
+{
+    if (reader->pos == reader->len)
+    {
+        reader->len = fread(reader->buffer, 1, READ_BUFFER_SIZE, reader->file);
+        reader->pos = 0;
+        if (!reader->len)
+            return EOF;
+    }
+    return reader->buffer[reader->pos++];
+}
+
+int OpenReader(READER *reader, const char *path)
+{
+    reader->file = fopen(path, "rb");
+    reader->len = reader->pos = 0;
+    if (!reader->file)
+    {
+        printf("Could not open pattern: %s\n", path);
+        return 1;
+    }
+    return 0;
+}
+
+// RLE files start with '#' comments or the "x = ..." header, plaintext with '!' comments or cells
+int DetectFormat(READER *reader)
+{
+    int c;
+    do
+    {
+        c = ReadChar(reader);
+    } while (c == ' ' || c == '\t' || c == '\r' || c == '\n');
+
+    rewind(reader->file);
+    reader->len = reader->pos = 0;
+    return c == '#' || c == 'x' ? FORMAT_RLE : FORMAT_PLAINTEXT;
+}
+
+// rule_text receives the header's rule, if the pattern has one
+int ReadPatternSize(const char *path, int *width, int *height, char *rule_text)
+{
+    READER *reader = (READER *)malloc(sizeof(READER));
+    if (OpenReader(reader, path))
+    {
+        free(reader);
+        return 1;
+    }
+
+    *width = *height = 0;
+    int c, line_len = 0, at_line_start = 1, comment = 0;
+    if (DetectFormat(reader) == FORMAT_RLE)
+    {
+        // skip comment lines, then read "x = <w>, y = <h>" from the header
+        while ((c = ReadChar(reader)) == '#')
+            while ((c = ReadChar(reader)) != '\n' && c != EOF)
+                ;
+        char header[256];
+        int len = 0;
+        while (c != '\n' && c != EOF && len < (int)sizeof(header) - 1)
+        {
+            header[len++] = c;
+            c = ReadChar(reader);
+        }
+        header[len] = '\0';
+        if (sscanf(header, " x = %d , y = %d", width, height) != 2)
+        {
+            printf("Malformed RLE header in %s: %s\n", path, header);
+            fclose(reader->file);
+            free(reader);
+            return 1;
+        }
+        char *rule_field = strstr(header, "rule");
+        if (rule_field && sscanf(rule_field, "rule = %63[^ ,\r]", rule_text) != 1)
+            strcpy(rule_text, DEFAULT_RULE);
+    }
+    else
+    {
+        // plaintext has no header, so the size is the longest line by the number of cell lines,
+        // where an empty line is a row of dead cells
+        while ((c = ReadChar(reader)) != EOF)
+        {
+            if (c == '\n')
+            {
+                if (!comment)
+                    (*height)++;
+                at_line_start = 1;
+                comment = 0;
+                line_len = 0;
+                continue;
+            }
+            if (at_line_start && c == '!')
+                comment = 1;
+            at_line_start = 0;
+            if (!comment && c != '\r' && ++line_len > *width)
+                *width = line_len;
+        }
+        if (!comment && !at_line_start)
+            (*height)++;
+    }
+
+    fclose(reader->file);
+    free(reader);
+    return 0;
+}
+
+int LoadPattern(const char *path, const ENGINE *engine, int row_off, int col_off)
+{
+    READER *reader = (READER *)malloc(sizeof(READER));
+    if (OpenReader(reader, path))
+    {
+        free(reader);
+        return 1;
+    }
+
+    int c, row = 0, col = 0;
+    if (DetectFormat(reader) == FORMAT_RLE)
+    {
+        // skip comments and the header line, already handled by ReadPatternSize
+        while ((c = ReadChar(reader)) == '#')
+            while ((c = ReadChar(reader)) != '\n' && c != EOF)
+                ;
+        while (c != '\n' && c != EOF)
+            c = ReadChar(reader);
+
+        // runs saturate at the board size and cells past its edges are skipped, so huge or
+        // corrupt counts cannot overflow or spin through cells that are never stored
+        int run = 0, width = cols - col_off, height = rows - row_off;
+        while ((c = ReadChar(reader)) != EOF && c != '!')
+        {
+            if (c >= '0' && c <= '9')
+            {
+                run = SDL_min(run * 10 + c - '0', rows + cols);
+                continue;
+            }
+            if (c == ' ' || c == '\t' || c == '\r' || c == '\n')
+                continue;
+
+            int count = run ? run : 1;
+            run = 0;
+            if (c == '$')
+            {
+                row = SDL_min(row + count, height);
+                col = 0;
+            }
+            else if (c == 'b' || c == '.')
+                col = SDL_min(col + count, width);
+            else
+            {
+                // multi-state patterns use 'A' for state 1, 'B' for state 2 and so on
+                int state = c >= 'A' && c <= 'X' ? c - 'A' + 1 : LIVE;
+                if (state >= rule.states)
+                    state = LIVE;
+                int end = SDL_min(col + count, width);
+                if (row < height)
+                    for (; col < end; col++)
+                        engine->set(row + row_off, col + col_off, state);
+                col = end;
+            }
+        }
+    }
+    else
+    {
+        int comment = 0, at_line_start = 1;
+        while ((c = ReadChar(reader)) != EOF)
+        {
+            if (c == '\n')
+            {
+                if (!comment)
+                    row++;
+                at_line_start = 1;
+                comment = 0;
+                col = 0;
+                continue;
+            }
+            if (at_line_start && c == '!')
+                comment = 1;
+            at_line_start = 0;
+            if (comment || c == '\r')
+                continue;
+            if ((c == 'O' || c == '*') && row + row_off < rows && col + col_off < cols)
+                engine->set(row + row_off, col + col_off, LIVE);
+            col++;
+        }
+    }
+
+    fclose(reader->file);
+    free(reader);
+    return 0;
+}
+
+char StateTag(int state)
+{
+    if (rule.states > 2)
+        return state == DEAD ? '.' : 'A' + state - 1;
+    return state == DEAD ? 'b' : 'o';
+}
+
+void WriteRleRun(RLE_WRITER *writer, int run, char tag)
+{
+    char token[16];
+    int len = run > 1 ? sprintf(token, "%d%c", run, tag) : sprintf(token, "%c", tag);
+    if (writer->line_len + len > RLE_LINE_LENGTH)
+    {
+        fputc('\n', writer->file);
+        writer->line_len = 0;
+    }
+    fputs(token, writer->file);
+    writer->line_len += len;
+}
+
+// .cells files are written as plaintext, anything else as RLE, both trimmed to the live bounding box
+int SavePattern(const char *path, const ENGINE *engine)
+{
+    // plaintext has no rule line and only live and dead cells, so it would drop the dying states
+    const char *ext = strrchr(path, '.');
+    int plaintext = ext && !strcmp(ext, ".cells");
+    if (plaintext && rule.states > 2)
+    {
+        printf("Cannot save a Generations rule as plaintext, use an .rle file: %s\n", path);
+        return 1;
+    }
+
+    FILE *file = fopen(path, "w");
+    if (!file)
+    {
+        printf("Could not write pattern: %s\n", path);
+        return 1;
+    }
+
+    int min_row = rows, max_row = -1, min_col = cols, max_col = -1;
+    for (int i = 0; i < rows; i++)
+    {
+        for (int j = 0; j < cols; j++)
+        {
+            if (engine->get(i, j) == DEAD)
+                continue;
+            if (i < min_row)
+                min_row = i;
+            if (i > max_row)
+                max_row = i;
+            if (j < min_col)
+                min_col = j;
+            if (j > max_col)
+                max_col = j;
+        }
+    }
+    if (max_row < 0)
+        min_row = min_col = 0;
+
+    if (plaintext)
+    {
+        fprintf(file, "!Name: %s\n", path);
+        for (int i = min_row; i <= max_row; i++)
+        {
+            for (int j = min_col; j <= max_col; j++)
+                fputc(engine->get(i, j) == LIVE ? 'O' : '.', file);
+            fputc('\n', file);
+        }
+        fclose(file);
+        return 0;
+    }
+
+    char rule_name[RULE_TEXT_SIZE];
+    FormatRule(&rule, rule_name);
+    fprintf(file, "x = %d, y = %d, rule = %s\n", max_col - min_col + 1, max_row - min_row + 1, rule_name);
+    RLE_WRITER writer = {file, 0};
+    int pending_rows = 0;
+    for (int i = min_row; i <= max_row; i++)
+    {
+        int run = 0, state = DEAD;
+        for (int j = min_col; j <= max_col; j++)
+        {
+            int cell = engine->get(i, j);
+            if (cell == state)
+            {
+                run++;
+                continue;
+            }
+            if (run)
+            {
+                if (pending_rows)
+                {
+                    WriteRleRun(&writer, pending_rows, '$');
+                    pending_rows = 0;
+                }
+                WriteRleRun(&writer, run, StateTag(state));
+            }
+            state = cell;
+            run = 1;
+        }
+        // trailing dead cells are implied by the end of the row
+        if (state != DEAD)
+        {
+            if (pending_rows)
+            {
+                WriteRleRun(&writer, pending_rows, '$');
+                pending_rows = 0;
+            }
+            WriteRleRun(&writer, run, StateTag(state));
+        }
+        pending_rows++;
+    }
+    WriteRleRun(&writer, 1, '!');
+    fputc('\n', file);
+    fclose(file);
+    return 0;
+}
+
+Uint64 CountPopulation(const ENGINE *engine)
+{
+    Uint64 population = 0;
+    for (int i = 0; i < rows; i++)
+        for (int j = 0; j < cols; j++)
+            population += engine->get(i, j) == LIVE;
+    return population;
+}
+
+int RunBenchmark(const char *pattern_path, int gens, const char *engine_name, int board_w, int board_h, const char *save_path, const char *rule_text)
+{
+    char pattern_rule[RULE_TEXT_SIZE] = DEFAULT_RULE;
+    int pattern_w = 0, pattern_h = 0;
+    if (pattern_path && ReadPatternSize(pattern_path, &pattern_w, &pattern_h, pattern_rule))
+        return 1;
+    if (ParseRule(rule_text ? rule_text : pattern_rule, &rule))
+    {
+        printf("Invalid rule: %s\n", rule_text ? rule_text : pattern_rule);
+        return 1;
+    }
+    CompileRule();
+    if (!pattern_path)
+    {
+        // an empty run with no size gets the window's board
+        board_w = board_w > 0 ? board_w : COLS;
+        board_h = board_h > 0 ? board_h : ROWS;
+    }
+    else if (board_w < pattern_w || board_h < pattern_h)
+    {
+        // leave room around the pattern so it can grow before it hits the dead border
+        board_w = board_w ? board_w : pattern_w + 2 * DEFAULT_MARGIN;
+        board_h = board_h ? board_h : pattern_h + 2 * DEFAULT_MARGIN;
+        if (board_w < pattern_w)
+            board_w = pattern_w;
+        if (board_h < pattern_h)
+            board_h = pattern_h;
+    }
+
+    char rule_name[RULE_TEXT_SIZE];
+    FormatRule(&rule, rule_name);
+    printf("Pattern: %s (%dx%d), rule %s, board %dx%d, %d generations\n", pattern_path ? pattern_path : "(empty)", pattern_w, pattern_h, rule_name, board_w, board_h, gens);
+
+    int ran = 0;
+    for (int e = 0; e < num_engines; e++)
+    {
+        const ENGINE *engine = engines + e;
+        if (strcmp(engine_name, "all") && strcmp(engine_name, engine->name))
+            continue;
+        ran = 1;
+        if (engine->max_states < rule.states)
+        {
+            printf("%-8s skipped, supports %d states at most\n", engine->name, engine->max_states);
+            continue;
+        }
+
+        engine->init(board_h, board_w);
+        if (pattern_path && LoadPattern(pattern_path, engine, (board_h - pattern_h) / 2, (board_w - pattern_w) / 2))
+            return 1;
+
+        Uint64 start = SDL_GetPerformanceCounter();
+        for (int g = 0; g < gens; g++)
+            engine->step();
+        double secs = (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+
+        double cells = (double)board_w * board_h * gens;
+        printf("%-8s %10.3f s  %12.4g cells/s  %10.1f gens/s  population %llu\n", engine->name, secs, secs > 0 ? cells / secs : 0, secs > 0 ? gens / secs : 0, (unsigned long long)CountPopulation(engine));
+
+        if (save_path && !SavePattern(save_path, engine))
+            printf("Saved final state to %s\n", save_path);
+        engine->destroy();
+    }
+
+    if (!ran)
+    {
+        printf("Unknown engine: %s\n", engine_name);
+        return 1;
+    }
+    return 0;
+}
+
+// loads small patterns through the same reader as --pattern and compares their size and cells
+int CheckPatterns()
+{
+    const char *path = "game_of_life_check.tmp";
+    // pattern text, then the cells expected with one line per row
+    const char *cases[][2] = {
+        {"OO\n\nOO\n", "OO\n..\nOO"},
+        {"!Name: gap\nO\n\n\n.O", "O.\n..\n..\n.O"},
+        {"OO\r\n\r\nOO\r\n", "OO\n..\nOO"},
+        {"x = 3, y = 2\n2000000000o$99999999999999999999bo!", "OOO\n..."},
+        {"x = 2, y = 2\n99999999999999999999$o!", "..\n.."},
+    };
+    const int num_cases = sizeof(cases) / sizeof(cases[0]);
+
+    ParseRule(DEFAULT_RULE, &rule);
+    CompileRule();
+    const ENGINE *engine = FindEngine("table");
+    int failed = 0;
+    for (int k = 0; k < num_cases; k++)
+    {
+        FILE *file = fopen(path, "wb");
+        if (!file)
+        {
+            printf("Could not write pattern: %s\n", path);
+            return 1;
+        }
+        fputs(cases[k][0], file);
+        fclose(file);
+
+        int expect_w = 0, expect_h = 1, line_len = 0;
+        for (const char *e = cases[k][1]; *e; e++)
+        {
+            if (*e == '\n')
+            {
+                expect_h++;
+                line_len = 0;
+            }
+            else if (++line_len > expect_w)
+                expect_w = line_len;
+        }
+
+        char pattern_rule[RULE_TEXT_SIZE] = DEFAULT_RULE;
+        int width = 0, height = 0;
+        int ok = !ReadPatternSize(path, &width, &height, pattern_rule) && width == expect_w && height == expect_h;
+        if (ok)
+        {
+            engine->init(height, width);
+            ok = !LoadPattern(path, engine, 0, 0);
+            int row = 0, col = 0;
+            for (const char *e = cases[k][1]; ok && *e; e++)
+            {
+                if (*e == '\n')
+                {
+                    row++;
+                    col = 0;
+                    continue;
+                }
+                ok = engine->get(row, col++) == (*e == 'O' ? LIVE : DEAD);
+            }
+            engine->destroy();
+        }
+        printf("pattern %d: %dx%d, expected %dx%d, %s\n", k, width, height, expect_w, expect_h, ok ? "ok" : "FAILED");
+        failed += !ok;
+    }
+    remove(path);
+    return failed != 0;
+}
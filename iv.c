@@ -1,143 +1,1990 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <SDL2/SDL.h>
+#include "pixel_convert.h"
+#include "resample.h"
 
+#define READ_CHUNK (1 << 20)
+#define PAM_LINE_SIZE 256
+#define TILE_SIZE 256
+#define TILE_FORMAT SDL_PIXELFORMAT_ARGB8888
+#define TILE_BUCKETS 4096
+#define MAX_TILE_THREADS 16
+#define DEFAULT_CACHE_MB 512
+#define UPLOADS_PER_FRAME 16
+#define MAX_ZOOM 32.0
+#define ZOOM_STEP 1.25
+#define PAN_STEP 64
+#define MAX_OPEN_IMAGES 64
+#define IMAGE_CACHE_MB 256
+#define PREFETCH_AHEAD 2
+#define PREFETCH_BEHIND 1
+#define MAX_WANTED 256
+#define THUMB_SIZE 160
+#define THUMB_GAP 12
+#define THUMB_CELL (THUMB_SIZE + THUMB_GAP)
+#define RESAMPLE_MAX_PIXELS (1 << 25)
+
+enum TILE_STATE
+{
+    TILE_QUEUED,
+    TILE_BUILDING,
+    TILE_READY
+};
+
+enum IMAGE_STATE
+{
+    IMAGE_CLOSED,
+    IMAGE_QUEUED,
+    IMAGE_LOADING,
+    IMAGE_OPEN,
+    IMAGE_FAILED
+};
+
+enum DECODE_STATE
+{
+    DECODE_MAGIC,
+    DECODE_HEADER,
+    DECODE_PAM_HEADER,
+    DECODE_PIXELS,
+    DECODE_DONE,
+    DECODE_ERROR
+};
+
+// Incremental Netpbm decoder for P1-P7. Bytes are pushed in whatever pieces they
+// arrive, and each row is converted to RGB24 as soon as it is complete. When the
+// input is one contiguous buffer (a mapped file), binary payloads stay where they
+// are and readPixels converts just the pixels that are asked for.
 typedef struct
 {
-    int width, height;
-} DIMENSIONS;
+    int state, format;
+    int width, height, depth, max_val;
+    int contiguous;
 
+    // header tokens
+    int fields[3], num_fields, value, in_value, in_comment;
+    char line[PAM_LINE_SIZE];
+    int line_len;
+
+    // payload
+    int sample_bytes;
+    size_t row_bytes, row_fill;
+    Uint8 *row_buf;
+    size_t row_buf_size;
+    int ascii_x, ascii_channel;
+    int rows_done;
+    Uint8 *rgb;
+    size_t rgb_size;
+    const Uint8 *payload;
+    Uint8 *scale;
+    int scale_size;
+} NETPBM_DECODER;
+
+// A file or pipe decoded on a loader thread. Each image is published with a copy of
+// the decoder (source) once its header is read, and rows become visible as they
+// arrive. A finished image is held until the viewer releases it, since the next one
+// reuses its buffers, unless the stream is single and stops after its first image.
 typedef struct
 {
-    unsigned char r, g, b;
-} RGB_COLOR;
+    SDL_mutex *mutex;
+    SDL_cond *released_cond;
+    const char *path;
+    int fd, single;
+    Uint8 *map;
+    size_t map_size;
+    NETPBM_DECODER decoder;
 
-int main(int argc, char **argv)
+    // published under the mutex
+    NETPBM_DECODER source;
+    int image, rows_ready, complete, finished, released, quit;
+} IMAGE_STREAM;
+
+// one file of the list; its stream is open from when it is queued until it is evicted
+typedef struct
 {
-    DIMENSIONS *getImageDimensions(FILE *);
-    int getMaxVal(FILE *);
-    RGB_COLOR *getRGB(FILE *);
+    char *path;
+    int state, image;
+    IMAGE_STREAM stream;
+    Uint64 last_used;
+} IMAGE_ENTRY;
 
-    if (argc != 2)
-    {
-        printf("Usage: ./iv <PPM file>\n");
-        return 0;
-    }
+// The files being browsed. Loader threads decode the queued ones in the background,
+// so that the neighbours of the current image and the thumbnails in view are ready
+// by the time they are shown.
+typedef struct
+{
+    SDL_mutex *mutex;
+    SDL_cond *work;
+    SDL_Thread *threads[MAX_TILE_THREADS];
+    int num_threads, quit;
+    IMAGE_ENTRY *entries;
+    int num_entries, current;
+    int *queue;
+    int queue_head, queue_len;
+} LIBRARY;
 
-    printf("This is an image viewer for raw PPM files\n");
-    printf("Viewing File: %s\n", argv[1]);
+typedef struct TILE TILE;
 
-    FILE *fimg = fopen(argv[1], "rb");
-    DIMENSIONS *dims = getImageDimensions(fimg);
-    printf("Width: %d, Height: %d\n", dims->width, dims->height);
-    int max_val = getMaxVal(fimg);
-    printf("Maximum Color Value: %d\n", max_val);
+// a TILE_SIZE square (smaller at the edges) of one level of the mip pyramid, kept
+// in the cache in TILE_FORMAT and, once drawn, as a texture
+struct TILE
+{
+    int image, level, tx, ty, width, height;
+    int state, pins, rows, complete, texture_stale;
+    Uint64 requested, last_used;
+    Uint8 *pixels;
+    SDL_Texture *texture;
+    TILE *next;
+};
 
-    SDL_Init(SDL_INIT_EVERYTHING);
-    SDL_Window *window = SDL_CreateWindow("PPM Image Viewer", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, dims->width, dims->height, 0);
-    SDL_Surface *surface = SDL_GetWindowSurface(window);
+// what the tiles of one image are built from; the size stays known once the pixels are gone
+typedef struct
+{
+    NETPBM_DECODER decoder;
+    int width, height, levels, rows_ready, valid;
+} TILE_SOURCE;
 
-    SDL_Rect pixel_rect = {0, 0, 1, 1};
-    RGB_COLOR *rgb = NULL;
+// Level 0 of an image's pyramid is the image and every level above halves the one
+// below. Tiles are built on request by worker threads, from the four tiles below when
+// those are cached and by sampling the source otherwise. Once the cache holds more
+// than cap bytes, the tiles used least recently are evicted, whichever image they
+// belong to.
+typedef struct
+{
+    SDL_mutex *mutex;
+    SDL_cond *work, *idle;
+    SDL_Thread *threads[MAX_TILE_THREADS];
+    int num_threads, busy, quit;
+    TILE *buckets[TILE_BUCKETS];
+    TILE **queue;
+    int queue_len, queue_cap;
+    size_t bytes, cap;
+    TILE_SOURCE *sources;
+    int num_sources;
+    PIXEL_CONVERSION to_tile;
+} TILE_CACHE;
+
+// image coordinate at the window's top-left corner and window pixels per image pixel
+typedef struct
+{
+    double x, y, scale;
+    int fit;
+} VIEW;
 
-    for (int y = 0; y < dims->height; y++)
+// the current image resampled to the size it is fitted to the window at, which is
+// drawn instead of its tiles while the view stays fitted
+typedef struct
+{
+    SDL_Texture *texture;
+    int image, entry_image, width, height, filter;
+} RESAMPLED;
+
+void initDecoder(NETPBM_DECODER *decoder, int contiguous);
+void resetDecoder(NETPBM_DECODER *decoder);
+void freeDecoder(NETPBM_DECODER *decoder);
+size_t feedDecoder(NETPBM_DECODER *decoder, const Uint8 *data, size_t len);
+void finishDecoder(NETPBM_DECODER *decoder);
+int headerByte(NETPBM_DECODER *decoder, Uint8 c);
+int pamLine(NETPBM_DECODER *decoder);
+int beginPixels(NETPBM_DECODER *decoder, const Uint8 *next);
+void convertRow(NETPBM_DECODER *decoder, const Uint8 *src);
+void convertSamples(NETPBM_DECODER *decoder, const Uint8 *src, int x, int count, Uint8 *dst);
+void readPixels(NETPBM_DECODER *decoder, int x, int y, int count, Uint8 *dst);
+void asciiSample(NETPBM_DECODER *decoder, int value);
+int openStream(const char *path, IMAGE_STREAM *stream);
+void closeStream(IMAGE_STREAM *stream);
+int streamMain(void *data);
+void initTileCache(TILE_CACHE *cache, int num_images, int num_threads, size_t cap);
+void freeTileCache(TILE_CACHE *cache);
+void setTileImage(TILE_CACHE *cache, int image, const NETPBM_DECODER *decoder);
+void removeTileImage(TILE_CACHE *cache, int image);
+void drainTiles(TILE_CACHE *cache);
+void dropTiles(TILE_CACHE *cache, int image);
+void beginTileFrame(TILE_CACHE *cache);
+TILE **tileBucket(TILE_CACHE *cache, int image, int level, int tx, int ty);
+TILE *findTile(TILE_CACHE *cache, int image, int level, int tx, int ty);
+TILE *requestTile(TILE_CACHE *cache, int image, int level, int tx, int ty, Uint64 frame);
+void freeTile(TILE_CACHE *cache, TILE *tile);
+void levelSize(const TILE_SOURCE *source, int level, int *width, int *height);
+int tileMain(void *data);
+void buildTile(TILE_SOURCE *source, const PIXEL_CONVERSION *to_tile, TILE *tile, TILE *children[4], int rows_ready,
+               Uint8 *pixels);
+int visibleTiles(const TILE_SOURCE *source, const VIEW *view, int win_w, int win_h, int *level, SDL_Point **order);
+void requestView(TILE_CACHE *cache, int image, const VIEW *view, int win_w, int win_h, Uint64 frame);
+void drawImage(SDL_Renderer *renderer, TILE_CACHE *cache, int image, const VIEW *view, int win_w, int win_h, Uint64 frame);
+int drawTile(SDL_Renderer *renderer, TILE_CACHE *cache, TILE *tile, const SDL_Rect *src, const SDL_FRect *dst, Uint64 frame,
+             int *uploads);
+void evictTiles(TILE_CACHE *cache, Uint64 frame);
+int hasThumbnail(TILE_CACHE *cache, int image);
+void fitView(VIEW *view, const TILE_SOURCE *source, int win_w, int win_h);
+void zoomView(VIEW *view, double factor, int at_x, int at_y);
+void clampView(VIEW *view, const TILE_SOURCE *source, int win_w, int win_h);
+void readSourceRow(void *data, int y, Uint8 *row);
+int updateResampled(SDL_Renderer *renderer, RESAMPLED *resampled, TILE_SOURCE *source, int image, int entry_image,
+                    const VIEW *view, int filter);
+void initLibrary(LIBRARY *library);
+void addEntry(LIBRARY *library, const char *path);
+void addPath(LIBRARY *library, const char *path);
+int compareEntries(const void *a, const void *b);
+void startLibrary(LIBRARY *library, int num_threads);
+int stopLibrary(LIBRARY *library);
+void freeLibrary(LIBRARY *library);
+int loaderMain(void *data);
+void requestImages(LIBRARY *library, const int *wanted, int count, Uint64 frame);
+void syncImages(LIBRARY *library, TILE_CACHE *cache);
+void evictImages(LIBRARY *library, TILE_CACHE *cache, Uint64 frame);
+size_t entryBytes(IMAGE_ENTRY *entry);
+int gridCell(int x, int y, int columns);
+void drawGrid(SDL_Renderer *renderer, TILE_CACHE *cache, LIBRARY *library, int scroll, int columns, int win_h, Uint64 frame);
+
+int main(int argc, char **argv)
+{
+    LIBRARY library;
+    int num_threads = SDL_min(SDL_GetCPUCount(), MAX_TILE_THREADS), cache_mb = DEFAULT_CACHE_MB, filter = FILTER_LANCZOS3;
+    initLibrary(&library);
+    for (int i = 1; i < argc; i++)
     {
-        for (int x = 0; x < dims->width; x++)
+        if (!strcmp(argv[i], "--threads") && i + 1 < argc)
+            num_threads = SDL_clamp(atoi(argv[++i]), 1, MAX_TILE_THREADS);
+        else if (!strcmp(argv[i], "--cache-mb") && i + 1 < argc)
+            cache_mb = SDL_max(atoi(argv[++i]), 16);
+        else if (!strcmp(argv[i], "--filter") && i + 1 < argc)
         {
-            pixel_rect.x = x;
-            pixel_rect.y = y;
-
-            rgb = getRGB(fimg);
-            int rgb_color_map = SDL_MapRGB(surface->format, rgb->r, rgb->g, rgb->b);
-            SDL_FillRect(surface, &pixel_rect, rgb_color_map);
+            // anything else leaves fitted images to the tiles
+            i++;
+            for (filter = 0; filter < NUM_FILTERS && strncasecmp(argv[i], filter_names[filter], 4); filter++)
+                ;
         }
+        else if (!strcmp(argv[i], "--bench-convert"))
+        {
+            benchPixelConversion(4096, 4096);
+            return 0;
+        }
+        else if (!strcmp(argv[i], "--bench-resample"))
+        {
+            benchResample(1920, 1280);
+            return 0;
+        }
+        else
+            addPath(&library, argv[i]);
+    }
+    if (!library.num_entries && !isatty(STDIN_FILENO))
+        addPath(&library, "-");
+    if (!library.num_entries)
+    {
+        printf("Usage: ./iv [--threads N] [--cache-mb N] [--filter bilinear|bicubic|lanczos|none] <Netpbm file or directory>...\n");
+        printf("       <command> | ./iv [--threads N] [--cache-mb N] [--filter ...] [-]\n");
+        printf("       ./iv --bench-convert | --bench-resample\n");
+        return 0;
     }
+    printf("This is an image viewer for Netpbm (PBM, PGM, PPM and PAM) files\n");
+    if (library.num_entries == 1)
+        printf("Viewing File: %s\n", strcmp(library.entries[0].path, "-") ? library.entries[0].path : "<stdin>");
+    else
+        printf("Viewing %d files\n", library.num_entries);
+    printf("Wheel or +/- to zoom, drag or arrows to pan, F to fit, 1 for actual size, G for the thumbnail grid\n");
+    printf("N/PageDown/Space for the next image, P/PageUp/Backspace for the previous one\n");
+    printf("R to change the filter used to fit images to the window\n");
 
-    SDL_UpdateWindowSurface(window);
+    SDL_Init(SDL_INIT_EVERYTHING);
+    SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "1");
+    TILE_CACHE cache;
+    initTileCache(&cache, library.num_entries, num_threads, (size_t)cache_mb << 20);
+    startLibrary(&library, num_threads);
+    SDL_Window *window = NULL;
+    SDL_Renderer *renderer = NULL;
+    VIEW view = {0, 0, 1, 1};
+    int shown = -1, shown_image = -1, timed = 0, loaded = 0, waiting_next = 0, win_w = 0, win_h = 0, dragging = 0;
+    int grid = 0, grid_scroll = 0;
+    RESAMPLED resampled = {NULL, -1, -1, 0, 0, -1};
+    Uint64 frame = 0, start = SDL_GetPerformanceCounter();
 
     int running = 1;
     while (running)
     {
+        frame++;
+        int columns = SDL_max(1, (win_w - THUMB_GAP) / THUMB_CELL), current = library.current;
         SDL_Event event;
         while (SDL_PollEvent(&event))
         {
-            if (event.type == SDL_QUIT)
+            switch (event.type)
+            {
+            case SDL_QUIT:
                 running = 0;
+                break;
+            case SDL_WINDOWEVENT:
+                if (event.window.event == SDL_WINDOWEVENT_SIZE_CHANGED)
+                {
+                    SDL_GetRendererOutputSize(renderer, &win_w, &win_h);
+                    if (view.fit)
+                        fitView(&view, &cache.sources[current], win_w, win_h);
+                }
+                break;
+            case SDL_MOUSEWHEEL:
+                if (grid)
+                    grid_scroll -= event.wheel.y * THUMB_CELL / 2;
+                else if (event.wheel.y)
+                {
+                    int mx, my;
+                    SDL_GetMouseState(&mx, &my);
+                    zoomView(&view, event.wheel.y > 0 ? ZOOM_STEP : 1 / ZOOM_STEP, mx, my);
+                }
+                break;
+            case SDL_MOUSEBUTTONDOWN:
+                if (grid && event.button.button == SDL_BUTTON_LEFT)
+                {
+                    int cell = gridCell(event.button.x, event.button.y + grid_scroll, columns);
+                    if (cell >= 0 && cell < library.num_entries)
+                    {
+                        current = cell;
+                        grid = 0;
+                    }
+                }
+                else
+                    dragging |= event.button.button == SDL_BUTTON_LEFT;
+                break;
+            case SDL_MOUSEBUTTONUP:
+                dragging &= event.button.button != SDL_BUTTON_LEFT;
+                break;
+            case SDL_MOUSEMOTION:
+                if (dragging && !grid)
+                {
+                    view.x -= event.motion.xrel / view.scale;
+                    view.y -= event.motion.yrel / view.scale;
+                    view.fit = 0;
+                }
+                break;
+            case SDL_KEYDOWN:
+            {
+                SDL_Keycode key = event.key.keysym.sym;
+                if (key == SDLK_ESCAPE)
+                    running = 0;
+                else if (key == SDLK_g)
+                    grid = !grid;
+                else if (key == SDLK_HOME)
+                    current = 0;
+                else if (key == SDLK_END)
+                    current = library.num_entries - 1;
+                else if (grid)
+                {
+                    // arrows move the selection around the grid, return opens it
+                    if (key == SDLK_LEFT || key == SDLK_BACKSPACE)
+                        current--;
+                    else if (key == SDLK_RIGHT || key == SDLK_SPACE)
+                        current++;
+                    else if (key == SDLK_UP)
+                        current -= columns;
+                    else if (key == SDLK_DOWN)
+                        current += columns;
+                    else if (key == SDLK_PAGEUP)
+                        current -= columns * SDL_max(win_h / THUMB_CELL, 1);
+                    else if (key == SDLK_PAGEDOWN)
+                        current += columns * SDL_max(win_h / THUMB_CELL, 1);
+                    else if (key == SDLK_RETURN)
+                        grid = 0;
+                    current = SDL_clamp(current, 0, library.num_entries - 1);
+                    grid_scroll = SDL_clamp(grid_scroll, (current / columns + 1) * THUMB_CELL + THUMB_GAP - win_h,
+                                            current / columns * THUMB_CELL);
+                }
+                else if (key == SDLK_n || key == SDLK_PAGEDOWN || key == SDLK_SPACE)
+                {
+                    IMAGE_STREAM *stream = &library.entries[current].stream;
+                    if (library.num_entries > 1)
+                        current = SDL_min(current + 1, library.num_entries - 1);
+                    // the reader may only reuse its buffers once no tile is being built from them
+                    else if (shown_image >= 0 && loaded && !waiting_next)
+                    {
+                        drainTiles(&cache);
+                        SDL_LockMutex(stream->mutex);
+                        stream->released = shown_image + 1;
+                        SDL_CondSignal(stream->released_cond);
+                        SDL_UnlockMutex(stream->mutex);
+                        waiting_next = 1;
+                        start = SDL_GetPerformanceCounter();
+                    }
+                }
+                else if (key == SDLK_p || key == SDLK_PAGEUP || key == SDLK_BACKSPACE)
+                    current = SDL_max(current - 1, 0);
+                else if (key == SDLK_PLUS || key == SDLK_EQUALS || key == SDLK_KP_PLUS)
+                    zoomView(&view, ZOOM_STEP, win_w / 2, win_h / 2);
+                else if (key == SDLK_MINUS || key == SDLK_KP_MINUS)
+                    zoomView(&view, 1 / ZOOM_STEP, win_w / 2, win_h / 2);
+                else if (key == SDLK_1)
+                    zoomView(&view, 1 / view.scale, win_w / 2, win_h / 2);
+                else if (key == SDLK_f)
+                    fitView(&view, &cache.sources[current], win_w, win_h);
+                else if (key == SDLK_r)
+                {
+                    filter = (filter + 1) % (NUM_FILTERS + 1);
+                    printf("Fitting with %s\n", filter < NUM_FILTERS ? filter_names[filter] : "the tiles");
+                }
+                else if (key == SDLK_LEFT || key == SDLK_RIGHT || key == SDLK_UP || key == SDLK_DOWN)
+                {
+                    view.x += ((key == SDLK_RIGHT) - (key == SDLK_LEFT)) * PAN_STEP / view.scale;
+                    view.y += ((key == SDLK_DOWN) - (key == SDLK_UP)) * PAN_STEP / view.scale;
+                    view.fit = 0;
+                }
+                break;
+            }
+            }
+        }
+
+        // the images worth having decoded, least important first: the thumbnails in
+        // view that are not built yet, then the neighbours, then the current image
+        library.current = current;
+        int wanted[MAX_WANTED], num_wanted = 0;
+        if (grid && win_w)
+        {
+            grid_scroll = SDL_clamp(grid_scroll, 0, SDL_max(0, (library.num_entries + columns - 1) / columns * THUMB_CELL + THUMB_GAP - win_h));
+            int first = grid_scroll / THUMB_CELL * columns;
+            int last = SDL_min((grid_scroll + win_h) / THUMB_CELL * columns + columns, library.num_entries) - 1;
+            for (int i = last; i >= first && num_wanted < MAX_WANTED - PREFETCH_AHEAD - PREFETCH_BEHIND - 1; i--)
+            {
+                if (!hasThumbnail(&cache, i))
+                    wanted[num_wanted++] = i;
+            }
+        }
+        for (int i = PREFETCH_AHEAD; i > 0; i--)
+        {
+            if (i <= PREFETCH_BEHIND && current - i >= 0)
+                wanted[num_wanted++] = current - i;
+            if (current + i < library.num_entries)
+                wanted[num_wanted++] = current + i;
         }
-        SDL_Delay(10);
+        wanted[num_wanted++] = current;
+        requestImages(&library, wanted, num_wanted, frame);
+        syncImages(&library, &cache);
+
+        IMAGE_ENTRY *entry = &library.entries[current];
+        TILE_SOURCE *source = &cache.sources[current];
+        SDL_LockMutex(library.mutex);
+        int state = entry->state, entry_image = entry->image;
+        SDL_UnlockMutex(library.mutex);
+        int complete = 0, finished = 0;
+        if (state == IMAGE_LOADING || state == IMAGE_OPEN)
+        {
+            SDL_LockMutex(entry->stream.mutex);
+            complete = entry->stream.complete;
+            finished = entry->stream.finished;
+            SDL_UnlockMutex(entry->stream.mutex);
+        }
+        if (current != timed)
+        {
+            start = SDL_GetPerformanceCounter();
+            timed = current;
+        }
+
+        if (!window)
+        {
+            // nothing to look at until some image has started
+            if (state == IMAGE_FAILED || (finished && entry_image < 0))
+            {
+                if (current + 1 < library.num_entries)
+                    library.current++;
+                else
+                {
+                    printf("No images to show\n");
+                    running = 0;
+                }
+                continue;
+            }
+            if (entry_image < 0)
+            {
+                SDL_Delay(5);
+                continue;
+            }
+            // as large as the image, up to most of the screen
+            SDL_Rect bounds = {0, 0, 1280, 720};
+            SDL_GetDisplayUsableBounds(0, &bounds);
+            double fit = SDL_min(1.0, SDL_min(bounds.w * 0.9 / source->width, bounds.h * 0.9 / source->height));
+            window = SDL_CreateWindow("PPM Image Viewer", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
+                                      SDL_max((int)(source->width * fit), 64), SDL_max((int)(source->height * fit), 64),
+                                      SDL_WINDOW_RESIZABLE);
+            renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+            SDL_GetRendererOutputSize(renderer, &win_w, &win_h);
+        }
+
+        if (entry_image >= 0 && (current != shown || entry_image != shown_image))
+        {
+            printf("Image %d: %s, P%d, Width: %d, Height: %d, Maximum Color Value: %d, %d mip levels\n",
+                   library.num_entries > 1 ? current + 1 : entry_image + 1, strcmp(entry->path, "-") ? entry->path : "<stdin>",
+                   source->decoder.format,
+                   source->width, source->height, source->decoder.max_val, source->levels);
+            shown = current;
+            shown_image = entry_image;
+            loaded = waiting_next = 0;
+            fitView(&view, source, win_w, win_h);
+        }
+        if (shown == current && complete && !loaded)
+        {
+            printf("Loaded in %.1f ms\n", (double)(SDL_GetPerformanceCounter() - start) * 1000 / SDL_GetPerformanceFrequency());
+            start = SDL_GetPerformanceCounter();
+            loaded = 1;
+        }
+        // no further image: the released one is still intact, so keep viewing it
+        if (waiting_next && finished && entry_image == shown_image)
+        {
+            printf("No more images\n");
+            waiting_next = 0;
+        }
+
+        int smooth = 0;
+        char title[512];
+        if (shown == current)
+        {
+            clampView(&view, source, win_w, win_h);
+            smooth = !grid && !waiting_next && view.fit && filter < NUM_FILTERS &&
+                     updateResampled(renderer, &resampled, source, current, entry_image, &view, filter);
+            snprintf(title, sizeof(title), "PPM Image Viewer - %s (%d/%d) - %dx%d - %.0f%%%s%s", entry->path, current + 1,
+                     library.num_entries, source->width, source->height, view.scale * 100, smooth ? " - " : "",
+                     smooth ? filter_names[filter] : "");
+        }
+        else
+            snprintf(title, sizeof(title), "PPM Image Viewer - %s (%d/%d)", entry->path, current + 1, library.num_entries);
+        SDL_SetWindowTitle(window, title);
+
+        beginTileFrame(&cache);
+        // the neighbours' tiles are wanted first, as they would be shown, so that
+        // stepping to them is immediate
+        for (int i = 0; i < num_wanted - 1 && !grid; i++)
+        {
+            TILE_SOURCE *neighbour = &cache.sources[wanted[i]];
+            if (neighbour->valid && wanted[i] != current)
+            {
+                VIEW fit;
+                fitView(&fit, neighbour, win_w, win_h);
+                requestView(&cache, wanted[i], &fit, win_w, win_h, frame);
+            }
+        }
+
+        SDL_SetRenderDrawColor(renderer, 32, 32, 32, 255);
+        SDL_RenderClear(renderer);
+        if (grid)
+            drawGrid(renderer, &cache, &library, grid_scroll, columns, win_h, frame);
+        else if (smooth)
+        {
+            SDL_Rect dst = {(int)SDL_floor(-view.x * view.scale + 0.5), (int)SDL_floor(-view.y * view.scale + 0.5),
+                            resampled.width, resampled.height};
+            SDL_RenderCopy(renderer, resampled.texture, NULL, &dst);
+        }
+        else if (shown == current && !waiting_next)
+            drawImage(renderer, &cache, current, &view, win_w, win_h, frame);
+        SDL_RenderPresent(renderer);
+        evictTiles(&cache, frame);
+        evictImages(&library, &cache, frame);
     }
 
-    fclose(fimg);
-    SDL_DestroyWindow(window);
+    // a reader blocked on a pipe that never closes cannot be joined
+    freeTileCache(&cache);
+    if (stopLibrary(&library))
+        freeLibrary(&library);
+
+    if (resampled.texture)
+        SDL_DestroyTexture(resampled.texture);
+    if (renderer)
+        SDL_DestroyRenderer(renderer);
+    if (window)
+        SDL_DestroyWindow(window);
     SDL_Quit();
     return 0;
 }
 
-DIMENSIONS *getImageDimensions(FILE *fimg)
+void initDecoder(NETPBM_DECODER *decoder, int contiguous)
 {
-    DIMENSIONS *dims = (DIMENSIONS *)malloc(sizeof(DIMENSIONS));
-    memset(dims, 0, sizeof(dims));
+    memset(decoder, 0, sizeof(NETPBM_DECODER));
+    decoder->contiguous = contiguous;
+}
 
-    int buff_byte = 0;
+// starts over for the next image in the stream, keeping the buffers
+void resetDecoder(NETPBM_DECODER *decoder)
+{
+    decoder->state = DECODE_MAGIC;
+    decoder->format = decoder->width = decoder->height = decoder->depth = decoder->max_val = 0;
+    decoder->num_fields = decoder->value = decoder->in_value = decoder->in_comment = decoder->line_len = 0;
+    decoder->row_fill = 0;
+    decoder->ascii_x = decoder->ascii_channel = decoder->rows_done = 0;
+    decoder->payload = NULL;
+}
+
+void freeDecoder(NETPBM_DECODER *decoder)
+{
+    free(decoder->row_buf);
+    free(decoder->rgb);
+    free(decoder->scale);
+}
 
-    // Skips Magic Number
-    do
+// Consumes bytes until the current image is complete or the input runs out, and
+// returns how many were used. Anything left over belongs to the next image.
+size_t feedDecoder(NETPBM_DECODER *decoder, const Uint8 *data, size_t len)
+{
+    size_t i = 0;
+    while (i < len && decoder->state < DECODE_DONE)
     {
-        fread(&buff_byte, 1, 1, fimg);
-    } while (buff_byte != '\n');
+        Uint8 c = data[i];
+        switch (decoder->state)
+        {
+        case DECODE_MAGIC:
+            // whitespace may separate the images of a stream
+            if (decoder->line_len == 0 && SDL_isspace(c))
+                break;
+            decoder->line[decoder->line_len++] = c;
+            if (decoder->line_len == 2)
+            {
+                if (decoder->line[0] != 'P' || decoder->line[1] < '1' || decoder->line[1] > '7')
+                {
+                    decoder->state = DECODE_ERROR;
+                    return i;
+                }
+                decoder->format = decoder->line[1] - '0';
+                decoder->line_len = 0;
+                decoder->state = decoder->format == 7 ? DECODE_PAM_HEADER : DECODE_HEADER;
+            }
+            break;
+        case DECODE_HEADER:
+            if (!headerByte(decoder, c))
+                return i;
+            if (decoder->state == DECODE_PIXELS && !beginPixels(decoder, data + i + 1))
+                return i;
+            break;
+        case DECODE_PAM_HEADER:
+            if (c != '\n')
+            {
+                if (decoder->line_len < PAM_LINE_SIZE - 1)
+                    decoder->line[decoder->line_len++] = c;
+                break;
+            }
+            decoder->line[decoder->line_len] = 0;
+            decoder->line_len = 0;
+            if (!pamLine(decoder))
+                return i;
+            if (decoder->state == DECODE_PIXELS && !beginPixels(decoder, data + i + 1))
+                return i;
+            break;
+        case DECODE_PIXELS:
+            if (decoder->sample_bytes == 0)
+            {
+                // plain formats: decimal samples, except P1 where every 0 or 1 is a sample
+                if (decoder->in_comment)
+                    decoder->in_comment = c != '\n';
+                else if (decoder->format == 1 && (c == '0' || c == '1'))
+                    asciiSample(decoder, c - '0');
+                else if (SDL_isdigit(c))
+                {
+                    decoder->value = SDL_min(decoder->value * 10 + c - '0', 1 << 20);
+                    decoder->in_value = 1;
+                }
+                else
+                {
+                    if (decoder->in_value)
+                        asciiSample(decoder, decoder->value);
+                    decoder->value = decoder->in_value = 0;
+                    decoder->in_comment = c == '#';
+                }
+                break;
+            }
+            if (decoder->payload)
+            {
+                // the payload stays in the caller's buffer; only count the rows
+                size_t take = SDL_min(len - i, decoder->row_bytes * decoder->height - decoder->row_fill);
+                decoder->row_fill += take;
+                decoder->rows_done = decoder->row_fill / decoder->row_bytes;
+                if (decoder->rows_done == decoder->height)
+                    decoder->state = DECODE_DONE;
+                i += take;
+                continue;
+            }
+            if (decoder->row_fill == 0 && len - i >= decoder->row_bytes)
+            {
+                // whole rows straight from the input
+                convertRow(decoder, data + i);
+                i += decoder->row_bytes;
+                continue;
+            }
+            size_t take = SDL_min(len - i, decoder->row_bytes - decoder->row_fill);
+            memcpy(decoder->row_buf + decoder->row_fill, data + i, take);
+            decoder->row_fill += take;
+            i += take;
+            if (decoder->row_fill == decoder->row_bytes)
+            {
+                decoder->row_fill = 0;
+                convertRow(decoder, decoder->row_buf);
+            }
+            continue;
+        }
+        i++;
+    }
+    return i;
+}
 
-    // Skips Optional Comment Line
-    fread(&buff_byte, 1, 1, fimg);
-    if (buff_byte == '#')
+// end of input: a plain image may end with its last sample and no whitespace after it
+void finishDecoder(NETPBM_DECODER *decoder)
+{
+    if (decoder->state == DECODE_PIXELS && decoder->sample_bytes == 0 && decoder->in_value)
+        asciiSample(decoder, decoder->value);
+    decoder->in_value = 0;
+}
+
+// P1-P6 header: width, height and (except for bitmaps) maxval, separated by any
+// whitespace and # comments. The binary payload starts after the single whitespace
+// character that ends the last field.
+int headerByte(NETPBM_DECODER *decoder, Uint8 c)
+{
+    int num_fields = decoder->format == 1 || decoder->format == 4 ? 2 : 3;
+    if (decoder->in_comment)
     {
-        do
+        decoder->in_comment = c != '\n' && c != '\r';
+        return 1;
+    }
+    if (SDL_isdigit(c))
+    {
+        if (decoder->value >= 1 << 24)
+        {
+            decoder->state = DECODE_ERROR;
+            return 0;
+        }
+        decoder->value = decoder->value * 10 + c - '0';
+        decoder->in_value = 1;
+        return 1;
+    }
+    if (c != '#' && !SDL_isspace(c))
+    {
+        decoder->state = DECODE_ERROR;
+        return 0;
+    }
+    if (decoder->in_value)
+    {
+        decoder->fields[decoder->num_fields++] = decoder->value;
+        decoder->value = decoder->in_value = 0;
+        if (decoder->num_fields == num_fields)
+        {
+            if (c == '#')
+            {
+                decoder->state = DECODE_ERROR;
+                return 0;
+            }
+            decoder->width = decoder->fields[0];
+            decoder->height = decoder->fields[1];
+            decoder->max_val = num_fields == 3 ? decoder->fields[2] : 1;
+            decoder->depth = decoder->format == 3 || decoder->format == 6 ? 3 : 1;
+            decoder->state = DECODE_PIXELS;
+            return 1;
+        }
+    }
+    decoder->in_comment = c == '#';
+    return 1;
+}
+
+// one line of a PAM header: "WIDTH 640", "TUPLTYPE RGB", ... up to "ENDHDR"
+int pamLine(NETPBM_DECODER *decoder)
+{
+    char key[16];
+    int value;
+    if (decoder->line[0] == '#' || sscanf(decoder->line, "%15s", key) != 1)
+        return 1;
+    if (!strcmp(key, "ENDHDR"))
+    {
+        decoder->state = DECODE_PIXELS;
+        return 1;
+    }
+    if (!strcmp(key, "TUPLTYPE"))
+        return 1;
+    if (sscanf(decoder->line, "%15s %d", key, &value) == 2 && value > 0 && value < 1 << 24)
+    {
+        if (!strcmp(key, "WIDTH"))
+            decoder->width = value;
+        else if (!strcmp(key, "HEIGHT"))
+            decoder->height = value;
+        else if (!strcmp(key, "DEPTH"))
+            decoder->depth = value;
+        else if (!strcmp(key, "MAXVAL"))
+            decoder->max_val = value;
+        return 1;
+    }
+    decoder->state = DECODE_ERROR;
+    return 0;
+}
+
+// validates the header and prepares the row buffers and the sample lookup table;
+// next is where the payload starts in the current input
+int beginPixels(NETPBM_DECODER *decoder, const Uint8 *next)
+{
+    if (decoder->width <= 0 || decoder->height <= 0 || decoder->max_val <= 0 || decoder->max_val > 65535 ||
+        decoder->depth < 1 || decoder->depth > 4)
+    {
+        decoder->state = DECODE_ERROR;
+        return 0;
+    }
+
+    decoder->sample_bytes = decoder->format <= 3 ? 0 : decoder->max_val > 255 ? 2 : 1;
+    decoder->row_bytes = decoder->format == 4 ? (size_t)(decoder->width + 7) / 8 : (size_t)decoder->width * decoder->depth * decoder->sample_bytes;
+    decoder->row_fill = 0;
+    decoder->value = decoder->in_value = decoder->in_comment = 0;
+
+    // nothing is converted up front when the whole binary payload stays in memory
+    size_t rgb_size = (size_t)decoder->width * decoder->height * 3;
+    if (decoder->contiguous && decoder->sample_bytes)
+    {
+        decoder->payload = next;
+        rgb_size = 0;
+    }
+    else if (rgb_size > decoder->rgb_size)
+    {
+        free(decoder->rgb);
+        decoder->rgb = (Uint8 *)malloc(rgb_size);
+        decoder->rgb_size = decoder->rgb ? rgb_size : 0;
+    }
+    if (!decoder->payload && decoder->row_bytes > decoder->row_buf_size)
+    {
+        free(decoder->row_buf);
+        decoder->row_buf = (Uint8 *)malloc(decoder->row_bytes);
+        decoder->row_buf_size = decoder->row_buf ? decoder->row_bytes : 0;
+    }
+    if (decoder->max_val + 1 > decoder->scale_size)
+    {
+        free(decoder->scale);
+        decoder->scale = (Uint8 *)malloc(decoder->max_val + 1);
+        decoder->scale_size = decoder->scale ? decoder->max_val + 1 : 0;
+    }
+    if ((!decoder->payload && (!decoder->rgb || (decoder->sample_bytes && !decoder->row_buf))) || !decoder->scale)
+    {
+        decoder->state = DECODE_ERROR;
+        return 0;
+    }
+    // samples of any depth map to 8 bits; bitmaps store 1 for black
+    for (int i = 0; i <= decoder->max_val; i++)
+        decoder->scale[i] = (i * 255 + decoder->max_val / 2) / decoder->max_val;
+    if (decoder->format == 1 || decoder->format == 4)
+    {
+        decoder->scale[0] = 255;
+        decoder->scale[1] = 0;
+    }
+    if (rgb_size)
+        memset(decoder->rgb, 0, rgb_size);
+    return 1;
+}
+
+void convertRow(NETPBM_DECODER *decoder, const Uint8 *src)
+{
+    convertSamples(decoder, src, 0, decoder->width, decoder->rgb + (size_t)decoder->rows_done * decoder->width * 3);
+    if (++decoder->rows_done == decoder->height)
+        decoder->state = DECODE_DONE;
+}
+
+// count binary samples of one row, starting at pixel x, to RGB24; gray is replicated
+// and alpha channels are dropped
+void convertSamples(NETPBM_DECODER *decoder, const Uint8 *src, int x, int count, Uint8 *dst)
+{
+    const Uint8 *scale = decoder->scale;
+    int depth = decoder->depth, max_val = decoder->max_val;
+
+    if (decoder->format == 4)
+    {
+        for (int i = x; i < x + count; i++, dst += 3)
+            dst[0] = dst[1] = dst[2] = scale[src[i / 8] >> (7 - i % 8) & 1];
+    }
+    else if (decoder->sample_bytes == 1)
+    {
+        src += (size_t)x * depth;
+        if (depth == 3 && max_val == 255)
         {
-            fread(&buff_byte, 1, 1, fimg);
-        } while (buff_byte != '\n');
+            memcpy(dst, src, (size_t)count * 3);
+            return;
+        }
+        for (int i = 0; i < count; i++, src += depth, dst += 3)
+        {
+            if (depth < 3)
+                dst[0] = dst[1] = dst[2] = scale[SDL_min(src[0], max_val)];
+            else
+            {
+                dst[0] = scale[SDL_min(src[0], max_val)];
+                dst[1] = scale[SDL_min(src[1], max_val)];
+                dst[2] = scale[SDL_min(src[2], max_val)];
+            }
+        }
     }
+    else if (depth == 3 && max_val == 65535)
+        convert16To8(src + (size_t)x * 6, dst, count * 3);
     else
     {
-        // if there is no comment line, we have read the first character of width
-        dims->width = dims->width * 10 + buff_byte - 48;
+        // 16-bit samples are big-endian
+        src += (size_t)x * depth * 2;
+        for (int i = 0; i < count; i++, src += depth * 2, dst += 3)
+        {
+            if (depth < 3)
+                dst[0] = dst[1] = dst[2] = scale[SDL_min(src[0] << 8 | src[1], max_val)];
+            else
+            {
+                dst[0] = scale[SDL_min(src[0] << 8 | src[1], max_val)];
+                dst[1] = scale[SDL_min(src[2] << 8 | src[3], max_val)];
+                dst[2] = scale[SDL_min(src[4] << 8 | src[5], max_val)];
+            }
+        }
     }
+}
+
+// count pixels of row y from x on as RGB24, from the payload or the decoded image
+void readPixels(NETPBM_DECODER *decoder, int x, int y, int count, Uint8 *dst)
+{
+    if (decoder->payload)
+        convertSamples(decoder, decoder->payload + (size_t)y * decoder->row_bytes, x, count, dst);
+    else
+        memcpy(dst, decoder->rgb + ((size_t)y * decoder->width + x) * 3, (size_t)count * 3);
+}
 
+void asciiSample(NETPBM_DECODER *decoder, int value)
+{
+    Uint8 *dst = decoder->rgb + ((size_t)decoder->rows_done * decoder->width + decoder->ascii_x) * 3;
+    Uint8 v = decoder->scale[SDL_min(value, decoder->max_val)];
+    if (decoder->depth == 1)
+        dst[0] = dst[1] = dst[2] = v;
+    else
+        dst[decoder->ascii_channel] = v;
+
+    if (++decoder->ascii_channel < decoder->depth)
+        return;
+    decoder->ascii_channel = 0;
+    if (++decoder->ascii_x < decoder->width)
+        return;
+    decoder->ascii_x = 0;
+    if (++decoder->rows_done == decoder->height)
+        decoder->state = DECODE_DONE;
+}
+
+// regular files are mapped and fed as one contiguous buffer, anything else is read in chunks
+int openStream(const char *path, IMAGE_STREAM *stream)
+{
+    memset(stream, 0, sizeof(IMAGE_STREAM));
+    stream->path = path;
+    stream->fd = strcmp(path, "-") ? open(path, O_RDONLY) : STDIN_FILENO;
+    if (stream->fd < 0)
+    {
+        printf("Could not open %s\n", path);
+        return 0;
+    }
+    struct stat st;
+    if (fstat(stream->fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        stream->map_size = st.st_size;
+        stream->map = (Uint8 *)mmap(NULL, stream->map_size, PROT_READ, MAP_PRIVATE, stream->fd, 0);
+        if (stream->map == MAP_FAILED)
+            stream->map = NULL;
+        else
+            madvise(stream->map, stream->map_size, MADV_SEQUENTIAL);
+    }
+    initDecoder(&stream->decoder, stream->map != NULL);
+    stream->mutex = SDL_CreateMutex();
+    stream->image = -1;
+    stream->released_cond = SDL_CreateCond();
+    return 1;
+}
+
+void closeStream(IMAGE_STREAM *stream)
+{
+    if (stream->map)
+        munmap(stream->map, stream->map_size);
+    if (stream->fd != STDIN_FILENO)
+        close(stream->fd);
+    freeDecoder(&stream->decoder);
+    SDL_DestroyCond(stream->released_cond);
+    SDL_DestroyMutex(stream->mutex);
+}
+
+// decodes the whole input, publishing progress after every chunk
+int streamMain(void *data)
+{
+    IMAGE_STREAM *stream = (IMAGE_STREAM *)data;
+    NETPBM_DECODER *decoder = &stream->decoder;
+    Uint8 *buffer = stream->map ? NULL : (Uint8 *)malloc(READ_CHUNK);
+    size_t offset = 0;
+    int quit = 0, at_end = 0, started = 0;
+
+    while (!quit && !at_end)
+    {
+        const Uint8 *chunk;
+        size_t len;
+        if (stream->map)
+        {
+            chunk = stream->map + offset;
+            len = SDL_min(stream->map_size - offset, READ_CHUNK);
+            offset += len;
+        }
+        else
+        {
+            ssize_t n = read(stream->fd, buffer, READ_CHUNK);
+            chunk = buffer;
+            len = n > 0 ? n : 0;
+        }
+        at_end = len == 0;
+        if (at_end)
+            finishDecoder(decoder);
+
+        do
+        {
+            size_t used = feedDecoder(decoder, chunk, len);
+            chunk += used;
+            len -= used;
+
+            SDL_LockMutex(stream->mutex);
+            if (decoder->state >= DECODE_PIXELS && decoder->state <= DECODE_DONE)
+            {
+                if (!started)
+                {
+                    started = 1;
+                    stream->image++;
+                    stream->source = *decoder;
+                }
+                stream->rows_ready = decoder->rows_done;
+                stream->complete = decoder->state == DECODE_DONE;
+            }
+            if (decoder->state == DECODE_DONE && !stream->single)
+            {
+                while (stream->released <= stream->image && !stream->quit)
+                    SDL_CondWait(stream->released_cond, stream->mutex);
+                started = 0;
+                resetDecoder(decoder);
+            }
+            quit = stream->quit || decoder->state == DECODE_ERROR || (stream->single && decoder->state == DECODE_DONE);
+            SDL_UnlockMutex(stream->mutex);
+        } while (len && !quit);
+    }
+
+    if (decoder->state == DECODE_ERROR && stream->single)
+        printf("%s is not a valid Netpbm image\n", stream->path);
+    else if (decoder->state == DECODE_ERROR)
+        printf("Image %d is not a valid Netpbm image\n", stream->image + 1 + !started);
+    else if (!quit && (decoder->state != DECODE_MAGIC || decoder->line_len) && stream->single)
+        printf("%s is truncated\n", stream->path);
+    else if (!quit && (decoder->state != DECODE_MAGIC || decoder->line_len))
+        printf("Image %d is truncated\n", stream->image + 1 + !started);
+    else if (stream->image < 0)
+        printf("No image in input\n");
+
+    SDL_LockMutex(stream->mutex);
+    stream->finished = 1;
+    SDL_UnlockMutex(stream->mutex);
+    free(buffer);
+    return 0;
+}
+
+void initTileCache(TILE_CACHE *cache, int num_images, int num_threads, size_t cap)
+{
+    memset(cache, 0, sizeof(*cache));
+    cache->mutex = SDL_CreateMutex();
+    cache->work = SDL_CreateCond();
+    cache->idle = SDL_CreateCond();
+    cache->cap = cap;
+    initPixelConversion(&cache->to_tile, SDL_PIXELFORMAT_RGB24, TILE_FORMAT);
+    cache->sources = (TILE_SOURCE *)calloc(num_images, sizeof(TILE_SOURCE));
+    cache->num_sources = num_images;
+    cache->num_threads = num_threads;
+    for (int i = 0; i < num_threads; i++)
+        cache->threads[i] = SDL_CreateThread(tileMain, "iv tiles", cache);
+}
+
+void freeTileCache(TILE_CACHE *cache)
+{
+    SDL_LockMutex(cache->mutex);
+    cache->quit = 1;
+    SDL_CondBroadcast(cache->work);
+    SDL_UnlockMutex(cache->mutex);
+    for (int i = 0; i < cache->num_threads; i++)
+        SDL_WaitThread(cache->threads[i], NULL);
+    dropTiles(cache, -1);
+    free(cache->queue);
+    free(cache->sources);
+    SDL_DestroyCond(cache->work);
+    SDL_DestroyCond(cache->idle);
+    SDL_DestroyMutex(cache->mutex);
+}
+
+// Points an image at new pixels, dropping its old tiles. The caller makes sure no
+// tile is being built from the old ones.
+void setTileImage(TILE_CACHE *cache, int image, const NETPBM_DECODER *decoder)
+{
+    dropTiles(cache, image);
+    SDL_LockMutex(cache->mutex);
+    TILE_SOURCE *source = &cache->sources[image];
+    source->decoder = *decoder;
+    source->width = decoder->width;
+    source->height = decoder->height;
+    source->rows_ready = 0;
+    source->levels = 1;
+    while ((source->width - 1) >> (source->levels - 1) >= TILE_SIZE || (source->height - 1) >> (source->levels - 1) >= TILE_SIZE)
+        source->levels++;
+    source->valid = 1;
+    SDL_UnlockMutex(cache->mutex);
+}
+
+// Stops building tiles of an image whose pixels are going away; its cached tiles,
+// thumbnail included, stay drawable. The caller drains the workers first.
+void removeTileImage(TILE_CACHE *cache, int image)
+{
+    SDL_LockMutex(cache->mutex);
+    cache->sources[image].valid = 0;
+    SDL_UnlockMutex(cache->mutex);
+}
+
+// drops every queued request and waits for the tiles being built
+void drainTiles(TILE_CACHE *cache)
+{
+    SDL_LockMutex(cache->mutex);
+    for (int i = 0; i < cache->queue_len; i++)
+        cache->queue[i]->requested = 0;
+    cache->queue_len = 0;
+    while (cache->busy)
+        SDL_CondWait(cache->idle, cache->mutex);
+    SDL_UnlockMutex(cache->mutex);
+}
+
+// frees the tiles of one image, or of all of them when image is negative
+void dropTiles(TILE_CACHE *cache, int image)
+{
+    SDL_LockMutex(cache->mutex);
+    for (int i = 0; i < TILE_BUCKETS; i++)
+    {
+        TILE *tile = cache->buckets[i];
+        while (tile)
+        {
+            TILE *next = tile->next;
+            if (image < 0 || tile->image == image)
+                freeTile(cache, tile);
+            tile = next;
+        }
+    }
+    SDL_UnlockMutex(cache->mutex);
+}
+
+// Starts a frame's requests: whatever was asked for before and not built yet is
+// dropped unless it is asked for again.
+void beginTileFrame(TILE_CACHE *cache)
+{
+    SDL_LockMutex(cache->mutex);
+    for (int i = 0; i < cache->queue_len; i++)
+        cache->queue[i]->requested = 0;
+    cache->queue_len = 0;
+    for (int i = 0; i < TILE_BUCKETS; i++)
+    {
+        TILE *tile = cache->buckets[i];
+        while (tile)
+        {
+            TILE *next = tile->next;
+            if (tile->state == TILE_QUEUED && !tile->pixels)
+                freeTile(cache, tile);
+            else if (tile->state == TILE_QUEUED)
+                tile->state = TILE_READY;
+            tile = next;
+        }
+    }
+    SDL_UnlockMutex(cache->mutex);
+}
+
+TILE **tileBucket(TILE_CACHE *cache, int image, int level, int tx, int ty)
+{
+    unsigned hash = (unsigned)image * 0x27D4EB2Fu ^ (unsigned)level * 0x9E3779B1u ^ (unsigned)tx * 0x85EBCA77u ^
+                    (unsigned)ty * 0xC2B2AE3Du;
+    return &cache->buckets[(hash ^ hash >> 15) % TILE_BUCKETS];
+}
+
+TILE *findTile(TILE_CACHE *cache, int image, int level, int tx, int ty)
+{
+    TILE *tile = *tileBucket(cache, image, level, tx, ty);
+    while (tile && (tile->image != image || tile->level != level || tile->tx != tx || tile->ty != ty))
+        tile = tile->next;
+    return tile;
+}
+
+// Looks the tile up, queueing it to be built if it is missing or was built before
+// all of its rows had arrived. Requests made later in a frame are served first.
+TILE *requestTile(TILE_CACHE *cache, int image, int level, int tx, int ty, Uint64 frame)
+{
+    TILE_SOURCE *source = &cache->sources[image];
+    TILE *tile = findTile(cache, image, level, tx, ty);
+    if (!source->valid)
+        return tile;
+    if (!tile)
+    {
+        tile = (TILE *)calloc(1, sizeof(TILE));
+        if (!tile)
+            return NULL;
+        int level_w, level_h;
+        levelSize(source, level, &level_w, &level_h);
+        tile->image = image;
+        tile->level = level;
+        tile->tx = tx;
+        tile->ty = ty;
+        tile->width = SDL_min(TILE_SIZE, level_w - tx * TILE_SIZE);
+        tile->height = SDL_min(TILE_SIZE, level_h - ty * TILE_SIZE);
+        tile->state = TILE_QUEUED;
+        TILE **bucket = tileBucket(cache, image, level, tx, ty);
+        tile->next = *bucket;
+        *bucket = tile;
+    }
+    else if (tile->state == TILE_READY && !tile->complete && source->rows_ready > tile->rows)
+    {
+        // rebuilt as more of its rows come in, though not on every frame; the old
+        // pixels stay drawable meanwhile
+        int last_row = SDL_min((ty * TILE_SIZE + tile->height) << level, source->height);
+        if (source->rows_ready >= last_row || frame % 8 == 0)
+            tile->state = TILE_QUEUED;
+    }
+    tile->last_used = frame;
+    if (tile->state == TILE_QUEUED && tile->requested != frame)
+    {
+        if (cache->queue_len == cache->queue_cap)
+        {
+            int cap = SDL_max(cache->queue_cap * 2, 256);
+            TILE **queue = (TILE **)realloc(cache->queue, cap * sizeof(TILE *));
+            if (!queue)
+                return tile;
+            cache->queue = queue;
+            cache->queue_cap = cap;
+        }
+        cache->queue[cache->queue_len++] = tile;
+        tile->requested = frame;
+        SDL_CondSignal(cache->work);
+    }
+    return tile;
+}
+
+void freeTile(TILE_CACHE *cache, TILE *tile)
+{
+    TILE **link = tileBucket(cache, tile->image, tile->level, tile->tx, tile->ty);
+    while (*link != tile)
+        link = &(*link)->next;
+    *link = tile->next;
+    if (tile->pixels)
+        cache->bytes -= (size_t)tile->width * tile->height * 4;
+    if (tile->texture)
+    {
+        cache->bytes -= (size_t)tile->width * tile->height * 4;
+        SDL_DestroyTexture(tile->texture);
+    }
+    free(tile->pixels);
+    free(tile);
+}
+
+void levelSize(const TILE_SOURCE *source, int level, int *width, int *height)
+{
+    *width = ((source->width - 1) >> level) + 1;
+    *height = ((source->height - 1) >> level) + 1;
+}
+
+int tileMain(void *data)
+{
+    TILE_CACHE *cache = (TILE_CACHE *)data;
+    SDL_LockMutex(cache->mutex);
     while (1)
     {
-        // get image width
-        fread(&buff_byte, 1, 1, fimg);
-        if (buff_byte == ' ')
+        while (!cache->quit && !cache->queue_len)
+            SDL_CondWait(cache->work, cache->mutex);
+        if (cache->quit)
             break;
-        dims->width = dims->width * 10 + buff_byte - 48;
+        TILE *tile = cache->queue[--cache->queue_len];
+        TILE_SOURCE *source = &cache->sources[tile->image];
+        tile->state = TILE_BUILDING;
+        cache->busy++;
+
+        // downsample the level below when all of it is at hand, pinning it meanwhile
+        TILE *children[4] = {NULL, NULL, NULL, NULL};
+        if (tile->level > 0)
+        {
+            int level_w, level_h, ready = 1;
+            levelSize(source, tile->level - 1, &level_w, &level_h);
+            for (int i = 0; i < 4 && ready; i++)
+            {
+                int cx = tile->tx * 2 + i % 2, cy = tile->ty * 2 + i / 2;
+                if (cx * TILE_SIZE >= level_w || cy * TILE_SIZE >= level_h)
+                    continue;
+                children[i] = findTile(cache, tile->image, tile->level - 1, cx, cy);
+                ready = children[i] && children[i]->pixels && children[i]->complete && children[i]->state != TILE_BUILDING;
+            }
+            for (int i = 0; i < 4; i++)
+            {
+                if (!ready)
+                    children[i] = NULL;
+                else if (children[i])
+                    children[i]->pins++;
+            }
+        }
+        int rows_ready = source->rows_ready;
+        SDL_UnlockMutex(cache->mutex);
+
+        Uint8 *pixels = (Uint8 *)malloc((size_t)tile->width * tile->height * 4);
+        if (pixels)
+            buildTile(source, &cache->to_tile, tile, children, rows_ready, pixels);
+
+        SDL_LockMutex(cache->mutex);
+        for (int i = 0; i < 4; i++)
+        {
+            if (children[i])
+                children[i]->pins--;
+        }
+        if (pixels)
+        {
+            int last_row = SDL_min((tile->ty * TILE_SIZE + tile->height) << tile->level, source->height);
+            if (!tile->pixels)
+                cache->bytes += (size_t)tile->width * tile->height * 4;
+            free(tile->pixels);
+            tile->pixels = pixels;
+            tile->rows = rows_ready;
+            tile->complete = children[0] || rows_ready >= last_row;
+            tile->texture_stale = 1;
+        }
+        tile->state = TILE_READY;
+        if (!--cache->busy)
+            SDL_CondBroadcast(cache->idle);
+    }
+    SDL_UnlockMutex(cache->mutex);
+    return 0;
+}
+
+// Fills a tile with a 2x2 box filter over its children when given them, and otherwise
+// straight from the source: a copy at level 0 and up to 4x4 samples per pixel above,
+// gathered a row at a time as RGB24 and converted. Rows that have not arrived yet are
+// left black.
+void buildTile(TILE_SOURCE *source, const PIXEL_CONVERSION *to_tile, TILE *tile, TILE *children[4], int rows_ready,
+               Uint8 *pixels)
+{
+    int width = tile->width, height = tile->height, level = tile->level;
+    int x0 = tile->tx * TILE_SIZE, y0 = tile->ty * TILE_SIZE;
+    Uint8 row[TILE_SIZE * 3];
+
+    if (children[0])
+    {
+        int below_w, below_h;
+        levelSize(source, level - 1, &below_w, &below_h);
+        for (int y = 0; y < height; y++)
+        {
+            int rows[2] = {(y0 + y) * 2, SDL_min((y0 + y) * 2 + 1, below_h - 1)};
+            for (int x = 0; x < width; x++)
+            {
+                int cols[2] = {(x0 + x) * 2, SDL_min((x0 + x) * 2 + 1, below_w - 1)};
+                int sum[4] = {2, 2, 2, 2};
+                for (int j = 0; j < 4; j++)
+                {
+                    int bx = cols[j % 2], by = rows[j / 2];
+                    TILE *child = children[(by / TILE_SIZE - tile->ty * 2) * 2 + bx / TILE_SIZE - tile->tx * 2];
+                    const Uint8 *p = child->pixels + ((size_t)(by % TILE_SIZE) * child->width + bx % TILE_SIZE) * 4;
+                    for (int c = 0; c < 4; c++)
+                        sum[c] += p[c];
+                }
+                Uint8 *dst = pixels + ((size_t)y * width + x) * 4;
+                for (int c = 0; c < 4; c++)
+                    dst[c] = sum[c] / 4;
+            }
+        }
+        return;
+    }
+
+    if (level == 0)
+    {
+        for (int y = 0; y < height; y++)
+        {
+            if (y0 + y < rows_ready)
+                readPixels(&source->decoder, x0, y0 + y, width, row);
+            else
+                memset(row, 0, (size_t)width * 3);
+            convertPixels(to_tile, row, pixels + (size_t)y * width * 4, width);
+        }
+        return;
     }
 
+    // stratified samples within each pixel's 2^level square footprint
+    int footprint = 1 << level, samples = SDL_min(footprint, 4);
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            int sum[3] = {0, 0, 0}, n = 0;
+            for (int sy = 0; sy < samples; sy++)
+            {
+                int row = SDL_min((y0 + y) * footprint + (2 * sy + 1) * footprint / (2 * samples), source->height - 1);
+                if (row >= rows_ready)
+                    continue;
+                for (int sx = 0; sx < samples; sx++)
+                {
+                    int col = SDL_min((x0 + x) * footprint + (2 * sx + 1) * footprint / (2 * samples), source->width - 1);
+                    Uint8 p[3];
+                    readPixels(&source->decoder, col, row, 1, p);
+                    sum[0] += p[0];
+                    sum[1] += p[1];
+                    sum[2] += p[2];
+                    n++;
+                }
+            }
+            Uint8 *dst = row + x * 3;
+            dst[0] = n ? sum[0] / n : 0;
+            dst[1] = n ? sum[1] / n : 0;
+            dst[2] = n ? sum[2] / n : 0;
+        }
+        convertPixels(to_tile, row, pixels + (size_t)y * width * 4, width);
+    }
+}
+
+// Lists the tiles of the level closest to the zoom that cover the window, farthest
+// from its centre first, and returns how many there are.
+int visibleTiles(const TILE_SOURCE *source, const VIEW *view, int win_w, int win_h, int *level, SDL_Point **order)
+{
+    *level = 0;
+    *order = NULL;
+    while (*level + 1 < source->levels && view->scale * (2 << *level) <= 1.0)
+        (*level)++;
+    int level_w, level_h;
+    levelSize(source, *level, &level_w, &level_h);
+    double span = (double)TILE_SIZE * (1 << *level);
+    int tx0 = SDL_max((int)SDL_floor(view->x / span), 0);
+    int ty0 = SDL_max((int)SDL_floor(view->y / span), 0);
+    int tx1 = SDL_min((int)SDL_floor((view->x + win_w / view->scale) / span), (level_w - 1) / TILE_SIZE);
+    int ty1 = SDL_min((int)SDL_floor((view->y + win_h / view->scale) / span), (level_h - 1) / TILE_SIZE);
+    if (tx1 < tx0 || ty1 < ty0)
+        return 0;
+
+    int count = (tx1 - tx0 + 1) * (ty1 - ty0 + 1);
+    *order = (SDL_Point *)malloc(count * sizeof(SDL_Point));
+    if (!*order)
+        return 0;
+    double cx = (view->x + win_w / view->scale / 2) / span - 0.5, cy = (view->y + win_h / view->scale / 2) / span - 0.5;
+    for (int i = 0; i < count; i++)
+    {
+        SDL_Point p = {tx0 + i % (tx1 - tx0 + 1), ty0 + i / (tx1 - tx0 + 1)};
+        double d = (p.x - cx) * (p.x - cx) + (p.y - cy) * (p.y - cy);
+        int j = i;
+        while (j > 0 && ((*order)[j - 1].x - cx) * ((*order)[j - 1].x - cx) + ((*order)[j - 1].y - cy) * ((*order)[j - 1].y - cy) < d)
+        {
+            (*order)[j] = (*order)[j - 1];
+            j--;
+        }
+        (*order)[j] = p;
+    }
+    return count;
+}
+
+// asks for the tiles a view would draw without drawing them
+void requestView(TILE_CACHE *cache, int image, const VIEW *view, int win_w, int win_h, Uint64 frame)
+{
+    SDL_Point *order;
+    int level, count = visibleTiles(&cache->sources[image], view, win_w, win_h, &level, &order);
+    SDL_LockMutex(cache->mutex);
+    for (int i = 0; i < count; i++)
+        requestTile(cache, image, level, order[i].x, order[i].y, frame);
+    requestTile(cache, image, cache->sources[image].levels - 1, 0, 0, frame);
+    SDL_UnlockMutex(cache->mutex);
+    free(order);
+}
+
+// Draws the visible tiles of an image, the nearest the centre requested last so they
+// are built first. A tile that is not ready yet is stood in for by the closest cached
+// level above it.
+void drawImage(SDL_Renderer *renderer, TILE_CACHE *cache, int image, const VIEW *view, int win_w, int win_h, Uint64 frame)
+{
+    TILE_SOURCE *source = &cache->sources[image];
+    SDL_Point *order;
+    int level, count = visibleTiles(source, view, win_w, win_h, &level, &order);
+    double span = (double)TILE_SIZE * (1 << level), tile_scale = view->scale * (1 << level);
+
+    SDL_LockMutex(cache->mutex);
+    for (int i = 0; i < count; i++)
+        requestTile(cache, image, level, order[i].x, order[i].y, frame);
+    requestTile(cache, image, source->levels - 1, 0, 0, frame);
+
+    int uploads = 0;
+    for (int i = 0; i < count; i++)
+    {
+        TILE *tile = findTile(cache, image, level, order[i].x, order[i].y);
+        SDL_FRect dst = {(float)((order[i].x * span - view->x) * view->scale), (float)((order[i].y * span - view->y) * view->scale),
+                         0, 0};
+        if (tile)
+        {
+            dst.w = (float)(tile->width * tile_scale);
+            dst.h = (float)(tile->height * tile_scale);
+            if (drawTile(renderer, cache, tile, NULL, &dst, frame, &uploads))
+                continue;
+        }
+        for (int up = 1; level + up < source->levels; up++)
+        {
+            TILE *ancestor = findTile(cache, image, level + up, order[i].x >> up, order[i].y >> up);
+            if (!ancestor)
+                continue;
+            SDL_Rect src = {(order[i].x * TILE_SIZE >> up) - ancestor->tx * TILE_SIZE,
+                            (order[i].y * TILE_SIZE >> up) - ancestor->ty * TILE_SIZE, 0, 0};
+            src.w = SDL_min(TILE_SIZE >> up, ancestor->width - src.x);
+            src.h = SDL_min(TILE_SIZE >> up, ancestor->height - src.y);
+            if (src.w <= 0 || src.h <= 0)
+                continue;
+            dst.w = (float)(src.w * tile_scale * (1 << up));
+            dst.h = (float)(src.h * tile_scale * (1 << up));
+            if (drawTile(renderer, cache, ancestor, &src, &dst, frame, &uploads))
+                break;
+        }
+    }
+    SDL_UnlockMutex(cache->mutex);
+    free(order);
+}
+
+// draws a built tile, uploading its texture first if that fits in this frame's budget
+int drawTile(SDL_Renderer *renderer, TILE_CACHE *cache, TILE *tile, const SDL_Rect *src, const SDL_FRect *dst, Uint64 frame,
+             int *uploads)
+{
+    if (tile->texture_stale && *uploads < UPLOADS_PER_FRAME)
+    {
+        if (!tile->texture)
+        {
+            tile->texture = SDL_CreateTexture(renderer, TILE_FORMAT, SDL_TEXTUREACCESS_STATIC, tile->width, tile->height);
+            if (tile->texture)
+                cache->bytes += (size_t)tile->width * tile->height * 4;
+        }
+        if (tile->texture)
+        {
+            SDL_UpdateTexture(tile->texture, NULL, tile->pixels, tile->width * 4);
+            tile->texture_stale = 0;
+        }
+        (*uploads)++;
+    }
+    if (!tile->texture)
+        return 0;
+    tile->last_used = frame;
+    SDL_RenderCopyF(renderer, tile->texture, src, dst);
+    return 1;
+}
+
+// evicts the tiles used least recently until the cache fits its budget
+void evictTiles(TILE_CACHE *cache, Uint64 frame)
+{
+    SDL_LockMutex(cache->mutex);
+    if (cache->bytes <= cache->cap)
+    {
+        SDL_UnlockMutex(cache->mutex);
+        return;
+    }
+    int count = 0;
+    for (int i = 0; i < TILE_BUCKETS; i++)
+    {
+        for (TILE *tile = cache->buckets[i]; tile; tile = tile->next)
+            count++;
+    }
+    TILE **victims = (TILE **)malloc(count * sizeof(TILE *));
+    int num_victims = 0;
+    for (int i = 0; i < TILE_BUCKETS && victims; i++)
+    {
+        for (TILE *tile = cache->buckets[i]; tile; tile = tile->next)
+        {
+            if (tile->state == TILE_READY && !tile->pins && tile->last_used < frame)
+                victims[num_victims++] = tile;
+        }
+    }
+    // oldest first
+    for (int i = 1; i < num_victims; i++)
+    {
+        TILE *tile = victims[i];
+        int j = i;
+        while (j > 0 && victims[j - 1]->last_used > tile->last_used)
+        {
+            victims[j] = victims[j - 1];
+            j--;
+        }
+        victims[j] = tile;
+    }
+    for (int i = 0; i < num_victims && cache->bytes > cache->cap; i++)
+        freeTile(cache, victims[i]);
+    free(victims);
+    SDL_UnlockMutex(cache->mutex);
+}
+
+// whether the image's coarsest tile, its thumbnail, is fully built
+int hasThumbnail(TILE_CACHE *cache, int image)
+{
+    SDL_LockMutex(cache->mutex);
+    TILE *tile = cache->sources[image].levels ? findTile(cache, image, cache->sources[image].levels - 1, 0, 0) : NULL;
+    int done = tile && tile->pixels && tile->complete;
+    SDL_UnlockMutex(cache->mutex);
+    return done;
+}
+
+void fitView(VIEW *view, const TILE_SOURCE *source, int win_w, int win_h)
+{
+    if (!source->width || !win_w || !win_h)
+        return;
+    view->scale = SDL_min((double)win_w / source->width, (double)win_h / source->height);
+    view->x = (source->width - win_w / view->scale) / 2;
+    view->y = (source->height - win_h / view->scale) / 2;
+    view->fit = 1;
+}
+
+// zooms keeping the image point under (at_x, at_y) in place
+void zoomView(VIEW *view, double factor, int at_x, int at_y)
+{
+    double scale = SDL_clamp(view->scale * factor, 1e-4, MAX_ZOOM);
+    view->x += at_x / view->scale - at_x / scale;
+    view->y += at_y / view->scale - at_y / scale;
+    view->scale = scale;
+    view->fit = 0;
+}
+
+// keeps the image on screen, centred along any axis it does not fill
+void clampView(VIEW *view, const TILE_SOURCE *source, int win_w, int win_h)
+{
+    double visible_w = win_w / view->scale, visible_h = win_h / view->scale;
+    if (visible_w >= source->width)
+        view->x = (source->width - visible_w) / 2;
+    else
+        view->x = SDL_clamp(view->x, 0, source->width - visible_w);
+    if (visible_h >= source->height)
+        view->y = (source->height - visible_h) / 2;
+    else
+        view->y = SDL_clamp(view->y, 0, source->height - visible_h);
+}
+
+void readSourceRow(void *data, int y, Uint8 *row)
+{
+    TILE_SOURCE *source = (TILE_SOURCE *)data;
+    readPixels(&source->decoder, 0, y, source->width, row);
+}
+
+// Resamples the whole of a fully decoded image to the size the view shows it at,
+// unless that was the last thing resampled. Returns whether there is a result to draw:
+// there is none while the image is still arriving, at 100% where the tiles are exact
+// already, or for images too large to filter in one go.
+int updateResampled(SDL_Renderer *renderer, RESAMPLED *resampled, TILE_SOURCE *source, int image, int entry_image,
+                    const VIEW *view, int filter)
+{
+    int width = SDL_max((int)(source->width * view->scale + 0.5), 1);
+    int height = SDL_max((int)(source->height * view->scale + 0.5), 1);
+    if (!source->valid || source->rows_ready < source->height || (Sint64)source->width * source->height > RESAMPLE_MAX_PIXELS ||
+        (width == source->width && height == source->height))
+        return 0;
+    if (resampled->image == image && resampled->entry_image == entry_image && resampled->width == width &&
+        resampled->height == height && resampled->filter == filter)
+        return resampled->texture != NULL;
+
+    Uint64 start = SDL_GetPerformanceCounter();
+    Uint8 *pixels = (Uint8 *)malloc((size_t)width * height * 4);
+    int done = pixels && resampleImage(filter, readSourceRow, source, source->width, source->height, 3, pixels, width * 4,
+                                       width, height);
+    if (resampled->texture && (!done || resampled->width != width || resampled->height != height))
+    {
+        SDL_DestroyTexture(resampled->texture);
+        resampled->texture = NULL;
+    }
+    // the RGB24 samples come out with opaque alpha after them, which is RGBA32
+    if (done && !resampled->texture)
+        resampled->texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_STATIC, width, height);
+    if (done && resampled->texture)
+    {
+        SDL_UpdateTexture(resampled->texture, NULL, pixels, width * 4);
+        printf("Resampled to %dx%d with %s in %.1f ms\n", width, height, filter_names[filter],
+               (double)(SDL_GetPerformanceCounter() - start) * 1000 / SDL_GetPerformanceFrequency());
+    }
+    free(pixels);
+    resampled->image = image;
+    resampled->entry_image = entry_image;
+    resampled->width = width;
+    resampled->height = height;
+    resampled->filter = filter;
+    return resampled->texture != NULL;
+}
+
+void initLibrary(LIBRARY *library)
+{
+    memset(library, 0, sizeof(*library));
+    library->mutex = SDL_CreateMutex();
+    library->work = SDL_CreateCond();
+}
+
+void addEntry(LIBRARY *library, const char *path)
+{
+    IMAGE_ENTRY *entries = (IMAGE_ENTRY *)realloc(library->entries, (library->num_entries + 1) * sizeof(IMAGE_ENTRY));
+    if (!entries)
+        return;
+    library->entries = entries;
+    IMAGE_ENTRY *entry = &entries[library->num_entries++];
+    memset(entry, 0, sizeof(*entry));
+    entry->path = strdup(path);
+    entry->image = -1;
+}
+
+// a directory adds its Netpbm files in name order, anything else is taken as a file
+void addPath(LIBRARY *library, const char *path)
+{
+    DIR *dir = strcmp(path, "-") ? opendir(path) : NULL;
+    if (!dir)
+    {
+        addEntry(library, path);
+        return;
+    }
+    int first = library->num_entries;
+    struct dirent *item;
+    while ((item = readdir(dir)))
+    {
+        const char *ext = strrchr(item->d_name, '.');
+        if (!ext || (strcasecmp(ext, ".pbm") && strcasecmp(ext, ".pgm") && strcasecmp(ext, ".ppm") &&
+                     strcasecmp(ext, ".pnm") && strcasecmp(ext, ".pam")))
+            continue;
+        char full[PATH_MAX];
+        snprintf(full, sizeof(full), "%s/%s", path, item->d_name);
+        addEntry(library, full);
+    }
+    closedir(dir);
+    qsort(library->entries + first, library->num_entries - first, sizeof(IMAGE_ENTRY), compareEntries);
+}
+
+int compareEntries(const void *a, const void *b)
+{
+    return strcmp(((const IMAGE_ENTRY *)a)->path, ((const IMAGE_ENTRY *)b)->path);
+}
+
+void startLibrary(LIBRARY *library, int num_threads)
+{
+    library->queue = (int *)malloc(SDL_max(library->num_entries, 1) * sizeof(int));
+    library->num_threads = num_threads;
+    for (int i = 0; i < num_threads; i++)
+        library->threads[i] = SDL_CreateThread(loaderMain, "iv loader", library);
+}
+
+// Stops the loaders and returns whether they could be joined. One blocked reading a
+// pipe that never closes cannot be, and then nothing is freed.
+int stopLibrary(LIBRARY *library)
+{
+    int blocked = 0;
+    SDL_LockMutex(library->mutex);
+    library->quit = 1;
+    SDL_CondBroadcast(library->work);
+    for (int i = 0; i < library->num_entries; i++)
+    {
+        IMAGE_STREAM *stream = &library->entries[i].stream;
+        if (library->entries[i].state != IMAGE_LOADING)
+            continue;
+        SDL_LockMutex(stream->mutex);
+        stream->quit = 1;
+        SDL_CondSignal(stream->released_cond);
+        blocked |= !stream->finished && !stream->map;
+        SDL_UnlockMutex(stream->mutex);
+    }
+    SDL_UnlockMutex(library->mutex);
+    for (int i = 0; i < library->num_threads; i++)
+    {
+        if (blocked)
+            SDL_DetachThread(library->threads[i]);
+        else
+            SDL_WaitThread(library->threads[i], NULL);
+    }
+    return !blocked;
+}
+
+void freeLibrary(LIBRARY *library)
+{
+    for (int i = 0; i < library->num_entries; i++)
+    {
+        int state = library->entries[i].state;
+        if (state == IMAGE_QUEUED || state == IMAGE_LOADING || state == IMAGE_OPEN)
+            closeStream(&library->entries[i].stream);
+        free(library->entries[i].path);
+    }
+    free(library->entries);
+    free(library->queue);
+    SDL_DestroyCond(library->work);
+    SDL_DestroyMutex(library->mutex);
+}
+
+// decodes queued images, most important first, publishing progress like the reader of a single stream
+int loaderMain(void *data)
+{
+    LIBRARY *library = (LIBRARY *)data;
+    SDL_LockMutex(library->mutex);
     while (1)
     {
-        // get image height
-        fread(&buff_byte, 1, 1, fimg);
-        if (buff_byte == '\n')
+        while (!library->quit && library->queue_head == library->queue_len)
+            SDL_CondWait(library->work, library->mutex);
+        if (library->quit)
             break;
-        dims->height = dims->height * 10 + buff_byte - 48;
+        IMAGE_ENTRY *entry = &library->entries[library->queue[library->queue_head++]];
+        entry->state = IMAGE_LOADING;
+        SDL_UnlockMutex(library->mutex);
+        streamMain(&entry->stream);
+        SDL_LockMutex(library->mutex);
+        entry->state = IMAGE_OPEN;
     }
+    SDL_UnlockMutex(library->mutex);
+    return 0;
+}
 
-    return dims;
+// Queues the wanted images, given least important first, that are not decoded yet.
+// Queued ones no longer wanted are closed again without being decoded.
+void requestImages(LIBRARY *library, const int *wanted, int count, Uint64 frame)
+{
+    SDL_LockMutex(library->mutex);
+    library->queue_head = library->queue_len = 0;
+    for (int i = count - 1; i >= 0; i--)
+    {
+        IMAGE_ENTRY *entry = &library->entries[wanted[i]];
+        if (entry->last_used == frame)
+            continue;
+        entry->last_used = frame;
+        if (entry->state == IMAGE_CLOSED)
+        {
+            if (!openStream(entry->path, &entry->stream))
+            {
+                entry->state = IMAGE_FAILED;
+                continue;
+            }
+            // a lone input may hold several images, a list shows the first of each file
+            entry->stream.single = library->num_entries > 1;
+            entry->state = IMAGE_QUEUED;
+        }
+        if (entry->state == IMAGE_QUEUED)
+            library->queue[library->queue_len++] = wanted[i];
+    }
+    for (int i = 0; i < library->num_entries; i++)
+    {
+        IMAGE_ENTRY *entry = &library->entries[i];
+        if (entry->state == IMAGE_QUEUED && entry->last_used != frame)
+        {
+            closeStream(&entry->stream);
+            entry->state = IMAGE_CLOSED;
+        }
+    }
+    if (library->queue_len)
+        SDL_CondBroadcast(library->work);
+    SDL_UnlockMutex(library->mutex);
 }
 
-int getMaxVal(FILE *fimg)
+// hands images whose header has been read to the tile cache and passes on their progress
+void syncImages(LIBRARY *library, TILE_CACHE *cache)
 {
-    int max_val = 0, buff_byte = 0;
-    while (1)
+    SDL_LockMutex(library->mutex);
+    for (int i = 0; i < library->num_entries; i++)
+    {
+        IMAGE_ENTRY *entry = &library->entries[i];
+        if (entry->state != IMAGE_LOADING && entry->state != IMAGE_OPEN)
+            continue;
+        IMAGE_STREAM *stream = &entry->stream;
+        SDL_LockMutex(stream->mutex);
+        if (stream->image >= 0 && stream->image != entry->image)
+        {
+            // the next image of a stream reuses the released one's buffers
+            if (entry->image >= 0)
+                drainTiles(cache);
+            setTileImage(cache, i, &stream->source);
+            entry->image = stream->image;
+        }
+        if (entry->image >= 0)
+        {
+            SDL_LockMutex(cache->mutex);
+            cache->sources[i].rows_ready = stream->rows_ready;
+            SDL_UnlockMutex(cache->mutex);
+        }
+        int failed = entry->state == IMAGE_OPEN && stream->image < 0;
+        SDL_UnlockMutex(stream->mutex);
+        if (failed)
+        {
+            closeStream(stream);
+            entry->state = IMAGE_FAILED;
+        }
+    }
+    SDL_UnlockMutex(library->mutex);
+}
+
+// Closes decoded images that were not wanted this frame, the farthest from the current
+// one first, while too many are open or their buffers take more than IMAGE_CACHE_MB.
+// Mapped payloads only cost address space and are not counted.
+void evictImages(LIBRARY *library, TILE_CACHE *cache, Uint64 frame)
+{
+    SDL_LockMutex(library->mutex);
+    int num_open = 0, drained = 0;
+    size_t bytes = 0;
+    for (int i = 0; i < library->num_entries; i++)
     {
-        fread(&buff_byte, 1, 1, fimg);
-        if (buff_byte == '\n')
+        int state = library->entries[i].state;
+        if (state == IMAGE_LOADING || state == IMAGE_OPEN)
+        {
+            num_open++;
+            bytes += entryBytes(&library->entries[i]);
+        }
+    }
+    while (num_open > MAX_OPEN_IMAGES || bytes > (size_t)IMAGE_CACHE_MB << 20)
+    {
+        int victim = -1;
+        for (int i = 0; i < library->num_entries; i++)
+        {
+            IMAGE_ENTRY *entry = &library->entries[i];
+            if (entry->state == IMAGE_OPEN && entry->last_used != frame &&
+                (victim < 0 || SDL_abs(i - library->current) > SDL_abs(victim - library->current)))
+                victim = i;
+        }
+        if (victim < 0)
             break;
-        max_val = max_val * 10 + buff_byte - 48;
+        if (!drained)
+            drainTiles(cache);
+        drained = 1;
+        IMAGE_ENTRY *entry = &library->entries[victim];
+        num_open--;
+        bytes -= entryBytes(entry);
+        removeTileImage(cache, victim);
+        closeStream(&entry->stream);
+        entry->state = IMAGE_CLOSED;
+        entry->image = -1;
     }
-    return max_val;
+    SDL_UnlockMutex(library->mutex);
+}
+
+size_t entryBytes(IMAGE_ENTRY *entry)
+{
+    SDL_LockMutex(entry->stream.mutex);
+    size_t bytes = entry->image >= 0 ? entry->stream.source.rgb_size + entry->stream.source.row_buf_size : 0;
+    SDL_UnlockMutex(entry->stream.mutex);
+    return bytes;
 }
 
-RGB_COLOR *getRGB(FILE *fimg)
+// the image under a point of the grid, scrolled content coordinates, or -1
+int gridCell(int x, int y, int columns)
 {
-    RGB_COLOR *rgb = (RGB_COLOR *)malloc(sizeof(RGB_COLOR));
-    fread(rgb, 3, 1, fimg);
-    return rgb;
-}
\ No newline at end of file
+    x -= THUMB_GAP;
+    y -= THUMB_GAP;
+    if (x < 0 || y < 0 || x / THUMB_CELL >= columns || x % THUMB_CELL >= THUMB_SIZE || y % THUMB_CELL >= THUMB_SIZE)
+        return -1;
+    return y / THUMB_CELL * columns + x / THUMB_CELL;
+}
+
+// draws the thumbnails in view, each the coarsest tile of its image, and outlines the current one
+void drawGrid(SDL_Renderer *renderer, TILE_CACHE *cache, LIBRARY *library, int scroll, int columns, int win_h, Uint64 frame)
+{
+    int first = scroll / THUMB_CELL * columns;
+    int last = SDL_min(((scroll + win_h) / THUMB_CELL + 1) * columns, library->num_entries) - 1;
+    int uploads = 0;
+    SDL_LockMutex(library->mutex);
+    SDL_LockMutex(cache->mutex);
+    for (int i = first; i <= last; i++)
+    {
+        SDL_Rect cell = {THUMB_GAP + i % columns * THUMB_CELL, THUMB_GAP + i / columns * THUMB_CELL - scroll, THUMB_SIZE, THUMB_SIZE};
+        if (library->entries[i].state == IMAGE_FAILED)
+            SDL_SetRenderDrawColor(renderer, 96, 32, 32, 255);
+        else
+            SDL_SetRenderDrawColor(renderer, 48, 48, 48, 255);
+        SDL_RenderFillRect(renderer, &cell);
+
+        TILE_SOURCE *source = &cache->sources[i];
+        TILE *tile = source->levels ? requestTile(cache, i, source->levels - 1, 0, 0, frame) : NULL;
+        if (tile && tile->pixels)
+        {
+            float fit = SDL_min((float)THUMB_SIZE / tile->width, (float)THUMB_SIZE / tile->height);
+            SDL_FRect dst = {cell.x + (THUMB_SIZE - tile->width * fit) / 2, cell.y + (THUMB_SIZE - tile->height * fit) / 2,
+                             tile->width * fit, tile->height * fit};
+            drawTile(renderer, cache, tile, NULL, &dst, frame, &uploads);
+        }
+        if (i == library->current)
+        {
+            SDL_Rect outline = {cell.x - 3, cell.y - 3, THUMB_SIZE + 6, THUMB_SIZE + 6};
+            SDL_SetRenderDrawColor(renderer, 255, 200, 0, 255);
+            SDL_RenderDrawRect(renderer, &outline);
+        }
+    }
+    SDL_UnlockMutex(cache->mutex);
+    SDL_UnlockMutex(library->mutex);
+}
@@ -1,4 +1,7 @@
 #include <SDL2/SDL.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define WIDTH 1280
 #define HEIGHT 720
@@ -7,6 +10,27 @@
 #define BRUSH_SIZE_SMALL 8
 #define BRUSH_SIZE_MEDIUM 16
 #define BRUSH_SIZE_LARGE 32
+#define MAX_BRUSH_SIZE 512
+// stamps go a tenth of the brush apart along a stroke
+#define BRUSH_SPACING 10
+// brush masks are kept for this many sizes, hardnesses and flows at once
+#define MASK_CACHE_SIZE 8
+#define BENCH_BRUSH_SIZE 256
+#define CANVAS_TILE_SIZE 256
+#define MAX_CANVAS_SIZE 65536
+#define MIN_ZOOM (1.0 / 16)
+// zoomed out, tiles are drawn from copies shrunk by up to 2^this a side, no texel wider than a window pixel
+#define MAX_TILE_LEVEL 4
+#define MAX_ZOOM 16.0
+#define ZOOM_STEP 1.25
+#define DEFAULT_UNDO_MB 64
+// steps further back than this have their tiles compressed
+#define UNCOMPRESSED_STEPS 8
+#define DEFAULT_FILL_TOLERANCE 32
+// filled pixels are told apart by their alpha until a fill is done, which no wider tolerance would
+#define MAX_FILL_TOLERANCE 254
+// the most a fill reaches from where it starts across or down, and the size it is timed at
+#define MAX_FILL_SIZE 4096
 
 #define RGB_BLACK 0, 0, 0
 #define RGB_WHITE 255, 255, 255
@@ -16,12 +40,111 @@
 #define RGB_YELLOW 255, 255, 0
 #define RGB_CYAN 0, 255, 255
 #define RGB_MAGENTA 255, 0, 255
+#define RGB_GREY 128, 128, 128
 
 typedef struct
 {
     Uint8 r, g, b;
 } RGB_COLOR;
 
+enum BRUSH_SHAPES
+{
+    SHAPE_SQUARE,
+    SHAPE_ROUND,
+    SHAPE_SOFT,
+    SHAPE_TEXTURED,
+    SHAPES_SIZE
+};
+
+// Opacity is the most a stroke covers what was under it, and flow how much of the way
+// there each stamp goes. Hardness is how much of a soft brush is solid before it fades.
+// All three are percentages.
+typedef struct
+{
+    int shape, size, hardness, opacity, flow;
+} BRUSH;
+
+typedef struct
+{
+    int shape, size, hardness, flow;
+    Uint8 *alpha;
+} BRUSH_MASK;
+
+// the brush stamps gathered over a frame, filled into the canvas in one call
+typedef struct
+{
+    SDL_Rect *rects;
+    int count, capacity;
+} STAMP_LIST;
+
+// The pixels of one tile of the canvas at some point in its history. A block is shared
+// by the tile and every step it went through unchanged, is copied before a shared one
+// is drawn on, and is freed once none of them needs it. Compressed blocks hold runs of
+// (count, pixel) pairs, and only the history has those.
+typedef struct
+{
+    int refs;
+    SDL_bool compressed;
+    int size;
+    Uint32 *data;
+} TILE_BLOCK;
+
+// what a step did to one tile, with NULL for a tile still blank
+typedef struct
+{
+    int tile;
+    TILE_BLOCK *before, *after;
+} TILE_CHANGE;
+
+typedef struct
+{
+    TILE_CHANGE *changes;
+    int num_changes;
+} HISTORY_STEP;
+
+// Undo and redo over the tiles of the canvas. The steps before position are done and
+// the ones from it on have been undone. The stroke in progress gathers in pending, with
+// what each tile it has drawn on was before.
+typedef struct
+{
+    HISTORY_STEP *steps;
+    int num_steps, capacity, position;
+    HISTORY_STEP pending;
+    int pending_capacity;
+    size_t bytes, budget;
+    SDL_bool compress;
+} HISTORY;
+
+typedef struct
+{
+    // NULL while the tile is blank
+    TILE_BLOCK *block;
+    // only while the tile is in view, holding it shrunk by 2^level a side
+    SDL_Texture *texture;
+    int level;
+    SDL_bool dirty, touched;
+    // while a stroke draws on the tile, what it was before and how far the stroke covers it
+    const TILE_BLOCK *before;
+    Uint8 *coverage;
+} CANVAS_TILE;
+
+// A canvas far larger than the window, in tiles that only come to be once drawn on.
+// painted lists those tiles, and bytes counts the blocks they hold.
+typedef struct
+{
+    int width, height, tiles_x, tiles_y;
+    CANVAS_TILE **tiles;
+    int *painted;
+    int num_painted, painted_capacity;
+    size_t bytes;
+} CANVAS;
+
+// the part of the canvas in the window, from the canvas pixel at its top left
+typedef struct
+{
+    double x, y, zoom;
+} VIEW;
+
 enum COLORS
 {
     BLACK,
@@ -48,36 +171,141 @@ SDL_Rect color_rects[PALETTE_SIZE];
 
 int brush_sizes[BRUSHES_SIZE];
 SDL_Rect brush_rects[BRUSHES_SIZE];
+SDL_Rect fill_rect;
+
+const char *shape_names[SHAPES_SIZE] = {"square", "round", "soft", "textured"};
+BRUSH_MASK brush_masks[MASK_CACHE_SIZE];
+int next_brush_mask;
 
 void initPalette();
 void initBrushMenu();
 void renderPalette(SDL_Renderer *);
 void renderBrushMenu(SDL_Renderer *);
+SDL_bool overMenus(const SDL_Rect *);
+void addStamp(STAMP_LIST *, int, int, int);
+SDL_Point stampSegment(STAMP_LIST *, SDL_Point, SDL_Point, int);
+const Uint8 *brushMask(int, int, int, int);
+void freeBrushMasks();
+void paintStamps(HISTORY *, CANVAS *, STAMP_LIST *, RGB_COLOR, const BRUSH *);
+SDL_bool initCanvas(CANVAS *, int, int);
+SDL_Point canvasPoint(const VIEW *, int, int);
+void panView(VIEW *, const CANVAS *, int, int);
+void zoomView(VIEW *, const CANVAS *, int, int, double);
+void halvePixels(const Uint32 *, Uint32 *, int);
+void shrinkTile(const Uint32 *, Uint32 *, int);
+void renderCanvas(SDL_Renderer *, CANVAS *, const VIEW *);
+void freeCanvas(CANVAS *, HISTORY *);
+int floodFill(Uint32 *, int, int, int, int, int, Uint32, int, SDL_Rect *);
+void fillCanvas(HISTORY *, CANVAS *, const VIEW *, int, int, RGB_COLOR, int);
+void benchFill(int);
+void benchBrush(const BRUSH *);
+void commitStroke(HISTORY *, CANVAS *);
+void undoStep(HISTORY *, CANVAS *);
+void redoStep(HISTORY *, CANVAS *);
+void freeHistory(HISTORY *);
 
-int main()
+int main(int argc, char **argv)
 {
+    HISTORY history;
+    memset(&history, 0, sizeof(history));
+    history.budget = (size_t)DEFAULT_UNDO_MB << 20;
+    history.compress = SDL_TRUE;
+    int fill_tolerance = DEFAULT_FILL_TOLERANCE;
+    SDL_bool bench_fill = SDL_FALSE;
+    int canvas_width = MAX_CANVAS_SIZE, canvas_height = MAX_CANVAS_SIZE;
+    BRUSH brush = {SHAPE_SQUARE, BRUSH_SIZE_SMALL, 50, 100, 100};
+    SDL_bool bench_brush = SDL_FALSE;
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--undo-mb") && i + 1 < argc)
+        {
+            int megabytes = atoi(argv[++i]);
+            history.budget = (size_t)SDL_max(megabytes, 1) << 20;
+        }
+        else if (!strcmp(argv[i], "--undo-raw"))
+            history.compress = SDL_FALSE;
+        else if (!strcmp(argv[i], "--fill-tolerance") && i + 1 < argc)
+            fill_tolerance = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--bench-fill"))
+            bench_fill = SDL_TRUE;
+        else if (!strcmp(argv[i], "--canvas") && i + 1 < argc && sscanf(argv[i + 1], "%dx%d", &canvas_width, &canvas_height) == 2)
+            i++;
+        else if (!strcmp(argv[i], "--brush") && i + 1 < argc)
+        {
+            i++;
+            for (brush.shape = 0; brush.shape < SHAPES_SIZE && strcmp(argv[i], shape_names[brush.shape]); brush.shape++)
+                ;
+            if (brush.shape == SHAPES_SIZE)
+            {
+                printf("Brushes: square, round, soft, textured\n");
+                return 0;
+            }
+        }
+        else if (!strcmp(argv[i], "--brush-size") && i + 1 < argc)
+            brush.size = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--hardness") && i + 1 < argc)
+            brush.hardness = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--opacity") && i + 1 < argc)
+            brush.opacity = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--flow") && i + 1 < argc)
+            brush.flow = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--bench-brush"))
+            bench_brush = SDL_TRUE;
+        else
+        {
+            printf("Usage: ./paint [--canvas WxH] [--undo-mb N] [--undo-raw] [--fill-tolerance 0-%d] [--bench-fill]\n", MAX_FILL_TOLERANCE);
+            printf("               [--brush square|round|soft|textured] [--brush-size 1-%d] [--hardness %%] [--opacity %%] [--flow %%] [--bench-brush]\n", MAX_BRUSH_SIZE);
+            return 0;
+        }
+    }
+    brush.size = SDL_clamp(brush.size, 1, MAX_BRUSH_SIZE);
+    brush.hardness = SDL_clamp(brush.hardness, 0, 100);
+    brush.opacity = SDL_clamp(brush.opacity, 1, 100);
+    brush.flow = SDL_clamp(brush.flow, 1, 100);
+    if (bench_brush)
+    {
+        benchBrush(&brush);
+        return 0;
+    }
+    fill_tolerance = SDL_clamp(fill_tolerance, 0, MAX_FILL_TOLERANCE);
+    canvas_width = SDL_clamp(canvas_width, 1, MAX_CANVAS_SIZE);
+    canvas_height = SDL_clamp(canvas_height, 1, MAX_CANVAS_SIZE);
+    if (bench_fill)
+    {
+        benchFill(fill_tolerance);
+        return 0;
+    }
+    CANVAS canvas;
+    if (!initCanvas(&canvas, canvas_width, canvas_height))
+    {
+        printf("Could not create the canvas\n");
+        return 1;
+    }
+    printf("Ctrl+Z to undo, Ctrl+Y or Ctrl+Shift+Z to redo, [ and ] to change the fill tolerance\n");
+    printf("Drag with the right button to pan and use the wheel to zoom around the %dx%d canvas\n", canvas.width, canvas.height);
+    printf("B to change the brush, H its hardness, O its opacity and F its flow\n");
+
     SDL_Init(SDL_INIT_EVERYTHING);
     SDL_Window *window = SDL_CreateWindow("Paint", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, WIDTH, HEIGHT, 0);
     SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
 
     initPalette();
     initBrushMenu();
-
     SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_NONE);
-    SDL_SetRenderDrawColor(renderer, RGB_WHITE, SDL_ALPHA_OPAQUE);
-    SDL_RenderClear(renderer);
-    renderPalette(renderer);
-    renderBrushMenu(renderer);
-    SDL_RenderPresent(renderer);
 
     RGB_COLOR color_selected = rgb_colors[BLACK];
-    SDL_SetRenderDrawColor(renderer, color_selected.r, color_selected.g, color_selected.b, SDL_ALPHA_OPAQUE);
-    int brush_size = BRUSH_SIZE_SMALL;
+    STAMP_LIST stamps = {NULL, 0, 0};
+    VIEW view = {0, 0, 1};
+    // where the stroke in progress has got to on the canvas, and the pan in the window
+    SDL_Point stroke_end = {0, 0}, pan_from = {0, 0};
+    SDL_bool stroking = SDL_FALSE, panning = SDL_FALSE, redraw = SDL_TRUE, filling = SDL_FALSE;
     SDL_bool running = SDL_TRUE;
     while (running)
     {
+        // every event since the last frame is handled before anything is drawn, so that
+        // however often the mouse reports, its stamps go to the canvas in one batch
         SDL_Event event;
-        SDL_bool draw_occurred = SDL_FALSE;
+        stamps.count = 0;
         while (SDL_PollEvent(&event))
         {
             switch (event.type)
@@ -85,6 +313,9 @@ int main()
             case SDL_QUIT:
                 running = SDL_FALSE;
                 break;
+            case SDL_WINDOWEVENT:
+                redraw = SDL_TRUE;
+                break;
             case SDL_MOUSEBUTTONDOWN:
                 switch (event.button.button)
                 {
@@ -96,7 +327,6 @@ int main()
                         {
                             color_selected = rgb_colors[i];
                             printf("Color Selected: %u, %u, %u\n", color_selected.r, color_selected.g, color_selected.b);
-                            SDL_SetRenderDrawColor(renderer, color_selected.r, color_selected.g, color_selected.b, SDL_ALPHA_OPAQUE);
                             break;
                         }
                     }
@@ -104,33 +334,134 @@ int main()
                     {
                         if (SDL_HasIntersection(brush_rects + i, &click_pixel))
                         {
-                            brush_size = brush_sizes[i];
-                            printf("Brush Size: %u\n", brush_size);
+                            brush.size = brush_sizes[i];
+                            filling = SDL_FALSE;
+                            printf("Brush Size: %u\n", brush.size);
                         }
                     }
+                    if (SDL_HasIntersection(&fill_rect, &click_pixel))
+                    {
+                        filling = SDL_TRUE;
+                        printf("Fill Tolerance: %d\n", fill_tolerance);
+                    }
+                    else if (filling && !overMenus(&click_pixel))
+                    {
+                        paintStamps(&history, &canvas, &stamps, color_selected, &brush);
+                        commitStroke(&history, &canvas);
+                        fillCanvas(&history, &canvas, &view, event.button.x, event.button.y, color_selected, fill_tolerance);
+                        redraw = SDL_TRUE;
+                    }
+                    else if (!overMenus(&click_pixel))
+                    {
+                        stroke_end = canvasPoint(&view, event.button.x, event.button.y);
+                        stroking = SDL_TRUE;
+                        addStamp(&stamps, stroke_end.x, stroke_end.y, brush.size);
+                    }
+                    break;
+                case SDL_BUTTON_RIGHT:
+                    pan_from = (SDL_Point){event.button.x, event.button.y};
+                    panning = SDL_TRUE;
                     break;
                 }
                 break;
-            case SDL_MOUSEMOTION:
-                if (event.motion.state & SDL_BUTTON_LMASK)
+            case SDL_MOUSEBUTTONUP:
+                if (event.button.button == SDL_BUTTON_LEFT)
+                    stroking = SDL_FALSE;
+                else if (event.button.button == SDL_BUTTON_RIGHT)
+                    panning = SDL_FALSE;
+                break;
+            case SDL_MOUSEWHEEL:
+            {
+                int x, y;
+                SDL_GetMouseState(&x, &y);
+                zoomView(&view, &canvas, x, y, SDL_pow(ZOOM_STEP, event.wheel.y));
+                redraw = SDL_TRUE;
+                break;
+            }
+            case SDL_KEYDOWN:
+                if (event.key.keysym.sym == SDLK_LEFTBRACKET || event.key.keysym.sym == SDLK_RIGHTBRACKET)
+                {
+                    fill_tolerance += event.key.keysym.sym == SDLK_RIGHTBRACKET ? 8 : -8;
+                    fill_tolerance = SDL_clamp(fill_tolerance, 0, MAX_FILL_TOLERANCE);
+                    printf("Fill Tolerance: %d\n", fill_tolerance);
+                }
+                else if (event.key.keysym.mod & KMOD_CTRL)
                 {
-                    // dont draw over palette or brush menu
-                    SDL_Rect draw_rect = {event.motion.x - brush_size / 2, event.motion.y - brush_size / 2, brush_size, brush_size};
-                    SDL_Rect palette_rect = {color_rects[0].x, color_rects[0].y, COLOR_RECT_SIZE * PALETTE_SIZE, COLOR_RECT_SIZE};
-                    SDL_Rect brush_menu_rect = {brush_rects[0].x, brush_rects[0].y, BRUSH_SIZE_LARGE * BRUSHES_SIZE, BRUSH_SIZE_LARGE};
-                    if (!SDL_HasIntersection(&draw_rect, &palette_rect) && !SDL_HasIntersection(&draw_rect, &brush_menu_rect))
+                    SDL_Keycode key = event.key.keysym.sym;
+                    SDL_bool redo = key == SDLK_y || (key == SDLK_z && (event.key.keysym.mod & KMOD_SHIFT));
+                    if (key != SDLK_z && !redo)
+                        break;
+                    // the stamps so far go to the canvas and the stroke into the history first
+                    paintStamps(&history, &canvas, &stamps, color_selected, &brush);
+                    commitStroke(&history, &canvas);
+                    stroking = SDL_FALSE;
+                    if (redo)
+                        redoStep(&history, &canvas);
+                    else
+                        undoStep(&history, &canvas);
+                    redraw = SDL_TRUE;
+                }
+                else
+                {
+                    // each key steps through a few settings, coming back round to the first, and any
+                    // other goes on to the next event
+                    switch (event.key.keysym.sym)
                     {
-                        SDL_RenderFillRect(renderer, &draw_rect);
-                        draw_occurred = SDL_TRUE;
+                    case SDLK_b:
+                        brush.shape = (brush.shape + 1) % SHAPES_SIZE;
+                        break;
+                    case SDLK_h:
+                        brush.hardness = (brush.hardness + 25) % 125;
+                        break;
+                    case SDLK_o:
+                        brush.opacity = brush.opacity > 25 ? brush.opacity - 25 : 100;
+                        break;
+                    case SDLK_f:
+                        brush.flow = brush.flow > 10 ? brush.flow / 2 : 100;
+                        break;
+                    default:
+                        continue;
                     }
+                    printf("Brush: %s, hardness %d%%, opacity %d%%, flow %d%%\n", shape_names[brush.shape], brush.hardness, brush.opacity, brush.flow);
+                }
+                break;
+            case SDL_MOUSEMOTION:
+                if (panning && (event.motion.state & SDL_BUTTON_RMASK))
+                {
+                    panView(&view, &canvas, event.motion.x - pan_from.x, event.motion.y - pan_from.y);
+                    pan_from = (SDL_Point){event.motion.x, event.motion.y};
+                    redraw = SDL_TRUE;
+                }
+                // only a press on the canvas starts a stroke, so dragging off the menus draws nothing
+                if (stroking && (event.motion.state & SDL_BUTTON_LMASK))
+                {
+                    SDL_Point point = canvasPoint(&view, event.motion.x, event.motion.y);
+                    stroke_end = stampSegment(&stamps, stroke_end, point, brush.size);
                 }
             }
         }
-        if (draw_occurred)
+        if (stamps.count)
+        {
+            paintStamps(&history, &canvas, &stamps, color_selected, &brush);
+            redraw = SDL_TRUE;
+        }
+        if (!stroking)
+            commitStroke(&history, &canvas);
+        if (redraw)
+        {
+            renderCanvas(renderer, &canvas, &view);
+            renderPalette(renderer);
+            renderBrushMenu(renderer);
             SDL_RenderPresent(renderer);
+            redraw = SDL_FALSE;
+        }
         SDL_Delay(1000 / FPS);
     }
 
+    free(stamps.rects);
+    freeHistory(&history);
+    freeCanvas(&canvas, &history);
+    freeBrushMasks();
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
     SDL_Quit();
@@ -173,6 +504,7 @@ void initBrushMenu()
         offset_from_right += brush_sizes[i];
         brush_rects[i] = (SDL_Rect){WIDTH - offset_from_right, 0, brush_sizes[i], brush_sizes[i]};
     }
+    fill_rect = (SDL_Rect){brush_rects[0].x - 2 * BRUSH_SIZE_LARGE, 0, BRUSH_SIZE_LARGE, BRUSH_SIZE_LARGE};
 }
 
 void renderBrushMenu(SDL_Renderer *renderer)
@@ -180,4 +512,999 @@ void renderBrushMenu(SDL_Renderer *renderer)
     SDL_SetRenderDrawColor(renderer, RGB_BLACK, SDL_ALPHA_OPAQUE);
     for (int i = 0; i < BRUSHES_SIZE; i++)
         SDL_RenderDrawRect(renderer, brush_rects + i);
-}
\ No newline at end of file
+    // the bucket, as a box with its lower half filled
+    SDL_Rect bucket = {fill_rect.x, fill_rect.y + fill_rect.h / 2, fill_rect.w, fill_rect.h / 2};
+    SDL_RenderDrawRect(renderer, &fill_rect);
+    SDL_RenderFillRect(renderer, &bucket);
+}
+
+// clicks on the palette or the menus don't draw
+SDL_bool overMenus(const SDL_Rect *rect)
+{
+    SDL_Rect palette_rect = {color_rects[0].x, color_rects[0].y, COLOR_RECT_SIZE * PALETTE_SIZE, COLOR_RECT_SIZE};
+    SDL_Rect brush_menu_rect = {brush_rects[0].x, brush_rects[0].y, BRUSH_SIZE_LARGE * BRUSHES_SIZE, BRUSH_SIZE_LARGE};
+    return SDL_HasIntersection(rect, &palette_rect) || SDL_HasIntersection(rect, &brush_menu_rect) || SDL_HasIntersection(rect, &fill_rect);
+}
+
+void addStamp(STAMP_LIST *stamps, int x, int y, int brush_size)
+{
+    SDL_Rect stamp = {x - brush_size / 2, y - brush_size / 2, brush_size, brush_size};
+    if (stamps->count == stamps->capacity)
+    {
+        int capacity = stamps->capacity ? stamps->capacity * 2 : 256;
+        SDL_Rect *rects = (SDL_Rect *)realloc(stamps->rects, capacity * sizeof(SDL_Rect));
+        if (!rects)
+            return;
+        stamps->rects = rects;
+        stamps->capacity = capacity;
+    }
+    stamps->rects[stamps->count++] = stamp;
+}
+
+// Stamps the line from one point to the next at the brush's spacing, leaving out the
+// first as it was stamped already, and returns the last point stamped for the next line
+// to go on from. Stepping a pixel at a time along the longer axis leaves no gaps however
+// far the mouse moved between events.
+SDL_Point stampSegment(STAMP_LIST *stamps, SDL_Point from, SDL_Point to, int brush_size)
+{
+    int dx = to.x - from.x, dy = to.y - from.y;
+    int steps = SDL_max(abs(dx), abs(dy)), spacing = SDL_max(brush_size / BRUSH_SPACING, 1);
+    SDL_Point last = from;
+    for (int i = spacing; i <= steps; i += spacing)
+    {
+        // to the nearest pixel, rounding halves away from the start
+        last.x = from.x + (int)((2 * (Sint64)dx * i + (dx < 0 ? -steps : steps)) / (2 * steps));
+        last.y = from.y + (int)((2 * (Sint64)dy * i + (dy < 0 ? -steps : steps)) / (2 * steps));
+        addStamp(stamps, last.x, last.y, brush_size);
+    }
+    return last;
+}
+
+// spreads bits of a pixel's position all through a number, for brush texture
+Uint32 hashPoint(int x, int y)
+{
+    Uint32 hash = (Uint32)x * 0x8DA6B343u ^ (Uint32)y * 0xD8163841u;
+    hash ^= hash >> 15;
+    hash *= 0x2C1B3C6Du;
+    return hash ^ hash >> 12;
+}
+
+// The alpha of each pixel of a brush stamp at a flow, made once for each size, hardness
+// and flow and kept while it is among the last few used
+const Uint8 *brushMask(int shape, int size, int hardness, int flow)
+{
+    for (int i = 0; i < MASK_CACHE_SIZE; i++)
+    {
+        const BRUSH_MASK *mask = &brush_masks[i];
+        if (mask->alpha && mask->shape == shape && mask->size == size && mask->flow == flow && (mask->hardness == hardness || shape < SHAPE_SOFT))
+            return mask->alpha;
+    }
+    Uint8 *alpha = (Uint8 *)malloc((size_t)size * size);
+    if (!alpha)
+        return NULL;
+    float radius = size / 2.0f, solid = radius * hardness / 100;
+    for (int y = 0; y < size; y++)
+    {
+        for (int x = 0; x < size; x++)
+        {
+            float dx = x + 0.5f - radius, dy = y + 0.5f - radius;
+            float distance = SDL_sqrtf(dx * dx + dy * dy), value = 1;
+            if (shape == SHAPE_ROUND)
+                value = SDL_clamp(radius - distance + 0.5f, 0.0f, 1.0f);
+            else if (shape >= SHAPE_SOFT)
+            {
+                // a gaussian from the solid middle out, at three deviations by the edge
+                float t = (distance - solid) / SDL_max(radius - solid, 0.5f);
+                value = t <= 0 ? 1 : t >= 1 ? 0 : SDL_expf(-4.5f * t * t);
+                if (shape == SHAPE_TEXTURED)
+                    value *= 0.25f + 0.75f * (hashPoint(x, y) >> 24) / 255.0f;
+            }
+            alpha[y * size + x] = (Uint8)(value * flow * 255 / 100 + 0.5f);
+        }
+    }
+    BRUSH_MASK *mask = &brush_masks[next_brush_mask];
+    next_brush_mask = (next_brush_mask + 1) % MASK_CACHE_SIZE;
+    free(mask->alpha);
+    *mask = (BRUSH_MASK){shape, size, hardness, flow, alpha};
+    return alpha;
+}
+
+void freeBrushMasks()
+{
+    for (int i = 0; i < MASK_CACHE_SIZE; i++)
+    {
+        free(brush_masks[i].alpha);
+        brush_masks[i].alpha = NULL;
+    }
+}
+
+// x / 255 for x up to 255 * 255, rounded
+int divide255(int x)
+{
+    x += 128;
+    return (x + (x >> 8)) >> 8;
+}
+
+#ifdef __SSE2__
+__m128i divide255Lanes(__m128i x)
+{
+    x = _mm_add_epi16(x, _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+#endif
+
+// Takes the stroke's coverage of a span further by a stamp's mask, and blends the colour
+// over what the span was before the stroke, white when before is NULL, at that coverage
+// of the opacity. Blending is the premultiplied over: the colour times alpha, and what was
+// there times what alpha leaves of it.
+void blendSpan(Uint32 *out, const Uint32 *before, Uint8 *coverage, const Uint8 *mask, int count, Uint32 color, int opacity)
+{
+    int x = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128(), full = _mm_set1_epi16(255), opacity16 = _mm_set1_epi16((short)opacity);
+    const __m128i color16 = _mm_unpacklo_epi8(_mm_set1_epi32((int)color), zero);
+    for (; x + 8 <= count; x += 8)
+    {
+        __m128i old = _mm_loadl_epi64((const __m128i *)(coverage + x));
+        __m128i c = _mm_unpacklo_epi8(old, zero), m = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(mask + x)), zero);
+        c = _mm_add_epi16(c, divide255Lanes(_mm_mullo_epi16(m, _mm_sub_epi16(full, c))));
+        __m128i covered = _mm_packus_epi16(c, zero);
+        // pixels whose coverage stays the same were blended to it already
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(covered, old)) == 0xFFFF)
+            continue;
+        _mm_storel_epi64((__m128i *)(coverage + x), covered);
+
+        // each pixel's alpha across its four channels, two pixels to a register
+        __m128i alpha = divide255Lanes(_mm_mullo_epi16(c, opacity16));
+        __m128i alpha4[2] = {_mm_unpacklo_epi16(alpha, alpha), _mm_unpackhi_epi16(alpha, alpha)};
+        for (int half = 0; half < 2; half++)
+        {
+            __m128i pixels = before ? _mm_loadu_si128((const __m128i *)(before + x + half * 4)) : _mm_set1_epi32(-1);
+            __m128i alpha_low = _mm_unpacklo_epi32(alpha4[half], alpha4[half]), alpha_high = _mm_unpackhi_epi32(alpha4[half], alpha4[half]);
+            __m128i low = _mm_add_epi16(_mm_mullo_epi16(color16, alpha_low), _mm_mullo_epi16(_mm_unpacklo_epi8(pixels, zero), _mm_sub_epi16(full, alpha_low)));
+            __m128i high = _mm_add_epi16(_mm_mullo_epi16(color16, alpha_high), _mm_mullo_epi16(_mm_unpackhi_epi8(pixels, zero), _mm_sub_epi16(full, alpha_high)));
+            _mm_storeu_si128((__m128i *)(out + x + half * 4), _mm_packus_epi16(divide255Lanes(low), divide255Lanes(high)));
+        }
+    }
+#endif
+    for (; x < count; x++)
+    {
+        int covered = coverage[x] + divide255(mask[x] * (255 - coverage[x]));
+        if (covered == coverage[x])
+            continue;
+        coverage[x] = covered;
+        int alpha = divide255(covered * opacity);
+        Uint32 pixel = before ? before[x] : 0xFFFFFFFF, blended = 0;
+        for (int shift = 0; shift < 32; shift += 8)
+            blended |= (Uint32)divide255((color >> shift & 0xFF) * alpha + (pixel >> shift & 0xFF) * (255 - alpha)) << shift;
+        out[x] = blended;
+    }
+}
+
+void releaseBlock(HISTORY *history, TILE_BLOCK *block)
+{
+    if (!block || --block->refs)
+        return;
+    history->bytes -= sizeof(TILE_BLOCK) + block->size;
+    free(block->data);
+    free(block);
+}
+
+// the pixels of a tile as a block has them, white for a blank tile
+void blockPixels(const TILE_BLOCK *block, Uint32 *pixels, int count)
+{
+    if (!block)
+    {
+        for (int i = 0; i < count; i++)
+            pixels[i] = 0xFFFFFFFF;
+    }
+    else if (!block->compressed)
+        memcpy(pixels, block->data, count * sizeof(Uint32));
+    else
+    {
+        const Uint32 *run = block->data, *end = block->data + block->size / sizeof(Uint32);
+        for (; run < end; run += 2)
+        {
+            for (Uint32 i = 0; i < run[0]; i++)
+                *pixels++ = run[1];
+        }
+    }
+}
+
+// a copy of a block's pixels, or a white block for none
+TILE_BLOCK *newBlock(HISTORY *history, const TILE_BLOCK *from)
+{
+    int count = CANVAS_TILE_SIZE * CANVAS_TILE_SIZE;
+    TILE_BLOCK *block = (TILE_BLOCK *)malloc(sizeof(TILE_BLOCK));
+    Uint32 *data = (Uint32 *)malloc(count * sizeof(Uint32));
+    if (!block || !data)
+    {
+        free(block);
+        free(data);
+        return NULL;
+    }
+    *block = (TILE_BLOCK){1, SDL_FALSE, count * (int)sizeof(Uint32), data};
+    blockPixels(from, data, count);
+    history->bytes += sizeof(TILE_BLOCK) + block->size;
+    return block;
+}
+
+SDL_bool decompressBlock(HISTORY *history, TILE_BLOCK *block)
+{
+    if (!block->compressed)
+        return SDL_TRUE;
+    int count = CANVAS_TILE_SIZE * CANVAS_TILE_SIZE;
+    Uint32 *data = (Uint32 *)malloc(count * sizeof(Uint32));
+    if (!data)
+        return SDL_FALSE;
+    blockPixels(block, data, count);
+    free(block->data);
+    history->bytes += count * sizeof(Uint32) - block->size;
+    block->data = data;
+    block->size = count * sizeof(Uint32);
+    block->compressed = SDL_FALSE;
+    return SDL_TRUE;
+}
+
+// run length encodes a block in place, unless that would not make it smaller
+void compressBlock(HISTORY *history, TILE_BLOCK *block)
+{
+    if (!block || block->compressed)
+        return;
+    int count = block->size / (int)sizeof(Uint32), num_runs = 0;
+    for (int i = 0; i < count; i++)
+        num_runs += !i || block->data[i] != block->data[i - 1];
+    if (num_runs * 2 >= count)
+        return;
+    Uint32 *runs = (Uint32 *)malloc(num_runs * 2 * sizeof(Uint32));
+    if (!runs)
+        return;
+    int r = -1;
+    for (int i = 0; i < count; i++)
+    {
+        if (!i || block->data[i] != block->data[i - 1])
+        {
+            r++;
+            runs[r * 2] = 0;
+            runs[r * 2 + 1] = block->data[i];
+        }
+        runs[r * 2]++;
+    }
+    free(block->data);
+    history->bytes -= block->size - num_runs * 2 * sizeof(Uint32);
+    block->data = runs;
+    block->size = num_runs * 2 * sizeof(Uint32);
+    block->compressed = SDL_TRUE;
+}
+
+void freeStep(HISTORY *history, HISTORY_STEP *step)
+{
+    for (int i = 0; i < step->num_changes; i++)
+    {
+        releaseBlock(history, step->changes[i].before);
+        releaseBlock(history, step->changes[i].after);
+    }
+    free(step->changes);
+}
+
+// hands a tile a block, whose reference it takes over from the caller
+void setTileBlock(HISTORY *history, CANVAS *canvas, CANVAS_TILE *tile, TILE_BLOCK *block)
+{
+    canvas->bytes += block ? sizeof(TILE_BLOCK) + block->size : 0;
+    canvas->bytes -= tile->block ? sizeof(TILE_BLOCK) + tile->block->size : 0;
+    releaseBlock(history, tile->block);
+    tile->block = block;
+}
+
+// The pixels of a tile made ready to draw on: a tile never drawn on comes to be, a
+// blank one gets a white block and one shared with the history is copied. What the
+// tile was goes to the stroke in progress the first time the stroke draws on it.
+Uint32 *writeTile(HISTORY *history, CANVAS *canvas, int index)
+{
+    CANVAS_TILE *tile = canvas->tiles[index];
+    if (!tile)
+    {
+        if (canvas->num_painted == canvas->painted_capacity)
+        {
+            int capacity = canvas->painted_capacity ? canvas->painted_capacity * 2 : 256;
+            int *painted = (int *)realloc(canvas->painted, capacity * sizeof(int));
+            if (!painted)
+                return NULL;
+            canvas->painted = painted;
+            canvas->painted_capacity = capacity;
+        }
+        tile = (CANVAS_TILE *)calloc(1, sizeof(CANVAS_TILE));
+        if (!tile)
+            return NULL;
+        canvas->tiles[index] = tile;
+        canvas->painted[canvas->num_painted++] = index;
+    }
+    if (!tile->touched)
+    {
+        if (history->pending.num_changes == history->pending_capacity)
+        {
+            int capacity = history->pending_capacity ? history->pending_capacity * 2 : 64;
+            TILE_CHANGE *changes = (TILE_CHANGE *)realloc(history->pending.changes, capacity * sizeof(TILE_CHANGE));
+            if (!changes)
+                return NULL;
+            history->pending.changes = changes;
+            history->pending_capacity = capacity;
+        }
+        if (tile->block)
+            tile->block->refs++;
+        history->pending.changes[history->pending.num_changes++] = (TILE_CHANGE){index, tile->block, NULL};
+        tile->touched = SDL_TRUE;
+        tile->before = tile->block;
+    }
+    if (!tile->block || tile->block->refs > 1)
+    {
+        TILE_BLOCK *block = newBlock(history, tile->block);
+        if (!block)
+            return NULL;
+        setTileBlock(history, canvas, tile, block);
+    }
+    tile->dirty = SDL_TRUE;
+    return tile->block->data;
+}
+
+// Writes a rectangle of the canvas, from rows of pixels when given and otherwise all in
+// one colour. The rectangle has to be within the canvas.
+void writeRect(HISTORY *history, CANVAS *canvas, const SDL_Rect *rect, const Uint32 *pixels, int pitch, Uint32 color)
+{
+    for (int tile_y = rect->y / CANVAS_TILE_SIZE; tile_y <= (rect->y + rect->h - 1) / CANVAS_TILE_SIZE; tile_y++)
+    {
+        for (int tile_x = rect->x / CANVAS_TILE_SIZE; tile_x <= (rect->x + rect->w - 1) / CANVAS_TILE_SIZE; tile_x++)
+        {
+            Uint32 *tile_pixels = writeTile(history, canvas, tile_y * canvas->tiles_x + tile_x);
+            if (!tile_pixels)
+                continue;
+            int left = tile_x * CANVAS_TILE_SIZE, top = tile_y * CANVAS_TILE_SIZE;
+            int x0 = SDL_max(rect->x, left), x1 = SDL_min(rect->x + rect->w, left + CANVAS_TILE_SIZE);
+            int y0 = SDL_max(rect->y, top), y1 = SDL_min(rect->y + rect->h, top + CANVAS_TILE_SIZE);
+            for (int y = y0; y < y1; y++)
+            {
+                Uint32 *row = tile_pixels + (y - top) * CANVAS_TILE_SIZE + x0 - left;
+                if (pixels)
+                    memcpy(row, pixels + (size_t)(y - rect->y) * pitch + x0 - rect->x, (x1 - x0) * sizeof(Uint32));
+                else
+                    SDL_memset4(row, color, x1 - x0);
+            }
+        }
+    }
+}
+
+// copies a rectangle within the canvas out into rows of pixels, white where it is blank
+void readRect(const CANVAS *canvas, const SDL_Rect *rect, Uint32 *pixels, int pitch)
+{
+    for (int tile_y = rect->y / CANVAS_TILE_SIZE; tile_y <= (rect->y + rect->h - 1) / CANVAS_TILE_SIZE; tile_y++)
+    {
+        for (int tile_x = rect->x / CANVAS_TILE_SIZE; tile_x <= (rect->x + rect->w - 1) / CANVAS_TILE_SIZE; tile_x++)
+        {
+            const CANVAS_TILE *tile = canvas->tiles[tile_y * canvas->tiles_x + tile_x];
+            int left = tile_x * CANVAS_TILE_SIZE, top = tile_y * CANVAS_TILE_SIZE;
+            int x0 = SDL_max(rect->x, left), x1 = SDL_min(rect->x + rect->w, left + CANVAS_TILE_SIZE);
+            int y0 = SDL_max(rect->y, top), y1 = SDL_min(rect->y + rect->h, top + CANVAS_TILE_SIZE);
+            for (int y = y0; y < y1; y++)
+            {
+                Uint32 *row = pixels + (size_t)(y - rect->y) * pitch + x0 - rect->x;
+                if (tile && tile->block)
+                    memcpy(row, tile->block->data + (y - top) * CANVAS_TILE_SIZE + x0 - left, (x1 - x0) * sizeof(Uint32));
+                else
+                    SDL_memset4(row, 0xFFFFFFFF, x1 - x0);
+            }
+        }
+    }
+}
+
+// Blends the stamps gathered into the canvas, as far as they are on it. Every pixel a
+// stroke covers is blended afresh from what it was before the stroke, so that stamps
+// overlapping build up to the brush's opacity and no further.
+void paintStamps(HISTORY *history, CANVAS *canvas, STAMP_LIST *stamps, RGB_COLOR color, const BRUSH *brush)
+{
+    SDL_Rect page = {0, 0, canvas->width, canvas->height};
+    Uint32 argb = 0xFF000000 | (Uint32)color.r << 16 | (Uint32)color.g << 8 | color.b;
+    int opacity = (brush->opacity * 255 + 50) / 100;
+    for (int i = 0; i < stamps->count; i++)
+    {
+        const SDL_Rect *stamp = &stamps->rects[i];
+        const Uint8 *mask = brushMask(brush->shape, stamp->w, brush->hardness, brush->flow);
+        SDL_Rect rect;
+        if (!mask || !SDL_IntersectRect(stamp, &page, &rect))
+            continue;
+        for (int tile_y = rect.y / CANVAS_TILE_SIZE; tile_y <= (rect.y + rect.h - 1) / CANVAS_TILE_SIZE; tile_y++)
+        {
+            for (int tile_x = rect.x / CANVAS_TILE_SIZE; tile_x <= (rect.x + rect.w - 1) / CANVAS_TILE_SIZE; tile_x++)
+            {
+                Uint32 *tile_pixels = writeTile(history, canvas, tile_y * canvas->tiles_x + tile_x);
+                CANVAS_TILE *tile = canvas->tiles[tile_y * canvas->tiles_x + tile_x];
+                if (!tile_pixels || (!tile->coverage && !(tile->coverage = (Uint8 *)calloc(CANVAS_TILE_SIZE * CANVAS_TILE_SIZE, 1))))
+                    continue;
+                int left = tile_x * CANVAS_TILE_SIZE, top = tile_y * CANVAS_TILE_SIZE;
+                int x0 = SDL_max(rect.x, left), x1 = SDL_min(rect.x + rect.w, left + CANVAS_TILE_SIZE);
+                int y0 = SDL_max(rect.y, top), y1 = SDL_min(rect.y + rect.h, top + CANVAS_TILE_SIZE);
+                for (int y = y0; y < y1; y++)
+                {
+                    int offset = (y - top) * CANVAS_TILE_SIZE + x0 - left;
+                    blendSpan(tile_pixels + offset, tile->before ? tile->before->data + offset : NULL, tile->coverage + offset,
+                              mask + (y - stamp->y) * stamp->w + x0 - stamp->x, x1 - x0, argb, opacity);
+                }
+            }
+        }
+    }
+    stamps->count = 0;
+}
+
+// Records the tiles the stroke in progress changed as one step of the history. Steps
+// that were undone are dropped, as they can no longer be redone, and the oldest go while
+// the history holds more than its budget beyond what the canvas itself does.
+void commitStroke(HISTORY *history, CANVAS *canvas)
+{
+    if (!history->pending.num_changes)
+        return;
+    HISTORY_STEP step = history->pending;
+    history->pending = (HISTORY_STEP){NULL, 0};
+    history->pending_capacity = 0;
+
+    Uint32 *previous = (Uint32 *)malloc(CANVAS_TILE_SIZE * CANVAS_TILE_SIZE * sizeof(Uint32));
+    int num_changes = 0;
+    for (int i = 0; i < step.num_changes; i++)
+    {
+        TILE_CHANGE change = step.changes[i];
+        CANVAS_TILE *tile = canvas->tiles[change.tile];
+        tile->touched = SDL_FALSE;
+        tile->before = NULL;
+        free(tile->coverage);
+        tile->coverage = NULL;
+        if (tile->block == change.before)
+        {
+            releaseBlock(history, change.before);
+            continue;
+        }
+        // painting a tile the colour it already was changes nothing worth keeping, so it
+        // goes back to sharing the block it had
+        if (previous)
+        {
+            blockPixels(change.before, previous, CANVAS_TILE_SIZE * CANVAS_TILE_SIZE);
+            if (!memcmp(previous, tile->block->data, tile->block->size))
+            {
+                setTileBlock(history, canvas, tile, change.before);
+                continue;
+            }
+        }
+        change.after = tile->block;
+        change.after->refs++;
+        step.changes[num_changes++] = change;
+    }
+    free(previous);
+    step.num_changes = num_changes;
+    if (!num_changes)
+    {
+        free(step.changes);
+        return;
+    }
+
+    while (history->num_steps > history->position)
+        freeStep(history, &history->steps[--history->num_steps]);
+    if (history->num_steps == history->capacity)
+    {
+        int capacity = history->capacity ? history->capacity * 2 : 64;
+        HISTORY_STEP *steps = (HISTORY_STEP *)realloc(history->steps, capacity * sizeof(HISTORY_STEP));
+        if (!steps)
+        {
+            // the canvas has moved on all the same, so the history before it is no use
+            freeStep(history, &step);
+            while (history->num_steps)
+                freeStep(history, &history->steps[--history->num_steps]);
+            history->position = 0;
+            return;
+        }
+        history->steps = steps;
+        history->capacity = capacity;
+    }
+    history->steps[history->num_steps++] = step;
+    history->position = history->num_steps;
+
+    // a step at a time as it falls far enough behind, so that none has to wait for many
+    if (history->compress && history->num_steps > UNCOMPRESSED_STEPS)
+    {
+        HISTORY_STEP *old = &history->steps[history->num_steps - 1 - UNCOMPRESSED_STEPS];
+        for (int i = 0; i < old->num_changes; i++)
+        {
+            const TILE_BLOCK *current = canvas->tiles[old->changes[i].tile]->block;
+            if (old->changes[i].before != current)
+                compressBlock(history, old->changes[i].before);
+            if (old->changes[i].after != current)
+                compressBlock(history, old->changes[i].after);
+        }
+    }
+    while (history->bytes > canvas->bytes + history->budget && history->num_steps > 1)
+    {
+        freeStep(history, &history->steps[0]);
+        memmove(history->steps, history->steps + 1, (history->num_steps - 1) * sizeof(HISTORY_STEP));
+        history->num_steps--;
+        history->position--;
+    }
+}
+
+// makes a block the present of a tile again, for it to be uploaded when next in view
+void restoreTile(HISTORY *history, CANVAS *canvas, int index, TILE_BLOCK *block)
+{
+    if (block)
+    {
+        if (!decompressBlock(history, block))
+            return;
+        block->refs++;
+    }
+    setTileBlock(history, canvas, canvas->tiles[index], block);
+    canvas->tiles[index]->dirty = SDL_TRUE;
+}
+
+void undoStep(HISTORY *history, CANVAS *canvas)
+{
+    if (!history->position)
+        return;
+    const HISTORY_STEP *step = &history->steps[--history->position];
+    for (int i = 0; i < step->num_changes; i++)
+        restoreTile(history, canvas, step->changes[i].tile, step->changes[i].before);
+    printf("Undo: %d of %d steps, %.1f MB of history\n", history->position, history->num_steps, (history->bytes - canvas->bytes) / 1048576.0);
+}
+
+void redoStep(HISTORY *history, CANVAS *canvas)
+{
+    if (history->position == history->num_steps)
+        return;
+    const HISTORY_STEP *step = &history->steps[history->position++];
+    for (int i = 0; i < step->num_changes; i++)
+        restoreTile(history, canvas, step->changes[i].tile, step->changes[i].after);
+    printf("Redo: %d of %d steps, %.1f MB of history\n", history->position, history->num_steps, (history->bytes - canvas->bytes) / 1048576.0);
+}
+
+void freeHistory(HISTORY *history)
+{
+    while (history->num_steps)
+        freeStep(history, &history->steps[--history->num_steps]);
+    freeStep(history, &history->pending);
+    history->pending = (HISTORY_STEP){NULL, 0};
+    free(history->steps);
+}
+
+SDL_bool initCanvas(CANVAS *canvas, int width, int height)
+{
+    memset(canvas, 0, sizeof(CANVAS));
+    canvas->width = width;
+    canvas->height = height;
+    canvas->tiles_x = (width + CANVAS_TILE_SIZE - 1) / CANVAS_TILE_SIZE;
+    canvas->tiles_y = (height + CANVAS_TILE_SIZE - 1) / CANVAS_TILE_SIZE;
+    canvas->tiles = (CANVAS_TILE **)calloc((size_t)canvas->tiles_x * canvas->tiles_y, sizeof(CANVAS_TILE *));
+    return canvas->tiles != NULL;
+}
+
+// the canvas pixel under the centre of a pixel of the window
+SDL_Point canvasPoint(const VIEW *view, int x, int y)
+{
+    return (SDL_Point){(int)SDL_floor(view->x + (x + 0.5) / view->zoom), (int)SDL_floor(view->y + (y + 0.5) / view->zoom)};
+}
+
+// keeps at least the middle of the window over the canvas
+void clampView(VIEW *view, const CANVAS *canvas)
+{
+    double half_width = WIDTH / view->zoom / 2, half_height = HEIGHT / view->zoom / 2;
+    view->x = SDL_clamp(view->x, -half_width, canvas->width - half_width);
+    view->y = SDL_clamp(view->y, -half_height, canvas->height - half_height);
+}
+
+void panView(VIEW *view, const CANVAS *canvas, int dx, int dy)
+{
+    view->x -= dx / view->zoom;
+    view->y -= dy / view->zoom;
+    clampView(view, canvas);
+}
+
+// zooms by a factor, keeping the canvas pixel under a point of the window where it is
+void zoomView(VIEW *view, const CANVAS *canvas, int x, int y, double factor)
+{
+    double canvas_x = view->x + x / view->zoom, canvas_y = view->y + y / view->zoom;
+    view->zoom = SDL_clamp(view->zoom * factor, MIN_ZOOM, MAX_ZOOM);
+    view->x = canvas_x - x / view->zoom;
+    view->y = canvas_y - y / view->zoom;
+    clampView(view, canvas);
+}
+
+// The window pixels whose centres fall in a rectangle of the canvas. Working out each
+// edge on its own lets neighbouring tiles meet without seams or overlaps.
+SDL_Rect screenRect(const VIEW *view, int x, int y, int w, int h)
+{
+    int left = (int)SDL_ceil((x - view->x) * view->zoom - 0.5), top = (int)SDL_ceil((y - view->y) * view->zoom - 0.5);
+    int right = (int)SDL_ceil((x + w - view->x) * view->zoom - 0.5), bottom = (int)SDL_ceil((y + h - view->y) * view->zoom - 0.5);
+    return (SDL_Rect){left, top, right - left, bottom - top};
+}
+
+// halves a square of pixels size a side, which may be done in place, each new pixel the
+// average of the four it covers
+void halvePixels(const Uint32 *pixels, Uint32 *halved, int size)
+{
+    int half = size / 2;
+    for (int y = 0; y < half; y++)
+    {
+        const Uint32 *top = pixels + 2 * y * size, *bottom = top + size;
+        Uint32 *out = halved + y * half;
+        int x = 0;
+#ifdef __SSE2__
+        for (; x + 4 <= half; x += 4)
+        {
+            __m128i left = _mm_avg_epu8(_mm_loadu_si128((const __m128i *)(top + 2 * x)), _mm_loadu_si128((const __m128i *)(bottom + 2 * x)));
+            __m128i right = _mm_avg_epu8(_mm_loadu_si128((const __m128i *)(top + 2 * x + 4)), _mm_loadu_si128((const __m128i *)(bottom + 2 * x + 4)));
+            __m128 even = _mm_shuffle_ps(_mm_castsi128_ps(left), _mm_castsi128_ps(right), _MM_SHUFFLE(2, 0, 2, 0));
+            __m128 odd = _mm_shuffle_ps(_mm_castsi128_ps(left), _mm_castsi128_ps(right), _MM_SHUFFLE(3, 1, 3, 1));
+            _mm_storeu_si128((__m128i *)(out + x), _mm_avg_epu8(_mm_castps_si128(even), _mm_castps_si128(odd)));
+        }
+#endif
+        for (; x < half; x++)
+        {
+            Uint32 pixel = 0;
+            for (int shift = 0; shift < 32; shift += 8)
+            {
+                int left = ((top[2 * x] >> shift & 0xFF) + (bottom[2 * x] >> shift & 0xFF) + 1) >> 1;
+                int right = ((top[2 * x + 1] >> shift & 0xFF) + (bottom[2 * x + 1] >> shift & 0xFF) + 1) >> 1;
+                pixel |= (Uint32)((left + right + 1) >> 1) << shift;
+            }
+            out[x] = pixel;
+        }
+    }
+}
+
+// a tile's pixels shrunk by 2^level a side, halved level times
+void shrinkTile(const Uint32 *pixels, Uint32 *shrunk, int level)
+{
+    halvePixels(pixels, shrunk, CANVAS_TILE_SIZE);
+    for (int size = CANVAS_TILE_SIZE / 2; size > CANVAS_TILE_SIZE >> level; size /= 2)
+        halvePixels(shrunk, shrunk, size);
+}
+
+// Draws the tiles in view over a white page. Tiles get a texture when they come into
+// view and lose it when they leave, and are only uploaded again once drawn on. Zoomed
+// out, the textures hold shrunk tiles, so their memory stays about that of the window
+// however much of the canvas is painted.
+void renderCanvas(SDL_Renderer *renderer, CANVAS *canvas, const VIEW *view)
+{
+    int level = 0;
+    while (level < MAX_TILE_LEVEL && view->zoom * (2 << level) <= 1)
+        level++;
+    int x0 = SDL_max((int)SDL_floor(view->x / CANVAS_TILE_SIZE), 0);
+    int y0 = SDL_max((int)SDL_floor(view->y / CANVAS_TILE_SIZE), 0);
+    int x1 = SDL_min((int)SDL_floor((view->x + WIDTH / view->zoom) / CANVAS_TILE_SIZE), canvas->tiles_x - 1);
+    int y1 = SDL_min((int)SDL_floor((view->y + HEIGHT / view->zoom) / CANVAS_TILE_SIZE), canvas->tiles_y - 1);
+    for (int i = 0; i < canvas->num_painted; i++)
+    {
+        CANVAS_TILE *tile = canvas->tiles[canvas->painted[i]];
+        int x = canvas->painted[i] % canvas->tiles_x, y = canvas->painted[i] / canvas->tiles_x;
+        if (tile->texture && (!tile->block || tile->level != level || x < x0 || x > x1 || y < y0 || y > y1))
+        {
+            SDL_DestroyTexture(tile->texture);
+            tile->texture = NULL;
+        }
+    }
+
+    SDL_Rect window = {0, 0, WIDTH, HEIGHT}, page = screenRect(view, 0, 0, canvas->width, canvas->height);
+    SDL_SetRenderDrawColor(renderer, RGB_GREY, SDL_ALPHA_OPAQUE);
+    SDL_RenderClear(renderer);
+    SDL_SetRenderDrawColor(renderer, RGB_WHITE, SDL_ALPHA_OPAQUE);
+    if (SDL_IntersectRect(&page, &window, &page))
+        SDL_RenderFillRect(renderer, &page);
+    for (int y = y0; y <= y1; y++)
+    {
+        for (int x = x0; x <= x1; x++)
+        {
+            CANVAS_TILE *tile = canvas->tiles[y * canvas->tiles_x + x];
+            if (!tile || !tile->block)
+                continue;
+            if (!tile->texture)
+            {
+                int size = CANVAS_TILE_SIZE >> level;
+                tile->texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, size, size);
+                if (!tile->texture)
+                    continue;
+                tile->level = level;
+                tile->dirty = SDL_TRUE;
+            }
+            if (tile->dirty && level)
+            {
+                Uint32 shrunk[CANVAS_TILE_SIZE / 2 * CANVAS_TILE_SIZE / 2];
+                shrinkTile(tile->block->data, shrunk, level);
+                SDL_UpdateTexture(tile->texture, NULL, shrunk, (CANVAS_TILE_SIZE >> level) * sizeof(Uint32));
+                tile->dirty = SDL_FALSE;
+            }
+            else if (tile->dirty)
+            {
+                SDL_UpdateTexture(tile->texture, NULL, tile->block->data, CANVAS_TILE_SIZE * sizeof(Uint32));
+                tile->dirty = SDL_FALSE;
+            }
+            // the tiles along the right and bottom can run off the canvas, and are drawn to
+            // whole texels, which go less than a window pixel past its edge
+            int w = SDL_min(CANVAS_TILE_SIZE, canvas->width - x * CANVAS_TILE_SIZE);
+            int h = SDL_min(CANVAS_TILE_SIZE, canvas->height - y * CANVAS_TILE_SIZE);
+            int texels_w = (w + (1 << level) - 1) >> level, texels_h = (h + (1 << level) - 1) >> level;
+            SDL_Rect source = {0, 0, texels_w, texels_h};
+            SDL_Rect destination = screenRect(view, x * CANVAS_TILE_SIZE, y * CANVAS_TILE_SIZE, texels_w << level, texels_h << level);
+            SDL_RenderCopy(renderer, tile->texture, &source, &destination);
+        }
+    }
+}
+
+void freeCanvas(CANVAS *canvas, HISTORY *history)
+{
+    for (int i = 0; i < canvas->num_painted; i++)
+    {
+        CANVAS_TILE *tile = canvas->tiles[canvas->painted[i]];
+        if (tile->texture)
+            SDL_DestroyTexture(tile->texture);
+        free(tile->coverage);
+        releaseBlock(history, tile->block);
+        free(tile);
+    }
+    free(canvas->painted);
+    free(canvas->tiles);
+}
+
+// whether every channel of a pixel is within tolerance of the target's
+SDL_bool colorMatches(Uint32 pixel, Uint32 target, int tolerance)
+{
+    for (int shift = 0; shift < 32; shift += 8)
+    {
+        if (abs((int)(pixel >> shift & 0xFF) - (int)(target >> shift & 0xFF)) > tolerance)
+            return SDL_FALSE;
+    }
+    return SDL_TRUE;
+}
+
+#ifdef __SSE2__
+// a bit for each of four pixels, set where it matches the target
+int matchPixels4(const Uint32 *pixels, __m128i target, __m128i tolerance)
+{
+    __m128i four = _mm_loadu_si128((const __m128i *)pixels);
+    __m128i difference = _mm_or_si128(_mm_subs_epu8(four, target), _mm_subs_epu8(target, four));
+    __m128i channels = _mm_cmpeq_epi8(_mm_subs_epu8(difference, tolerance), _mm_setzero_si128());
+    return _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(channels, _mm_set1_epi32(-1))));
+}
+#endif
+
+// the first pixel from x to the right, up to end, whose matching differs from the given, or end
+int scanRight(const Uint32 *row, int x, int end, Uint32 target, int tolerance, SDL_bool matching)
+{
+#ifdef __SSE2__
+    const __m128i target4 = _mm_set1_epi32((int)target), tolerance16 = _mm_set1_epi8((char)tolerance);
+    for (; x + 4 <= end; x += 4)
+    {
+        int stops = matchPixels4(row + x, target4, tolerance16) ^ (matching ? 0xF : 0);
+        if (stops)
+        {
+            while (!(stops & 1))
+            {
+                stops >>= 1;
+                x++;
+            }
+            return x;
+        }
+    }
+#endif
+    while (x < end && colorMatches(row[x], target, tolerance) == matching)
+        x++;
+    return x;
+}
+
+// the first pixel from x to the left, down to begin, whose matching differs from the given, or begin - 1
+int scanLeft(const Uint32 *row, int x, int begin, Uint32 target, int tolerance, SDL_bool matching)
+{
+#ifdef __SSE2__
+    const __m128i target4 = _mm_set1_epi32((int)target), tolerance16 = _mm_set1_epi8((char)tolerance);
+    for (; x - 3 >= begin; x -= 4)
+    {
+        int stops = matchPixels4(row + x - 3, target4, tolerance16) ^ (matching ? 0xF : 0);
+        if (stops)
+        {
+            while (!(stops & 8))
+            {
+                stops <<= 1;
+                x--;
+            }
+            return x;
+        }
+    }
+#endif
+    while (x >= begin && colorMatches(row[x], target, tolerance) == matching)
+        x--;
+    return x;
+}
+
+// A span of a row still to fill, from a pixel of it found on the row above or below,
+// along with the span it was found from so that span needn't be looked over again
+typedef struct
+{
+    int x, y, dy;
+    int parent_left, parent_right;
+} FILL_SEED;
+
+typedef struct
+{
+    FILL_SEED *seeds;
+    int size, capacity;
+} FILL_STACK;
+
+// pushes a seed for each run of matching pixels between from and to on a row
+SDL_bool pushRuns(FILL_STACK *stack, const Uint32 *row, int from, int to, Uint32 target, int tolerance, FILL_SEED seed)
+{
+    for (int x = scanRight(row, from, to, target, tolerance, SDL_FALSE); x < to; x = scanRight(row, x, to, target, tolerance, SDL_FALSE))
+    {
+        if (stack->size == stack->capacity)
+        {
+            int capacity = stack->capacity ? stack->capacity * 2 : 1024;
+            FILL_SEED *seeds = (FILL_SEED *)realloc(stack->seeds, capacity * sizeof(FILL_SEED));
+            if (!seeds)
+                return SDL_FALSE;
+            stack->seeds = seeds;
+            stack->capacity = capacity;
+        }
+        seed.x = x;
+        stack->seeds[stack->size++] = seed;
+        x = scanRight(row, x, to, target, tolerance, SDL_TRUE);
+    }
+    return SDL_TRUE;
+}
+
+// Fills the pixels connected to the seed that match its colour within tolerance, a row
+// span at a time. Spans still to fill wait on a stack of their own, so there is no
+// limit to how far a fill can wind. Returns how many pixels were filled.
+int floodFill(Uint32 *pixels, int width, int height, int pitch, int seed_x, int seed_y, Uint32 color, int tolerance, SDL_Rect *bounds)
+{
+    Uint32 target = pixels[(size_t)seed_y * pitch + seed_x];
+    // When the new colour is within tolerance of the old, filled pixels go without alpha
+    // until the end so that none of them matches again
+    SDL_bool marking = colorMatches(color, target, tolerance);
+    Uint32 fill = marking ? color & 0x00FFFFFF : color;
+    int filled = 0;
+    int min_x = seed_x, max_x = seed_x, min_y = seed_y, max_y = seed_y;
+    FILL_STACK stack = {NULL, 0, 0};
+    pushRuns(&stack, pixels + (size_t)seed_y * pitch, seed_x, seed_x + 1, target, tolerance, (FILL_SEED){seed_x, seed_y, 0, 0, 0});
+    while (stack.size)
+    {
+        FILL_SEED seed = stack.seeds[--stack.size];
+        Uint32 *row = pixels + (size_t)seed.y * pitch;
+        if (!colorMatches(row[seed.x], target, tolerance))
+            continue;
+        int left = scanLeft(row, seed.x, 0, target, tolerance, SDL_TRUE) + 1;
+        int right = scanRight(row, seed.x, width, target, tolerance, SDL_TRUE);
+        SDL_memset4(row + left, fill, right - left);
+        filled += right - left;
+        min_x = SDL_min(min_x, left);
+        max_x = SDL_max(max_x, right - 1);
+        min_y = SDL_min(min_y, seed.y);
+        max_y = SDL_max(max_y, seed.y);
+
+        for (int dy = -1; dy <= 1; dy += 2)
+        {
+            int y = seed.y + dy;
+            if (y < 0 || y >= height)
+                continue;
+            const Uint32 *next = pixels + (size_t)y * pitch;
+            FILL_SEED child = {0, y, dy, left, right};
+            SDL_bool pushed;
+            // the span this one was found from is filled already
+            if (dy == -seed.dy)
+                pushed = pushRuns(&stack, next, left, seed.parent_left, target, tolerance, child) &&
+                         pushRuns(&stack, next, seed.parent_right, right, target, tolerance, child);
+            else
+                pushed = pushRuns(&stack, next, left, right, target, tolerance, child);
+            if (!pushed)
+                stack.size = 0;
+        }
+    }
+    free(stack.seeds);
+
+    for (int y = min_y; y <= max_y && marking; y++)
+    {
+        Uint32 *row = pixels + (size_t)y * pitch;
+        for (int x = min_x; x <= max_x; x++)
+            row[x] |= 0xFF000000;
+    }
+    *bounds = (SDL_Rect){min_x, min_y, max_x - min_x + 1, max_y - min_y + 1};
+    return filled;
+}
+
+// Flood fills from a point of the window as one step of the history. The fill keeps to
+// the part of the canvas in view, and to MAX_FILL_SIZE around the point beyond that.
+void fillCanvas(HISTORY *history, CANVAS *canvas, const VIEW *view, int x, int y, RGB_COLOR color, int tolerance)
+{
+    SDL_Point seed = canvasPoint(view, x, y);
+    SDL_Rect page = {0, 0, canvas->width, canvas->height};
+    SDL_Rect seen = {(int)SDL_floor(view->x), (int)SDL_floor(view->y), (int)SDL_ceil(WIDTH / view->zoom) + 1, (int)SDL_ceil(HEIGHT / view->zoom) + 1};
+    SDL_Rect around = {seed.x - MAX_FILL_SIZE / 2, seed.y - MAX_FILL_SIZE / 2, MAX_FILL_SIZE, MAX_FILL_SIZE};
+    SDL_Rect region;
+    if (!SDL_PointInRect(&seed, &page) || !SDL_IntersectRect(&page, &seen, &region) || !SDL_IntersectRect(&region, &around, &region))
+        return;
+    Uint32 *pixels = (Uint32 *)malloc((size_t)region.w * region.h * sizeof(Uint32));
+    if (!pixels)
+        return;
+    readRect(canvas, &region, pixels, region.w);
+
+    SDL_Rect bounds;
+    Uint32 argb = 0xFF000000 | (Uint32)color.r << 16 | (Uint32)color.g << 8 | color.b;
+    floodFill(pixels, region.w, region.h, region.w, seed.x - region.x, seed.y - region.y, argb, tolerance, &bounds);
+    SDL_Rect filled = {region.x + bounds.x, region.y + bounds.y, bounds.w, bounds.h};
+    writeRect(history, canvas, &filled, pixels + (size_t)bounds.y * region.w + bounds.x, region.w, 0);
+    free(pixels);
+    commitStroke(history, canvas);
+}
+
+// Times filling a 16 megapixel image, first all of it and then a maze of walls, with no window
+void benchFill(int tolerance)
+{
+    Uint32 *pixels = (Uint32 *)malloc((size_t)MAX_FILL_SIZE * MAX_FILL_SIZE * sizeof(Uint32));
+    if (!pixels)
+    {
+        printf("Could not allocate the image\n");
+        return;
+    }
+    for (int pass = 0; pass < 2; pass++)
+    {
+        SDL_memset4(pixels, 0xFFFFFFFF, (size_t)MAX_FILL_SIZE * MAX_FILL_SIZE);
+        if (pass)
+        {
+            // walls every 16 rows, each with a gap at alternate ends, so the fill has to wind
+            // through every row of the image
+            for (int y = 8; y < MAX_FILL_SIZE; y += 16)
+            {
+                int gap = y / 16 % 2 ? 0 : MAX_FILL_SIZE - 8;
+                for (int x = 0; x < MAX_FILL_SIZE; x++)
+                {
+                    if (x < gap || x >= gap + 8)
+                        pixels[(size_t)y * MAX_FILL_SIZE + x] = 0xFF000000;
+                }
+            }
+        }
+        SDL_Rect bounds;
+        Uint64 start = SDL_GetPerformanceCounter();
+        int filled = floodFill(pixels, MAX_FILL_SIZE, MAX_FILL_SIZE, MAX_FILL_SIZE, 0, 0, 0xFFFF0000, tolerance, &bounds);
+        double ms = (SDL_GetPerformanceCounter() - start) * 1000.0 / SDL_GetPerformanceFrequency();
+        printf("%s: filled %d pixels in %.1f ms, %.0f megapixels/s\n", pass ? "Maze" : "Open", filled, ms, filled / ms / 1000.0);
+    }
+    free(pixels);
+}
+
+// Times strokes of a large brush across a canvas with no window, against the thousand or
+// so stamps a second a fast mouse can ask for
+void benchBrush(const BRUSH *settings)
+{
+    BRUSH brush = *settings;
+    // a large brush unless another size was asked for
+    if (brush.size == BRUSH_SIZE_SMALL)
+        brush.size = BENCH_BRUSH_SIZE;
+    HISTORY history;
+    CANVAS canvas;
+    memset(&history, 0, sizeof(history));
+    history.budget = (size_t)DEFAULT_UNDO_MB << 20;
+    if (!initCanvas(&canvas, MAX_FILL_SIZE, MAX_FILL_SIZE))
+        return;
+    STAMP_LIST stamps = {NULL, 0, 0};
+    int num_stamps = 0;
+    Uint64 start = SDL_GetPerformanceCounter();
+    for (int y = brush.size / 2; y < canvas.height; y += brush.size)
+    {
+        // a stroke across and back down, as rows of mouse events a few pixels apart
+        SDL_Point end = {0, y};
+        addStamp(&stamps, end.x, end.y, brush.size);
+        for (int x = 8; x < canvas.width; x += 8)
+        {
+            end = stampSegment(&stamps, end, (SDL_Point){x, y + (x & 64 ? 8 : -8)}, brush.size);
+            num_stamps += stamps.count;
+            paintStamps(&history, &canvas, &stamps, (RGB_COLOR){RGB_BLUE}, &brush);
+        }
+        commitStroke(&history, &canvas);
+    }
+    double ms = (SDL_GetPerformanceCounter() - start) * 1000.0 / SDL_GetPerformanceFrequency();
+    printf("%d stamps of a %d pixel %s brush in %.1f ms: %.0f stamps/s, %.0f megapixels/s\n", num_stamps, brush.size,
+           shape_names[brush.shape], ms, num_stamps / ms * 1000, (double)num_stamps * brush.size * brush.size / ms / 1000);
+    free(stamps.rects);
+    freeHistory(&history);
+    freeCanvas(&canvas, &history);
+    freeBrushMasks();
+}
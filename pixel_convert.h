@@ -0,0 +1,365 @@
+#ifndef PIXEL_CONVERT_H
+#define PIXEL_CONVERT_H
+
+// Row-at-a-time conversion between packed pixel formats with 8 bits per channel,
+// and from 16-bit big-endian samples (Netpbm with a maximum of 65535) to 8 bits.
+// On x86 the work is done by SSSE3 or AVX2 byte shuffles picked at run time, with a
+// scalar loop for everything else and for the last few pixels of a row.
+//
+//     PIXEL_CONVERSION conversion;
+//     if (initPixelConversion(&conversion, SDL_PIXELFORMAT_RGB24, SDL_PIXELFORMAT_ARGB8888))
+//         convertPixelRows(&conversion, rgb, width * 3, argb, width * 4, width, height);
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <SDL2/SDL.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PIXEL_CONVERT_X86 1
+#endif
+
+// below this many pixels an image is converted on the calling thread
+#define PARALLEL_CONVERT_PIXELS (1 << 20)
+#define MAX_CONVERT_THREADS 16
+// a destination byte that is not in the source is opaque alpha
+#define PIXEL_OPAQUE 0x80
+
+enum PIXEL_KERNEL
+{
+    KERNEL_SCALAR,
+    KERNEL_SSSE3,
+    KERNEL_AVX2,
+    KERNEL_BEST
+};
+
+// For each byte of a destination pixel, the byte of the source pixel it is copied
+// from, or PIXEL_OPAQUE for alpha and padding bytes the source does not have.
+typedef struct
+{
+    int src_bytes, dst_bytes;
+    Uint8 map[4];
+} PIXEL_CONVERSION;
+
+typedef struct
+{
+    const PIXEL_CONVERSION *conversion;
+    const Uint8 *src;
+    Uint8 *dst;
+    int src_pitch, dst_pitch, width, height;
+} CONVERT_JOB;
+
+static int pixel_kernel = KERNEL_BEST;
+
+static inline int channelBytes(Uint32 format, int bytes[4]);
+static inline int initPixelConversion(PIXEL_CONVERSION *conversion, Uint32 src_format, Uint32 dst_format);
+static inline int bestKernel(void);
+static inline void convertScalar(const PIXEL_CONVERSION *conversion, const Uint8 *src, Uint8 *dst, int count);
+static inline void convertPixels(const PIXEL_CONVERSION *conversion, const Uint8 *src, Uint8 *dst, int count);
+static inline int convertJob(void *data);
+static inline void convertPixelRows(const PIXEL_CONVERSION *conversion, const Uint8 *src, int src_pitch, Uint8 *dst,
+                                    int dst_pitch, int width, int height);
+static inline void convert16To8(const Uint8 *src, Uint8 *dst, int count);
+static inline double timeConversion(const PIXEL_CONVERSION *conversion, const Uint8 *src, Uint8 *dst, int width,
+                                    int height, int threaded);
+static inline void benchPixelConversion(int width, int height);
+
+// Byte offsets of red, green, blue and alpha (-1 if absent) within a pixel of a
+// format with 8-bit channels, or 0 if the format has none.
+static inline int channelBytes(Uint32 format, int bytes[4])
+{
+    int bpp;
+    Uint32 masks[4];
+    if (!SDL_PixelFormatEnumToMasks(format, &bpp, &masks[0], &masks[1], &masks[2], &masks[3]) || (bpp != 24 && bpp != 32))
+        return 0;
+    int size = bpp / 8;
+    for (int i = 0; i < 4; i++)
+    {
+        bytes[i] = -1;
+        for (int b = 0; b < size; b++)
+        {
+            if (masks[i] == 0xFFu << (8 * b))
+                bytes[i] = SDL_BYTEORDER == SDL_LIL_ENDIAN ? b : size - 1 - b;
+        }
+        if (i < 3 && bytes[i] < 0)
+            return 0;
+    }
+    return size;
+}
+
+// fails for formats that are not packed 24 or 32-bit RGB with 8 bits per channel
+static inline int initPixelConversion(PIXEL_CONVERSION *conversion, Uint32 src_format, Uint32 dst_format)
+{
+    int src[4], dst[4];
+    conversion->src_bytes = channelBytes(src_format, src);
+    conversion->dst_bytes = channelBytes(dst_format, dst);
+    if (!conversion->src_bytes || !conversion->dst_bytes)
+        return 0;
+    memset(conversion->map, PIXEL_OPAQUE, sizeof(conversion->map));
+    for (int i = 0; i < 4; i++)
+    {
+        if (dst[i] >= 0 && src[i] >= 0)
+            conversion->map[dst[i]] = src[i];
+    }
+    return 1;
+}
+
+static inline int bestKernel(void)
+{
+#ifdef PIXEL_CONVERT_X86
+    if (pixel_kernel != KERNEL_BEST)
+        return pixel_kernel;
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        pixel_kernel = KERNEL_AVX2;
+    else if (__builtin_cpu_supports("ssse3"))
+        pixel_kernel = KERNEL_SSSE3;
+    else
+        pixel_kernel = KERNEL_SCALAR;
+    return pixel_kernel;
+#else
+    return KERNEL_SCALAR;
+#endif
+}
+
+static inline void convertScalar(const PIXEL_CONVERSION *conversion, const Uint8 *src, Uint8 *dst, int count)
+{
+    int src_bytes = conversion->src_bytes, dst_bytes = conversion->dst_bytes;
+    const Uint8 *map = conversion->map;
+    for (int i = 0; i < count; i++, src += src_bytes, dst += dst_bytes)
+    {
+        for (int b = 0; b < dst_bytes; b++)
+            dst[b] = map[b] == PIXEL_OPAQUE ? 0xFF : src[map[b]];
+    }
+}
+
+#ifdef PIXEL_CONVERT_X86
+// Four pixels per 16 bytes of output. Every pixel reads a whole 16-byte load, so the
+// caller leaves enough pixels for the scalar loop that no load runs off the row.
+__attribute__((target("ssse3"))) static inline int convertSsse3(const PIXEL_CONVERSION *conversion, const Uint8 *src,
+                                                               Uint8 *dst, int count)
+{
+    int src_bytes = conversion->src_bytes;
+    Uint8 shuffle[16], alpha[16];
+    for (int i = 0; i < 16; i++)
+    {
+        Uint8 from = conversion->map[i % 4];
+        shuffle[i] = from == PIXEL_OPAQUE ? 0x80 : i / 4 * src_bytes + from;
+        alpha[i] = from == PIXEL_OPAQUE ? 0xFF : 0;
+    }
+    __m128i mask = _mm_loadu_si128((const __m128i *)shuffle), opaque = _mm_loadu_si128((const __m128i *)alpha);
+    int done = 0;
+    for (; done + 4 + (src_bytes == 3) * 2 <= count; done += 4, src += 4 * src_bytes, dst += 16)
+    {
+        __m128i pixels = _mm_loadu_si128((const __m128i *)src);
+        _mm_storeu_si128((__m128i *)dst, _mm_or_si128(_mm_shuffle_epi8(pixels, mask), opaque));
+    }
+    return done;
+}
+
+// eight pixels at a time, four from each 128-bit lane
+__attribute__((target("avx2"))) static inline int convertAvx2(const PIXEL_CONVERSION *conversion, const Uint8 *src,
+                                                             Uint8 *dst, int count)
+{
+    int src_bytes = conversion->src_bytes;
+    Uint8 shuffle[32], alpha[32];
+    for (int i = 0; i < 32; i++)
+    {
+        Uint8 from = conversion->map[i % 4];
+        shuffle[i] = from == PIXEL_OPAQUE ? 0x80 : i % 16 / 4 * src_bytes + from;
+        alpha[i] = from == PIXEL_OPAQUE ? 0xFF : 0;
+    }
+    __m256i mask = _mm256_loadu_si256((const __m256i *)shuffle), opaque = _mm256_loadu_si256((const __m256i *)alpha);
+    int done = 0;
+    for (; done + 8 + (src_bytes == 3) * 2 <= count; done += 8, src += 8 * src_bytes, dst += 32)
+    {
+        __m256i pixels = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)src)),
+                                                 _mm_loadu_si128((const __m128i *)(src + 4 * src_bytes)), 1);
+        _mm256_storeu_si256((__m256i *)dst, _mm256_or_si256(_mm256_shuffle_epi8(pixels, mask), opaque));
+    }
+    return done;
+}
+
+// rounds v * 255 / 65535 as (t - (t >> 8)) >> 8 with t = v + 128 saturated, which is exact for every v
+__attribute__((target("ssse3"))) static inline int convert16To8Ssse3(const Uint8 *src, Uint8 *dst, int count)
+{
+    const __m128i swap = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    const __m128i half = _mm_set1_epi16(128);
+    int done = 0;
+    for (; done + 16 <= count; done += 16, src += 32, dst += 16)
+    {
+        __m128i lo = _mm_adds_epu16(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)src), swap), half);
+        __m128i hi = _mm_adds_epu16(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src + 16)), swap), half);
+        lo = _mm_srli_epi16(_mm_sub_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+        hi = _mm_srli_epi16(_mm_sub_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+        _mm_storeu_si128((__m128i *)dst, _mm_packus_epi16(lo, hi));
+    }
+    return done;
+}
+
+__attribute__((target("avx2"))) static inline int convert16To8Avx2(const Uint8 *src, Uint8 *dst, int count)
+{
+    const __m256i swap = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14, 1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11,
+                                          10, 13, 12, 15, 14);
+    const __m256i half = _mm256_set1_epi16(128);
+    int done = 0;
+    for (; done + 32 <= count; done += 32, src += 64, dst += 32)
+    {
+        __m256i lo = _mm256_adds_epu16(_mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)src), swap), half);
+        __m256i hi = _mm256_adds_epu16(_mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)(src + 32)), swap), half);
+        lo = _mm256_srli_epi16(_mm256_sub_epi16(lo, _mm256_srli_epi16(lo, 8)), 8);
+        hi = _mm256_srli_epi16(_mm256_sub_epi16(hi, _mm256_srli_epi16(hi, 8)), 8);
+        // packus interleaves the lanes, so put them back in order
+        _mm256_storeu_si256((__m256i *)dst, _mm256_permute4x64_epi64(_mm256_packus_epi16(lo, hi), 0xD8));
+    }
+    return done;
+}
+#endif
+
+// converts count pixels of one row
+static inline void convertPixels(const PIXEL_CONVERSION *conversion, const Uint8 *src, Uint8 *dst, int count)
+{
+    int done = 0;
+#ifdef PIXEL_CONVERT_X86
+    // the shuffles only produce 32-bit pixels
+    if (conversion->dst_bytes == 4)
+    {
+        int kernel = bestKernel();
+        if (kernel == KERNEL_AVX2)
+            done = convertAvx2(conversion, src, dst, count);
+        else if (kernel == KERNEL_SSSE3)
+            done = convertSsse3(conversion, src, dst, count);
+    }
+#endif
+    convertScalar(conversion, src + done * conversion->src_bytes, dst + done * conversion->dst_bytes, count - done);
+}
+
+static inline int convertJob(void *data)
+{
+    CONVERT_JOB *job = (CONVERT_JOB *)data;
+    for (int y = 0; y < job->height; y++)
+        convertPixels(job->conversion, job->src + (size_t)y * job->src_pitch, job->dst + (size_t)y * job->dst_pitch, job->width);
+    return 0;
+}
+
+// converts a whole image, split into bands of rows across threads when it is large
+static inline void convertPixelRows(const PIXEL_CONVERSION *conversion, const Uint8 *src, int src_pitch, Uint8 *dst,
+                                    int dst_pitch, int width, int height)
+{
+    if (width <= 0 || height <= 0)
+        return;
+    int num_threads = SDL_clamp(SDL_GetCPUCount(), 1, MAX_CONVERT_THREADS);
+    if ((Sint64)width * height < PARALLEL_CONVERT_PIXELS)
+        num_threads = 1;
+    num_threads = SDL_min(num_threads, height);
+
+    CONVERT_JOB jobs[MAX_CONVERT_THREADS];
+    SDL_Thread *threads[MAX_CONVERT_THREADS];
+    for (int i = 0; i < num_threads; i++)
+    {
+        int y0 = (int)((Sint64)height * i / num_threads), y1 = (int)((Sint64)height * (i + 1) / num_threads);
+        jobs[i] = (CONVERT_JOB){conversion, src + (size_t)y0 * src_pitch, dst + (size_t)y0 * dst_pitch, src_pitch, dst_pitch, width,
+                                y1 - y0};
+        threads[i] = i ? SDL_CreateThread(convertJob, "convert", &jobs[i]) : NULL;
+    }
+    convertJob(&jobs[0]);
+    for (int i = 1; i < num_threads; i++)
+    {
+        if (threads[i])
+            SDL_WaitThread(threads[i], NULL);
+        else
+            convertJob(&jobs[i]);
+    }
+}
+
+// count big-endian 16-bit samples with a maximum of 65535 to 8 bits, rounded
+static inline void convert16To8(const Uint8 *src, Uint8 *dst, int count)
+{
+    int done = 0;
+#ifdef PIXEL_CONVERT_X86
+    int kernel = bestKernel();
+    if (kernel == KERNEL_AVX2)
+        done = convert16To8Avx2(src, dst, count);
+    else if (kernel == KERNEL_SSSE3)
+        done = convert16To8Ssse3(src, dst, count);
+#endif
+    for (int i = done; i < count; i++)
+        dst[i] = ((src[2 * i] << 8 | src[2 * i + 1]) * 255 + 32767) / 65535;
+}
+
+// best of a few runs, in seconds; a null conversion times the 16-bit samples instead
+static inline double timeConversion(const PIXEL_CONVERSION *conversion, const Uint8 *src, Uint8 *dst, int width,
+                                    int height, int threaded)
+{
+    double best = 1e30;
+    for (int run = 0; run < 5; run++)
+    {
+        Uint64 start = SDL_GetPerformanceCounter();
+        if (!conversion)
+        {
+            for (int y = 0; y < height; y++)
+                convert16To8(src + (size_t)y * width * 6, dst + (size_t)y * width * 3, width * 3);
+        }
+        else if (threaded)
+            convertPixelRows(conversion, src, width * conversion->src_bytes, dst, width * conversion->dst_bytes, width, height);
+        else
+        {
+            CONVERT_JOB job = {conversion, src, dst, width * conversion->src_bytes, width * conversion->dst_bytes, width, height};
+            convertJob(&job);
+        }
+        best = SDL_min(best, (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency());
+    }
+    return best;
+}
+
+// prints the throughput of every kernel, in GB/s of source and destination together
+static inline void benchPixelConversion(int width, int height)
+{
+    const struct
+    {
+        const char *name;
+        Uint32 src, dst;
+    } cases[] = {{"RGB24 -> ARGB8888", SDL_PIXELFORMAT_RGB24, SDL_PIXELFORMAT_ARGB8888},
+                 {"RGB24 -> RGBA8888", SDL_PIXELFORMAT_RGB24, SDL_PIXELFORMAT_RGBA8888},
+                 {"RGB24 -> BGRA8888", SDL_PIXELFORMAT_RGB24, SDL_PIXELFORMAT_BGRA8888},
+                 {"BGR24 -> ARGB8888", SDL_PIXELFORMAT_BGR24, SDL_PIXELFORMAT_ARGB8888},
+                 {"ARGB8888 -> ABGR8888", SDL_PIXELFORMAT_ARGB8888, SDL_PIXELFORMAT_ABGR8888},
+                 {"RGB48 -> RGB24", 0, 0}};
+    const char *kernel_names[] = {"scalar", "SSSE3", "AVX2"};
+    size_t pixels = (size_t)width * height;
+    Uint8 *src = (Uint8 *)malloc(pixels * 6), *dst = (Uint8 *)malloc(pixels * 4);
+    if (!src || !dst)
+    {
+        free(src);
+        free(dst);
+        return;
+    }
+    for (size_t i = 0; i < pixels * 6; i++)
+        src[i] = (Uint8)(i * 2654435761u >> 13);
+
+    int best = bestKernel();
+    printf("Converting %dx%d pixels, %d threads at most\n", width, height, SDL_clamp(SDL_GetCPUCount(), 1, MAX_CONVERT_THREADS));
+    for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++)
+    {
+        PIXEL_CONVERSION conversion;
+        if (cases[c].src && !initPixelConversion(&conversion, cases[c].src, cases[c].dst))
+            continue;
+        const PIXEL_CONVERSION *which = cases[c].src ? &conversion : NULL;
+        double bytes = cases[c].src ? (double)pixels * (conversion.src_bytes + conversion.dst_bytes) : (double)pixels * 9;
+        for (int kernel = KERNEL_SCALAR; kernel <= best; kernel++)
+        {
+            pixel_kernel = kernel;
+            printf("%-22s %-7s 1 thread  %6.2f GB/s\n", cases[c].name, kernel_names[kernel],
+                   bytes / timeConversion(which, src, dst, width, height, 0) / 1e9);
+        }
+        if (which)
+            printf("%-22s %-7s threaded  %6.2f GB/s\n", cases[c].name, kernel_names[best],
+                   bytes / timeConversion(which, src, dst, width, height, 1) / 1e9);
+    }
+    pixel_kernel = best;
+    free(src);
+    free(dst);
+}
+
+#endif
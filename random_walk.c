@@ -1,59 +1,186 @@
 #include <SDL2/SDL.h>
+#include <limits.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define WIDTH 1280
 #define HEIGHT 720
 #define FRAME_RATE 100
 #define POINT_SIZE 5
-#define NUM_POINTS NUM_COLORS
+#define NUM_POINTS 6
+#define GRID_W (WIDTH / POINT_SIZE)
+#define GRID_H (HEIGHT / POINT_SIZE)
+#define COLORMAP_SIZE 256
+#define MAX_THREADS 64
+#define CHUNK_SIZE 65536
+#define BENCH_WALKERS 1000000
+#define BENCH_STEPS 200
+#define DLA_WALKERS 256
+#define DLA_PARTICLES_PER_WALKER 4096
+#define DLA_BLOCK 8
+#define DLA_FIELD_CAP 16
+#define DLA_NEAR_RADIUS 8
+#define DLA_ROUND_STEPS 256
+#define DLA_ANGLES 4096
+#define DLA_VIEW_SIZE 1024
 
-#define COLOR_RED 255, 0, 0
-#define COLOR_GREEN 0, 255, 0
-#define COLOR_BLUE 0, 0, 255
-#define COLOR_YELLOW 255, 255, 0
-#define COLOR_CYAN 0, 255, 255
-#define COLOR_MAGENTA 255, 0, 255
+// walkers in structure-of-arrays layout. Every CHUNK_SIZE walkers draw from their own xoshiro256** stream, so the walk
+// is the same for any number of threads
+typedef struct
+{
+    int len, num_chunks;
+    Sint16 *x, *y;
+    Uint64 (*rng)[4];
+} WALKERS;
 
+// occupancy histogram over POINT_SIZE bins: each thread counts its slice of the
+// walkers into its own partial grid, the partials are summed row by row and the
+// sums tone-mapped through the colormap into ARGB pixels for a single upload
 typedef struct
 {
-    short x, y;
-    Uint32 color;
-} POINT;
+    WALKERS *walkers;
+    int num_slices;
+    Uint32 *partials;
+    Uint32 *counts;
+    Uint32 *row_max;
+    Uint32 *pixels;
+    Uint32 max_count;
+    int cumulative;
+} HEATMAP;
 
-enum DIR
+// diffusion-limited aggregation on a size x size lattice. The cluster is an occupancy
+// bitmap, and field holds the Chebyshev distance in DLA_BLOCK blocks from each block to
+// the nearest occupied one, capped at DLA_FIELD_CAP, so walkers far from the cluster
+// can jump to a random point on the largest circle that cannot touch it.
+// Walkers move speculatively in rounds against a frozen cluster, recording the blocks
+// their unit steps covered. The round is then committed in walker order, and a walker
+// whose steps came near a particle attached earlier in the same round is rolled back
+// to redo its moves next round, so every accepted move saw the cluster as it really
+// was. Each walker has its own random stream, so the cluster is the same for any
+// number of threads
+typedef struct
 {
-    LEFT,
-    RIGHT,
-    UP,
-    DOWN,
-    DIR_SIZE
-};
+    int size, words_per_row, blocks_per_row;
+    Uint64 *bitmap;
+    Uint8 *field;
+    Uint32 *stamps;
+    Uint32 round;
+    int count, target, max_radius;
+    Uint16 (*particles)[2];
+    int num_walkers, active, spawn_radius, kill_radius;
+    int *x, *y, *next_x, *next_y;
+    int (*touched)[4];
+    Uint8 *stuck;
+    Uint64 (*rng)[4], (*saved_rng)[4];
+    float angles[DLA_ANGLES][2];
+} DLA;
+
+typedef void (*WORK_FUNC)(void *, int, int);
+
+typedef struct WORKER_POOL WORKER_POOL;
+
+typedef struct
+{
+    WORKER_POOL *pool;
+    int index;
+} WORKER;
 
-enum COLOR
+// persistent threads that each run one slice of [0, count) per runParallel call
+struct WORKER_POOL
 {
-    RED,
-    BLUE,
-    GREEN,
-    YELLOW,
-    CYAN,
-    MAGENTA,
-    NUM_COLORS
+    int num_threads;
+    SDL_Thread *threads[MAX_THREADS];
+    WORKER workers[MAX_THREADS];
+    SDL_mutex *mutex;
+    SDL_cond *work_ready, *work_done;
+    int generation, pending, quit;
+    WORK_FUNC work;
+    void *data;
+    int count;
 };
 
-void initPoints(POINT points[], int len, SDL_Surface *surface);
-void randomStepPoints(POINT points[], int len);
-void clampPointPosition(POINT *point);
-void FillPoints(POINT points[], int len, SDL_Surface *surface);
+// log-scaled occupancy to colour, dark purple through orange to pale yellow
+Uint32 colormap[COLORMAP_SIZE];
 
-int main()
+void initColormap();
+void seedStreams(Uint64 (*rng)[4], int count, Uint64 seed);
+void initWalkers(WALKERS *walkers, int len, Uint64 seed);
+void freeWalkers(WALKERS *walkers);
+Uint64 nextRandom(Uint64 state[4]);
+void jumpRandom(Uint64 state[4]);
+void randomStepPoints(WALKERS *walkers, WORKER_POOL *pool);
+void randomStepChunks(void *data, int begin, int end);
+void randomStepRange(Sint16 *x, Sint16 *y, int len, Uint64 state[4]);
+void initHeatmap(HEATMAP *heatmap, WALKERS *walkers, int num_slices);
+void freeHeatmap(HEATMAP *heatmap);
+void updateHeatmap(HEATMAP *heatmap, WORKER_POOL *pool);
+void accumulateSlices(void *data, int begin, int end);
+void mergeRows(void *data, int begin, int end);
+void toneMapRows(void *data, int begin, int end);
+void initDla(DLA *dla, int target, int num_walkers, Uint64 seed);
+void freeDla(DLA *dla);
+int stepDla(DLA *dla, WORKER_POOL *pool);
+void walkDlaRange(void *data, int begin, int end);
+void walkDla(DLA *dla, int i);
+int isOccupied(DLA *dla, int x, int y);
+int isWindowEmpty(DLA *dla, int x, int y, int radius);
+int isWalkValid(DLA *dla, int i);
+void attachParticle(DLA *dla, int x, int y);
+int runDla(int target, int num_walkers, int num_threads, Uint64 seed, int bench);
+WORKER_POOL *createWorkerPool(int num_threads);
+void destroyWorkerPool(WORKER_POOL *pool);
+void runParallel(WORKER_POOL *pool, WORK_FUNC work, void *data, int count);
+int workerMain(void *data);
+int runBenchmark(int num_walkers, int num_steps, int num_threads, Uint64 seed);
+
+int main(int argc, char **argv)
 {
+    int bench = 0, dla = 0, num_walkers = 0, num_steps = BENCH_STEPS, num_threads = SDL_GetCPUCount();
+    Uint64 seed = time(NULL);
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--bench"))
+            bench = 1;
+        else if (!strcmp(argv[i], "--dla") && i + 1 < argc)
+            dla = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--walkers") && i + 1 < argc)
+            num_walkers = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--steps") && i + 1 < argc)
+            num_steps = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--threads") && i + 1 < argc)
+            num_threads = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--seed") && i + 1 < argc)
+            seed = strtoull(argv[++i], NULL, 10);
+        else
+        {
+            printf("Usage: ./random_walk [--walkers N] [--threads N] [--seed N]\n"
+                   "       ./random_walk --bench [--walkers N] [--steps N] [--threads N] [--seed N]\n"
+                   "       ./random_walk --dla PARTICLES [--bench] [--walkers N] [--threads N] [--seed N]\n");
+            return 0;
+        }
+    }
+
+    if (dla > 0)
+        return runDla(dla, num_walkers ? num_walkers : DLA_WALKERS, num_threads, seed, bench);
+
+    if (bench)
+        return runBenchmark(num_walkers ? num_walkers : BENCH_WALKERS, num_steps, num_threads, seed);
+
     SDL_Init(SDL_INIT_EVERYTHING);
     SDL_Window *window = SDL_CreateWindow("Random Walk", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, WIDTH, HEIGHT, 0);
-    SDL_Surface *surface = SDL_GetWindowSurface(window);
-    srand(time(NULL));
-    POINT points[NUM_POINTS];
-    initPoints(points, NUM_POINTS, surface);
+    SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+    SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "0");
+    SDL_Texture *texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, GRID_W, GRID_H);
+    initColormap();
+    WALKERS walkers;
+    initWalkers(&walkers, num_walkers ? num_walkers : NUM_POINTS, seed);
+    WORKER_POOL *pool = num_threads > 1 && walkers.num_chunks > 1 ? createWorkerPool(num_threads) : NULL;
+    HEATMAP heatmap;
+    initHeatmap(&heatmap, &walkers, pool ? pool->num_threads : 1);
 
     Uint8 running = 1;
     while (running)
@@ -66,90 +193,759 @@ int main()
             case SDL_QUIT:
                 running = 0;
                 break;
+            case SDL_KEYDOWN:
+                // t: keep counting across frames to show where walkers have been
+                if (event.key.keysym.sym == SDLK_t)
+                {
+                    heatmap.cumulative = !heatmap.cumulative;
+                    memset(heatmap.counts, 0, GRID_W * GRID_H * sizeof(Uint32));
+                }
+                break;
             }
         }
-        randomStepPoints(points, NUM_POINTS);
-        FillPoints(points, NUM_POINTS, surface);
-        SDL_UpdateWindowSurface(window);
+        randomStepPoints(&walkers, pool);
+        updateHeatmap(&heatmap, pool);
+        SDL_UpdateTexture(texture, NULL, heatmap.pixels, GRID_W * sizeof(Uint32));
+        SDL_RenderCopy(renderer, texture, NULL, NULL);
+        SDL_RenderPresent(renderer);
         SDL_Delay(1000 / FRAME_RATE);
     }
 
+    if (pool)
+        destroyWorkerPool(pool);
+    freeHeatmap(&heatmap);
+    freeWalkers(&walkers);
+    SDL_DestroyTexture(texture);
+    SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
     SDL_Quit();
     return 0;
 }
 
-void initPoints(POINT points[], int len, SDL_Surface *surface)
+void initColormap()
 {
+    static const Uint8 stops[][3] = {{0, 0, 4}, {87, 16, 110}, {188, 55, 84}, {249, 142, 9}, {252, 255, 164}};
+    const int num_segments = sizeof(stops) / sizeof(stops[0]) - 1;
+    for (int i = 0; i < COLORMAP_SIZE; i++)
+    {
+        double t = (double)i / (COLORMAP_SIZE - 1) * num_segments;
+        int s = SDL_min((int)t, num_segments - 1);
+        double f = t - s;
+        Uint32 rgb[3];
+        for (int c = 0; c < 3; c++)
+            rgb[c] = stops[s][c] + (stops[s + 1][c] - stops[s][c]) * f + 0.5;
+        colormap[i] = 0xff000000 | rgb[0] << 16 | rgb[1] << 8 | rgb[2];
+    }
+    // empty bins stay black so the walkers stand out from the background
+    colormap[0] = 0xff000000;
+}
+
+void initWalkers(WALKERS *walkers, int len, Uint64 seed)
+{
+    walkers->len = len;
+    walkers->num_chunks = (len + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    walkers->x = (Sint16 *)malloc(len * sizeof(Sint16));
+    walkers->y = (Sint16 *)malloc(len * sizeof(Sint16));
+    walkers->rng = (Uint64(*)[4])malloc(walkers->num_chunks * sizeof(walkers->rng[0]));
+
     for (int i = 0; i < len; i++)
     {
-        points[i].x = (WIDTH - POINT_SIZE) / 2;
-        points[i].y = (HEIGHT - POINT_SIZE) / 2;
-        Uint8 color_index = i % NUM_COLORS;
-        switch (color_index)
+        walkers->x[i] = (WIDTH - POINT_SIZE) / 2;
+        walkers->y[i] = (HEIGHT - POINT_SIZE) / 2;
+    }
+    seedStreams(walkers->rng, walkers->num_chunks, seed);
+}
+
+// splitmix64 expands the seed into the first state, and each following stream
+// starts 2^128 draws further along, so no two streams ever overlap
+void seedStreams(Uint64 (*rng)[4], int count, Uint64 seed)
+{
+    Uint64 state[4];
+    for (int i = 0; i < 4; i++)
+    {
+        Uint64 z = (seed += 0x9E3779B97F4A7C15ull);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        state[i] = z ^ (z >> 31);
+    }
+    for (int c = 0; c < count; c++)
+    {
+        memcpy(rng[c], state, sizeof(state));
+        jumpRandom(state);
+    }
+}
+
+void freeWalkers(WALKERS *walkers)
+{
+    free(walkers->x);
+    free(walkers->y);
+    free(walkers->rng);
+}
+
+// xoshiro256**
+Uint64 nextRandom(Uint64 state[4])
+{
+    Uint64 x = state[1] * 5;
+    Uint64 result = (x << 7 | x >> 57) * 9;
+    Uint64 t = state[1] << 17;
+    state[2] ^= state[0];
+    state[3] ^= state[1];
+    state[1] ^= state[2];
+    state[0] ^= state[3];
+    state[2] ^= t;
+    state[3] = state[3] << 45 | state[3] >> 19;
+    return result;
+}
+
+// equivalent to 2^128 calls to nextRandom
+void jumpRandom(Uint64 state[4])
+{
+    static const Uint64 jump[] = {0x180ec6d33cfd0abaull, 0xd5a61266f0c9392cull, 0xa9582618e03fc9aaull, 0x39abdc4529b1661cull};
+    Uint64 s[4] = {0, 0, 0, 0};
+    for (int i = 0; i < 4; i++)
+    {
+        for (int b = 0; b < 64; b++)
         {
-        case RED:
-            points[i].color = SDL_MapRGB(surface->format, COLOR_RED);
-            break;
-        case GREEN:
-            points[i].color = SDL_MapRGB(surface->format, COLOR_GREEN);
-            break;
-        case BLUE:
-            points[i].color = SDL_MapRGB(surface->format, COLOR_BLUE);
-            break;
-        case YELLOW:
-            points[i].color = SDL_MapRGB(surface->format, COLOR_YELLOW);
-            break;
-        case CYAN:
-            points[i].color = SDL_MapRGB(surface->format, COLOR_CYAN);
-            break;
-        case MAGENTA:
-            points[i].color = SDL_MapRGB(surface->format, COLOR_MAGENTA);
-            break;
+            if (jump[i] & (Uint64)1 << b)
+                for (int k = 0; k < 4; k++)
+                    s[k] ^= state[k];
+            nextRandom(state);
         }
     }
+    memcpy(state, s, sizeof(s));
 }
 
-void randomStepPoints(POINT points[], int len)
+void randomStepPoints(WALKERS *walkers, WORKER_POOL *pool)
 {
-    for (int i = 0; i < len; i++)
+    if (pool)
+        runParallel(pool, randomStepChunks, walkers, walkers->num_chunks);
+    else
+        randomStepChunks(walkers, 0, walkers->num_chunks);
+}
+
+void randomStepChunks(void *data, int begin, int end)
+{
+    WALKERS *walkers = (WALKERS *)data;
+    for (int c = begin; c < end; c++)
     {
-        Uint8 dir = rand() % DIR_SIZE;
-        switch (dir)
+        int first = c * CHUNK_SIZE;
+        int len = SDL_min(CHUNK_SIZE, walkers->len - first);
+        randomStepRange(walkers->x + first, walkers->y + first, len, walkers->rng[c]);
+    }
+}
+
+// Branch-free step: two random bits per walker pick the direction. Bit 0 is the
+// axis (0 = x, 1 = y) and bit 1 the sign, so the step is (bit1 * 2 - 1) * POINT_SIZE
+// on one axis and 0 on the other, followed by a clamp to the window.
+void randomStepRange(Sint16 *x, Sint16 *y, int len, Uint64 state[4])
+{
+    int i = 0;
+#ifdef __SSE2__
+    const __m128i one = _mm_set1_epi16(1), two = _mm_set1_epi16(2);
+    const __m128i point_size = _mm_set1_epi16(POINT_SIZE), zero = _mm_setzero_si128();
+    const __m128i max_x = _mm_set1_epi16(WIDTH - POINT_SIZE), max_y = _mm_set1_epi16(HEIGHT - POINT_SIZE);
+    while (i + 64 <= len)
+    {
+        // 128 random bits cover 64 walkers: 8 lanes of 16 bits, 2 bits per walker
+        Uint64 low = nextRandom(state), high = nextRandom(state);
+        __m128i bits = _mm_set_epi64x(high, low);
+        for (int shift = 0; shift < 8; shift++, i += 8)
         {
-        case LEFT:
-            points[i].x -= POINT_SIZE;
-            break;
-        case RIGHT:
-            points[i].x += POINT_SIZE;
+            __m128i axis_y = _mm_cmpeq_epi16(_mm_and_si128(bits, one), one);
+            __m128i step = _mm_sub_epi16(_mm_mullo_epi16(_mm_and_si128(bits, two), point_size), point_size);
+            __m128i px = _mm_loadu_si128((__m128i *)(x + i));
+            __m128i py = _mm_loadu_si128((__m128i *)(y + i));
+            px = _mm_add_epi16(px, _mm_andnot_si128(axis_y, step));
+            py = _mm_add_epi16(py, _mm_and_si128(axis_y, step));
+            px = _mm_min_epi16(_mm_max_epi16(px, zero), max_x);
+            py = _mm_min_epi16(_mm_max_epi16(py, zero), max_y);
+            _mm_storeu_si128((__m128i *)(x + i), px);
+            _mm_storeu_si128((__m128i *)(y + i), py);
+            bits = _mm_srli_epi16(bits, 2);
+        }
+    }
+#endif
+    Uint64 bits = 0;
+    for (int k = 0; i < len; i++, k = (k + 1) % 32)
+    {
+        if (!k)
+            bits = nextRandom(state);
+        int axis_y = bits & 1;
+        int step = ((int)(bits & 2) - 1) * POINT_SIZE;
+        int px = x[i] + step * !axis_y, py = y[i] + step * axis_y;
+        px = px < 0 ? 0 : px;
+        py = py < 0 ? 0 : py;
+        x[i] = px > WIDTH - POINT_SIZE ? WIDTH - POINT_SIZE : px;
+        y[i] = py > HEIGHT - POINT_SIZE ? HEIGHT - POINT_SIZE : py;
+        bits >>= 2;
+    }
+}
+
+void initHeatmap(HEATMAP *heatmap, WALKERS *walkers, int num_slices)
+{
+    heatmap->walkers = walkers;
+    heatmap->num_slices = num_slices;
+    heatmap->partials = (Uint32 *)malloc((size_t)num_slices * GRID_W * GRID_H * sizeof(Uint32));
+    heatmap->counts = (Uint32 *)calloc(GRID_W * GRID_H, sizeof(Uint32));
+    heatmap->row_max = (Uint32 *)calloc(GRID_H, sizeof(Uint32));
+    heatmap->pixels = (Uint32 *)calloc(GRID_W * GRID_H, sizeof(Uint32));
+    heatmap->max_count = 0;
+    heatmap->cumulative = 0;
+}
+
+void freeHeatmap(HEATMAP *heatmap)
+{
+    free(heatmap->partials);
+    free(heatmap->counts);
+    free(heatmap->row_max);
+    free(heatmap->pixels);
+}
+
+// num_slices matches the pool size, so each thread gets exactly one slice and one partial grid
+void updateHeatmap(HEATMAP *heatmap, WORKER_POOL *pool)
+{
+    if (pool)
+    {
+        runParallel(pool, accumulateSlices, heatmap, heatmap->num_slices);
+        runParallel(pool, mergeRows, heatmap, GRID_H);
+    }
+    else
+    {
+        accumulateSlices(heatmap, 0, heatmap->num_slices);
+        mergeRows(heatmap, 0, GRID_H);
+    }
+
+    heatmap->max_count = 0;
+    for (int i = 0; i < GRID_H; i++)
+        heatmap->max_count = SDL_max(heatmap->max_count, heatmap->row_max[i]);
+
+    if (pool)
+        runParallel(pool, toneMapRows, heatmap, GRID_H);
+    else
+        toneMapRows(heatmap, 0, GRID_H);
+}
+
+void accumulateSlices(void *data, int begin, int end)
+{
+    HEATMAP *heatmap = (HEATMAP *)data;
+    WALKERS *walkers = heatmap->walkers;
+    for (int s = begin; s < end; s++)
+    {
+        Uint32 *partial = heatmap->partials + (size_t)s * GRID_W * GRID_H;
+        int first = (Sint64)walkers->len * s / heatmap->num_slices;
+        int last = (Sint64)walkers->len * (s + 1) / heatmap->num_slices;
+        memset(partial, 0, GRID_W * GRID_H * sizeof(Uint32));
+        for (int i = first; i < last; i++)
+            partial[walkers->y[i] / POINT_SIZE * GRID_W + walkers->x[i] / POINT_SIZE]++;
+    }
+}
+
+void mergeRows(void *data, int begin, int end)
+{
+    HEATMAP *heatmap = (HEATMAP *)data;
+    for (int row = begin; row < end; row++)
+    {
+        Uint32 *counts = heatmap->counts + row * GRID_W;
+        Uint32 row_max = 0;
+        if (!heatmap->cumulative)
+            memset(counts, 0, GRID_W * sizeof(Uint32));
+        for (int s = 0; s < heatmap->num_slices; s++)
+        {
+            const Uint32 *partial = heatmap->partials + (size_t)s * GRID_W * GRID_H + row * GRID_W;
+            for (int i = 0; i < GRID_W; i++)
+                counts[i] += partial[i];
+        }
+        for (int i = 0; i < GRID_W; i++)
+            row_max = SDL_max(row_max, counts[i]);
+        heatmap->row_max[row] = row_max;
+    }
+}
+
+// log scale, so a handful of walkers stays visible next to a bin holding thousands
+void toneMapRows(void *data, int begin, int end)
+{
+    HEATMAP *heatmap = (HEATMAP *)data;
+    float scale = heatmap->max_count ? (COLORMAP_SIZE - 1) / SDL_log(1.0 + heatmap->max_count) : 0;
+    for (int row = begin; row < end; row++)
+    {
+        const Uint32 *counts = heatmap->counts + row * GRID_W;
+        Uint32 *pixels = heatmap->pixels + row * GRID_W;
+        for (int i = 0; i < GRID_W; i++)
+        {
+            int index = counts[i] ? 1 + (int)(SDL_log(1.0 + counts[i]) * scale) : 0;
+            pixels[i] = colormap[SDL_min(index, COLORMAP_SIZE - 1)];
+        }
+    }
+}
+
+void initDla(DLA *dla, int target, int num_walkers, Uint64 seed)
+{
+    // a DLA cluster of N particles reaches a radius of about 0.8 * N^(1/1.71), so 1.2 leaves
+    // headroom for unlucky seeds, and the lattice leaves room for the spawn and kill circles
+    int radius = 1.2 * SDL_pow(target, 1 / 1.71) + 64;
+    dla->size = 256;
+    while (dla->size < 4 * radius)
+        dla->size *= 2;
+    dla->words_per_row = dla->size / 64;
+    dla->blocks_per_row = dla->size / DLA_BLOCK;
+    dla->bitmap = (Uint64 *)calloc((size_t)dla->words_per_row * dla->size, sizeof(Uint64));
+    dla->field = (Uint8 *)malloc((size_t)dla->blocks_per_row * dla->blocks_per_row);
+    memset(dla->field, DLA_FIELD_CAP, (size_t)dla->blocks_per_row * dla->blocks_per_row);
+    dla->stamps = (Uint32 *)calloc((size_t)dla->blocks_per_row * dla->blocks_per_row, sizeof(Uint32));
+    dla->round = 0;
+    dla->count = 0;
+    dla->target = target;
+    dla->max_radius = 0;
+    dla->particles = (Uint16(*)[2])malloc(target * sizeof(dla->particles[0]));
+
+    dla->num_walkers = num_walkers;
+    dla->x = (int *)malloc(num_walkers * sizeof(int));
+    dla->y = (int *)malloc(num_walkers * sizeof(int));
+    dla->next_x = (int *)malloc(num_walkers * sizeof(int));
+    dla->next_y = (int *)malloc(num_walkers * sizeof(int));
+    dla->touched = (int(*)[4])malloc(num_walkers * sizeof(dla->touched[0]));
+    dla->stuck = (Uint8 *)calloc(num_walkers, 1);
+    dla->rng = (Uint64(*)[4])malloc(num_walkers * sizeof(dla->rng[0]));
+    dla->saved_rng = (Uint64(*)[4])malloc(num_walkers * sizeof(dla->saved_rng[0]));
+    seedStreams(dla->rng, num_walkers, seed);
+    // x < 0 marks a walker that still has to be spawned
+    for (int i = 0; i < num_walkers; i++)
+        dla->x[i] = dla->y[i] = -1;
+
+    for (int i = 0; i < DLA_ANGLES; i++)
+    {
+        dla->angles[i][0] = SDL_cos(2 * M_PI * i / DLA_ANGLES);
+        dla->angles[i][1] = SDL_sin(2 * M_PI * i / DLA_ANGLES);
+    }
+
+    attachParticle(dla, dla->size / 2, dla->size / 2);
+}
+
+void freeDla(DLA *dla)
+{
+    free(dla->bitmap);
+    free(dla->field);
+    free(dla->stamps);
+    free(dla->particles);
+    free(dla->x);
+    free(dla->y);
+    free(dla->next_x);
+    free(dla->next_y);
+    free(dla->touched);
+    free(dla->stuck);
+    free(dla->rng);
+    free(dla->saved_rng);
+}
+
+// One round: every active walker moves up to DLA_ROUND_STEPS times, then the round
+// is committed in walker order. There is one active walker per DLA_PARTICLES_PER_WALKER
+// particles: walkers crowding a small cluster would grow it denser than one-at-a-time
+// DLA. Returns the number of particles attached.
+int stepDla(DLA *dla, WORKER_POOL *pool)
+{
+    int before = dla->count;
+    dla->active = SDL_clamp(dla->count / DLA_PARTICLES_PER_WALKER, 1, dla->num_walkers);
+    dla->spawn_radius = dla->max_radius + DLA_BLOCK;
+    dla->kill_radius = SDL_min(3 * dla->spawn_radius + 64, dla->size / 2 - DLA_NEAR_RADIUS - 2);
+    if (dla->spawn_radius >= dla->kill_radius)
+        return 0;
+
+    dla->round++;
+    memcpy(dla->saved_rng, dla->rng, dla->active * sizeof(dla->rng[0]));
+    if (pool)
+        runParallel(pool, walkDlaRange, dla, dla->active);
+    else
+        walkDlaRange(dla, 0, dla->active);
+
+    for (int i = 0; i < dla->active; i++)
+    {
+        if (dla->count >= dla->target || !isWalkValid(dla, i))
+        {
+            // replay the same moves against the grown cluster next round
+            memcpy(dla->rng[i], dla->saved_rng[i], sizeof(dla->rng[i]));
+            dla->stuck[i] = 0;
+            continue;
+        }
+        if (dla->stuck[i])
+        {
+            dla->stuck[i] = 0;
+            attachParticle(dla, dla->next_x[i], dla->next_y[i]);
+            dla->x[i] = dla->y[i] = -1;
+        }
+        else
+        {
+            dla->x[i] = dla->next_x[i];
+            dla->y[i] = dla->next_y[i];
+        }
+    }
+    return dla->count - before;
+}
+
+void walkDlaRange(void *data, int begin, int end)
+{
+    DLA *dla = (DLA *)data;
+    for (int i = begin; i < end; i++)
+        walkDla(dla, i);
+}
+
+void walkDla(DLA *dla, int i)
+{
+    int x = dla->x[i], y = dla->y[i], center = dla->size / 2;
+    int kill_r2 = dla->kill_radius * dla->kill_radius;
+    int outside_r2 = (dla->max_radius + DLA_BLOCK) * (dla->max_radius + DLA_BLOCK);
+    Uint64 *state = dla->rng[i];
+    Uint64 bits = 0;
+    int bits_left = 0;
+    int *touched = dla->touched[i];
+    touched[0] = touched[1] = INT_MAX;
+    touched[2] = touched[3] = INT_MIN;
+
+    for (int n = 0; n < DLA_ROUND_STEPS; n++)
+    {
+        if (bits_left < 12)
+        {
+            bits = nextRandom(state);
+            bits_left = 64;
+        }
+        int dx = x - center, dy = y - center;
+        int r2 = dx * dx + dy * dy;
+        // spawn on the circle just outside the cluster, and put walkers that strayed
+        // too far back on it instead of waiting for them to return
+        if (x < 0 || r2 > kill_r2)
+        {
+            const float *angle = dla->angles[bits % DLA_ANGLES];
+            x = center + (int)SDL_floorf(angle[0] * dla->spawn_radius + 0.5f);
+            y = center + (int)SDL_floorf(angle[1] * dla->spawn_radius + 0.5f);
+            bits >>= 12;
+            bits_left -= 12;
+            continue;
+        }
+
+        // the largest circle around the walker that is free of the cluster, from the
+        // bounding circle when outside it and from the block field otherwise. It is
+        // shrunk by 3 so that the rounded landing point cannot touch a particle attached
+        // next to the cluster in this round either, which keeps jumps out of the
+        // conflict check
+        int jump = 0;
+        if (r2 > outside_r2)
+            jump = (int)SDL_sqrt(r2) - dla->max_radius - 3;
+        int blocks = dla->field[(y / DLA_BLOCK) * dla->blocks_per_row + x / DLA_BLOCK];
+        jump = SDL_max(jump, (blocks - 1) * DLA_BLOCK - 2);
+        // next to the cluster, look for an empty square in the bitmap before falling back to unit steps
+        for (int radius = DLA_NEAR_RADIUS; jump < 2 && radius >= 4; radius /= 2)
+            if (isWindowEmpty(dla, x, y, radius))
+                jump = radius - 2;
+        if (jump >= 2)
+        {
+            // keep each round's unit steps in one neighbourhood so conflicts stay local
+            if (touched[0] <= touched[2])
+                break;
+            const float *angle = dla->angles[bits % DLA_ANGLES];
+            x += (int)SDL_floorf(angle[0] * jump + 0.5f);
+            y += (int)SDL_floorf(angle[1] * jump + 0.5f);
+            bits >>= 12;
+            bits_left -= 12;
+            continue;
+        }
+
+        touched[0] = SDL_min(touched[0], x);
+        touched[1] = SDL_min(touched[1], y);
+        touched[2] = SDL_max(touched[2], x);
+        touched[3] = SDL_max(touched[3], y);
+        if (isOccupied(dla, x + 1, y) || isOccupied(dla, x - 1, y) || isOccupied(dla, x, y + 1) || isOccupied(dla, x, y - 1))
+        {
+            dla->stuck[i] = 1;
             break;
-        case UP:
-            points[i].y -= POINT_SIZE;
+        }
+        int step = (int)(bits & 2) - 1;
+        if (bits & 1)
+            y += step;
+        else
+            x += step;
+        bits >>= 2;
+        bits_left -= 2;
+    }
+    dla->next_x[i] = x;
+    dla->next_y[i] = y;
+}
+
+int isOccupied(DLA *dla, int x, int y)
+{
+    return dla->bitmap[(size_t)y * dla->words_per_row + x / 64] >> (x % 64) & 1;
+}
+
+// whether the square of the given Chebyshev radius around (x, y) holds no particle
+int isWindowEmpty(DLA *dla, int x, int y, int radius)
+{
+    int x0 = x - radius, shift = x0 % 64;
+    Uint64 mask = ((Uint64)1 << (2 * radius + 1)) - 1;
+    for (int j = y - radius; j <= y + radius; j++)
+    {
+        const Uint64 *words = dla->bitmap + (size_t)j * dla->words_per_row + x0 / 64;
+        Uint64 bits = words[0] >> shift;
+        if (shift)
+            bits |= words[1] << (64 - shift);
+        if (bits & mask)
+            return 0;
+    }
+    return 1;
+}
+
+// a walk stays valid unless a particle attached earlier in this round landed on or
+// next to one of its unit steps, checked through the blocks stamped with this round
+int isWalkValid(DLA *dla, int i)
+{
+    const int *touched = dla->touched[i];
+    if (touched[0] > touched[2])
+        return 1;
+    int x0 = (touched[0] - 1) / DLA_BLOCK, x1 = (touched[2] + 1) / DLA_BLOCK;
+    int y0 = (touched[1] - 1) / DLA_BLOCK, y1 = (touched[3] + 1) / DLA_BLOCK;
+    for (int y = y0; y <= y1; y++)
+        for (int x = x0; x <= x1; x++)
+            if (dla->stamps[y * dla->blocks_per_row + x] == dla->round)
+                return 0;
+    return 1;
+}
+
+void attachParticle(DLA *dla, int x, int y)
+{
+    int center = dla->size / 2;
+    dla->bitmap[(size_t)y * dla->words_per_row + x / 64] |= (Uint64)1 << (x % 64);
+    dla->particles[dla->count][0] = x;
+    dla->particles[dla->count][1] = y;
+    dla->count++;
+    dla->stamps[(y / DLA_BLOCK) * dla->blocks_per_row + x / DLA_BLOCK] = dla->round;
+    int radius = (int)SDL_ceil(SDL_sqrt((x - center) * (x - center) + (y - center) * (y - center)));
+    dla->max_radius = SDL_max(dla->max_radius, radius);
+
+    // the first particle in a block lowers the field for every block within the cap
+    int bx = x / DLA_BLOCK, by = y / DLA_BLOCK;
+    if (dla->field[by * dla->blocks_per_row + bx] == 0)
+        return;
+    int y0 = SDL_max(by - DLA_FIELD_CAP, 0), y1 = SDL_min(by + DLA_FIELD_CAP, dla->blocks_per_row - 1);
+    int x0 = SDL_max(bx - DLA_FIELD_CAP, 0), x1 = SDL_min(bx + DLA_FIELD_CAP, dla->blocks_per_row - 1);
+    for (int j = y0; j <= y1; j++)
+    {
+        Uint8 *row = dla->field + j * dla->blocks_per_row;
+        for (int i = x0; i <= x1; i++)
+        {
+            int d = SDL_max(SDL_abs(i - bx), SDL_abs(j - by));
+            if (d < row[i])
+                row[i] = d;
+        }
+    }
+}
+
+// grows a cluster of target particles, headless with --bench, otherwise drawn as it
+// grows with particles coloured by arrival time
+int runDla(int target, int num_walkers, int num_threads, Uint64 seed, int bench)
+{
+    DLA dla;
+    initDla(&dla, target, num_walkers, seed);
+    WORKER_POOL *pool = num_threads > 1 && num_walkers > 1 ? createWorkerPool(num_threads) : NULL;
+    printf("DLA: %d particles on a %dx%d lattice, %d walkers on %d thread(s)\n", target, dla.size, dla.size, num_walkers,
+           pool ? pool->num_threads : 1);
+
+    SDL_Window *window = NULL;
+    SDL_Renderer *renderer = NULL;
+    SDL_Texture *texture = NULL;
+    Uint32 *pixels = NULL;
+    int view_shift = 0, drawn = 0;
+    if (!bench)
+    {
+        SDL_Init(SDL_INIT_EVERYTHING);
+        window = SDL_CreateWindow("Random Walk - DLA", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, WIDTH, HEIGHT, 0);
+        renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+        while (dla.size >> view_shift > DLA_VIEW_SIZE)
+            view_shift++;
+        texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, dla.size >> view_shift,
+                                    dla.size >> view_shift);
+        pixels = (Uint32 *)calloc((size_t)(dla.size >> view_shift) * (dla.size >> view_shift), sizeof(Uint32));
+        initColormap();
+    }
+
+    Uint64 start = SDL_GetPerformanceCounter(), frequency = SDL_GetPerformanceFrequency();
+    Uint8 running = 1, growing = 1;
+    while (running)
+    {
+        // headless runs go flat out, the window grows the cluster for most of a frame between draws
+        Uint64 frame_start = SDL_GetPerformanceCounter();
+        while (growing && (bench || SDL_GetPerformanceCounter() - frame_start < frequency / FRAME_RATE))
+        {
+            stepDla(&dla, pool);
+            growing = dla.count < dla.target && dla.spawn_radius < dla.kill_radius;
+        }
+        if (bench)
             break;
-        case DOWN:
-            points[i].y += POINT_SIZE;
+
+        SDL_Event event;
+        while (SDL_PollEvent(&event))
+            if (event.type == SDL_QUIT)
+                running = 0;
+
+        int view_size = dla.size >> view_shift, top = view_size, bottom = -1;
+        for (; drawn < dla.count; drawn++)
+        {
+            int x = dla.particles[drawn][0] >> view_shift, y = dla.particles[drawn][1] >> view_shift;
+            pixels[y * view_size + x] = colormap[1 + (Sint64)drawn * (COLORMAP_SIZE - 2) / dla.target];
+            top = SDL_min(top, y);
+            bottom = SDL_max(bottom, y);
         }
-        clampPointPosition(points + i);
+        if (bottom >= top)
+        {
+            SDL_Rect rows = {0, top, view_size, bottom - top + 1};
+            SDL_UpdateTexture(texture, &rows, pixels + top * view_size, view_size * sizeof(Uint32));
+        }
+        char title[128];
+        double secs = (double)(SDL_GetPerformanceCounter() - start) / frequency;
+        snprintf(title, sizeof(title), "Random Walk - DLA: %d particles, %.0f particles/s", dla.count,
+                 growing && secs > 0 ? dla.count / secs : 0);
+        SDL_SetWindowTitle(window, title);
+        SDL_Rect view = {(WIDTH - HEIGHT) / 2, 0, HEIGHT, HEIGHT};
+        SDL_RenderClear(renderer);
+        SDL_RenderCopy(renderer, texture, NULL, &view);
+        SDL_RenderPresent(renderer);
+        if (!growing)
+            SDL_Delay(1000 / FRAME_RATE);
+    }
+
+    if (bench)
+    {
+        double secs = (double)(SDL_GetPerformanceCounter() - start) / frequency;
+        // order-sensitive hash of the attachment sequence, equal for any thread count
+        Uint64 hash = 0xcbf29ce484222325ull;
+        for (int i = 0; i < dla.count; i++)
+            hash = (hash ^ ((Uint32)dla.particles[i][0] << 16 | dla.particles[i][1])) * 0x100000001b3ull;
+        printf("attached %d particles in %.3f s: %.4g particles/s\n", dla.count, secs, secs > 0 ? dla.count / secs : 0);
+        printf("cluster radius %d, checksum %016llx%s\n", dla.max_radius, (unsigned long long)hash,
+               dla.count < dla.target ? " (lattice full)" : "");
+    }
+    else
+    {
+        free(pixels);
+        SDL_DestroyTexture(texture);
+        SDL_DestroyRenderer(renderer);
+        SDL_DestroyWindow(window);
+        SDL_Quit();
     }
+    if (pool)
+        destroyWorkerPool(pool);
+    freeDla(&dla);
+    return 0;
 }
 
-void clampPointPosition(POINT *point)
+WORKER_POOL *createWorkerPool(int num_threads)
 {
-    if (point->x < 0)
-        point->x = 0;
-    else if (point->x > WIDTH - POINT_SIZE)
-        point->x = WIDTH - POINT_SIZE;
-    if (point->y < 0)
-        point->y = 0;
-    else if (point->y > HEIGHT - POINT_SIZE)
-        point->y = HEIGHT - POINT_SIZE;
+    WORKER_POOL *pool = (WORKER_POOL *)calloc(1, sizeof(WORKER_POOL));
+    pool->num_threads = SDL_clamp(num_threads, 1, MAX_THREADS);
+    pool->mutex = SDL_CreateMutex();
+    pool->work_ready = SDL_CreateCond();
+    pool->work_done = SDL_CreateCond();
+    for (int i = 0; i < pool->num_threads; i++)
+    {
+        pool->workers[i] = (WORKER){pool, i};
+        pool->threads[i] = SDL_CreateThread(workerMain, "walk worker", pool->workers + i);
+    }
+    return pool;
 }
 
-void FillPoints(POINT points[], int len, SDL_Surface *surface)
+void destroyWorkerPool(WORKER_POOL *pool)
 {
-    for (int i = 0; i < len; i++)
+    SDL_LockMutex(pool->mutex);
+    pool->quit = 1;
+    SDL_CondBroadcast(pool->work_ready);
+    SDL_UnlockMutex(pool->mutex);
+    for (int i = 0; i < pool->num_threads; i++)
+        SDL_WaitThread(pool->threads[i], NULL);
+    SDL_DestroyCond(pool->work_ready);
+    SDL_DestroyCond(pool->work_done);
+    SDL_DestroyMutex(pool->mutex);
+    free(pool);
+}
+
+// runs work over [0, count) split into one contiguous slice per thread and waits for all of them
+void runParallel(WORKER_POOL *pool, WORK_FUNC work, void *data, int count)
+{
+    SDL_LockMutex(pool->mutex);
+    pool->work = work;
+    pool->data = data;
+    pool->count = count;
+    pool->pending = pool->num_threads;
+    pool->generation++;
+    SDL_CondBroadcast(pool->work_ready);
+    while (pool->pending)
+        SDL_CondWait(pool->work_done, pool->mutex);
+    SDL_UnlockMutex(pool->mutex);
+}
+
+int workerMain(void *data)
+{
+    WORKER *worker = (WORKER *)data;
+    WORKER_POOL *pool = worker->pool;
+    int seen = 0;
+
+    SDL_LockMutex(pool->mutex);
+    while (1)
     {
-        SDL_Rect point_rect = {points[i].x, points[i].y, POINT_SIZE, POINT_SIZE};
-        SDL_FillRect(surface, &point_rect, points[i].color);
+        while (pool->generation == seen && !pool->quit)
+            SDL_CondWait(pool->work_ready, pool->mutex);
+        if (pool->quit)
+            break;
+        seen = pool->generation;
+        int begin = (Sint64)pool->count * worker->index / pool->num_threads;
+        int end = (Sint64)pool->count * (worker->index + 1) / pool->num_threads;
+        SDL_UnlockMutex(pool->mutex);
+
+        pool->work(pool->data, begin, end);
+
+        SDL_LockMutex(pool->mutex);
+        if (--pool->pending == 0)
+            SDL_CondSignal(pool->work_done);
     }
-}
\ No newline at end of file
+    SDL_UnlockMutex(pool->mutex);
+    return 0;
+}
+
+int runBenchmark(int num_walkers, int num_steps, int num_threads, Uint64 seed)
+{
+    WALKERS walkers;
+    initWalkers(&walkers, num_walkers, seed);
+    WORKER_POOL *pool = num_threads > 1 && walkers.num_chunks > 1 ? createWorkerPool(num_threads) : NULL;
+
+    printf("Random walk benchmark: %d walkers x %d steps on %d thread(s)%s\n", num_walkers, num_steps, pool ? pool->num_threads : 1,
+#ifdef __SSE2__
+           ", SSE2"
+#else
+           ""
+#endif
+    );
+
+    Uint64 start = SDL_GetPerformanceCounter();
+    for (int s = 0; s < num_steps; s++)
+        randomStepPoints(&walkers, pool);
+    double secs = (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+
+    HEATMAP heatmap;
+    initColormap();
+    initHeatmap(&heatmap, &walkers, pool ? pool->num_threads : 1);
+    start = SDL_GetPerformanceCounter();
+    for (int s = 0; s < num_steps; s++)
+        updateHeatmap(&heatmap, pool);
+    double heatmap_secs = (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+    freeHeatmap(&heatmap);
+
+    // mean distance from the start as a sanity check, it grows like sqrt(steps)
+    double spread = 0;
+    for (int i = 0; i < num_walkers; i++)
+        spread += SDL_sqrt(SDL_pow(walkers.x[i] - (WIDTH - POINT_SIZE) / 2, 2) + SDL_pow(walkers.y[i] - (HEIGHT - POINT_SIZE) / 2, 2));
+
+    double walker_steps = (double)num_walkers * num_steps;
+    printf("%.0f walker-steps in %.3f s: %.4g walker-steps/s\n", walker_steps, secs, secs > 0 ? walker_steps / secs : 0);
+    printf("heatmap (%dx%d bins): %.3f ms per frame\n", GRID_W, GRID_H, num_steps ? heatmap_secs * 1000 / num_steps : 0);
+    printf("mean distance from start: %.1f px\n", num_walkers ? spread / num_walkers : 0);
+
+    if (pool)
+        destroyWorkerPool(pool);
+    freeWalkers(&walkers);
+    return 0;
+}
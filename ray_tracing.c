@@ -1,130 +1,1422 @@
 #include <SDL2/SDL.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define WINDOW_WIDTH 1280
 #define WINDOW_HEIGHT 720
-#define PI 3.1415926
-#define RAYS_SIZE 1000
-#define THRESHOLD 1
-#define RGBCOLOR_BG_LIT 192, 192, 192
-#define RGBCOLOR_BG_DARK 64, 64, 64
-#define RGBCOLOR_CIRCLE_BRIGHT 255, 255, 255
-#define RGBCOLOR_CIRCLE_OPAQUE 0, 0, 0
+#define MAX_THREADS 16
+#define TILE_SIZE 32
+#define BVH_LEAF_SIZE 4
+#define BVH_STACK 64
+#define CANDIDATE_BATCH 16
+#define MAX_POLYGON_POINTS 8
+#define DEFAULT_OCCLUDERS 200
+#define MAX_OCCLUDERS 12800
+#define NUM_LIGHTS 6
+#define LIGHT_RADIUS 10
+#define LIGHT_SAMPLES 64
+#define GOLDEN_ANGLE 2.39996323
+#define LIGHT_FALLOFF 250.0
+#define AMBIENT 0.02
+#define RGBCOLOR_OCCLUDER 0, 0, 0
+#define CIRCLE_SEGMENTS 32
+#define SEGMENT_WIDTH 3
+#define FALLOFF_TEXTURE_SIZE 256
+#define FALLOFF_INTENSITY 1.5
+#define SWEEP_EPSILON 1e-4f
+
+enum LIGHTING_MODE
+{
+    MODE_PIXELS,
+    MODE_POLYGONS
+};
+
+enum OCCLUDER_TYPE
+{
+    OCCLUDER_CIRCLE,
+    OCCLUDER_SEGMENT,
+    OCCLUDER_POLYGON
+};
 
 typedef struct
 {
     double x, y, r;
 } CIRCLE;
 
-int main()
+typedef struct
+{
+    CIRCLE circle;
+    float color[3];
+    float intensity;
+} LIGHT;
+
+// a shape that casts shadows: a circle, a segment between two points or a polygon
+typedef struct
+{
+    int type;
+    CIRCLE circle;
+    SDL_FPoint points[MAX_POLYGON_POINTS];
+    int num_points;
+} OCCLUDER;
+
+// what visibility is tested against: circles as they are, segments and polygons as their edges
+typedef struct
 {
-    void FillCircle(SDL_Surface *, CIRCLE *, int color);
-    void CastRays(SDL_Surface *, CIRCLE *, CIRCLE *);
+    int type;
+    float x0, y0, x1, y1, r;
+} PRIMITIVE;
+
+// A node of the bounding volume hierarchy over the primitives. A leaf holds count of
+// them from first; an inner node has count 0, its first child right after it and its
+// second at first.
+typedef struct
+{
+    float min_x, min_y, max_x, max_y;
+    int first, count;
+} BVH_NODE;
+
+// where a walk of the hierarchy has got to: the nodes still to visit, the next on top
+typedef struct
+{
+    int stack[BVH_STACK];
+    int top;
+} BVH_WALK;
+
+typedef struct
+{
+    LIGHT lights[NUM_LIGHTS];
+    OCCLUDER *occluders;
+    int num_occluders;
+    PRIMITIVE *primitives;
+    int num_primitives;
+    BVH_NODE *nodes;
+    int num_nodes;
+    // where the outlines of two primitives cross, which does not depend on the lights
+    SDL_FPoint *crossings;
+    int num_crossings;
+    // changes whenever the occluders do
+    int generation;
+} SCENE;
+
+// the outline of what one light reaches, kept until the light or the occluders move
+typedef struct
+{
+    SDL_FPoint *points;
+    int num_points, capacity;
+    double x, y;
+    int generation;
+} VISIBILITY;
+
+// triangles gathered for one SDL_RenderGeometry call
+typedef struct
+{
+    SDL_Vertex *vertices;
+    int *indices;
+    int num_vertices, num_indices, vertex_capacity, index_capacity;
+} GEOMETRY;
+
+// One pass of lighting, with each light shining from one point of its disc. Tiles are
+// handed out to the threads one at a time; each adds every light into the radiance
+// its pixels have gathered over the passes and tone maps the average into the canvas.
+typedef struct
+{
+    const SCENE *scene;
+    SDL_Surface *canvas;
+    // planar red, green and blue, canvas->w * canvas->h floats each
+    float *radiance;
+    SDL_FPoint samples[NUM_LIGHTS];
+    // this one's number, 0 to start the radiance again
+    int pass;
+    // where the canvas's top left pixel is in the scene, and how far apart its pixels are
+    float origin_x, origin_y, scale;
+    SDL_atomic_t next_tile;
+    int tiles_x, num_tiles;
+} FRAME;
+
+int main(int argc, char **argv)
+{
+    void GenerateOccluders(SCENE *, int);
+    int RenderFile(SCENE *, const char *, int, int, int, int);
+    double RenderPixels(SCENE *, SDL_Surface *, float *, int, float, float, float);
+    double RenderPolygons(SDL_Renderer *, const SCENE *, VISIBILITY *, SDL_Texture *, GEOMETRY *);
+    SDL_Texture *CreateFalloffTexture(SDL_Renderer *);
+    void DrawScene(SDL_Renderer *, const SCENE *, GEOMETRY *);
+    void FreeScene(SCENE *);
+
+    const char *render_path = NULL;
+    int render_w = 7680, render_h = 4320, num_occluders = DEFAULT_OCCLUDERS, samples = LIGHT_SAMPLES, frames = 1;
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--render") && i + 1 < argc)
+            render_path = argv[++i];
+        else if (!strcmp(argv[i], "--size") && i + 1 < argc)
+            sscanf(argv[++i], "%dx%d", &render_w, &render_h);
+        else if (!strcmp(argv[i], "--occluders") && i + 1 < argc)
+            num_occluders = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--samples") && i + 1 < argc)
+            samples = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--frames") && i + 1 < argc)
+            frames = atoi(argv[++i]);
+        else
+        {
+            printf("Usage: ./ray_tracing [--occluders N]\n"
+                   "       ./ray_tracing --render <PPM file> [--size WxH] [--occluders N] [--samples N] [--frames N]\n"
+                   "With more than one frame, the file name has a %%d or %%0Nd for the frame number, like frame%%04d.ppm\n");
+            return 0;
+        }
+    }
+    num_occluders = SDL_clamp(num_occluders, 1, MAX_OCCLUDERS);
+    samples = SDL_max(samples, 1);
+    frames = SDL_max(frames, 1);
+
+    SCENE scene = {{{{200, 250, LIGHT_RADIUS}, {1.0f, 0.85f, 0.6f}, 1.5f},
+                    {{640, 120, LIGHT_RADIUS}, {1.0f, 0.3f, 0.2f}, 1.2f},
+                    {{1080, 250, LIGHT_RADIUS}, {0.3f, 1.0f, 0.4f}, 1.2f},
+                    {{1080, 520, LIGHT_RADIUS}, {0.3f, 0.5f, 1.0f}, 1.2f},
+                    {{640, 600, LIGHT_RADIUS}, {1.0f, 0.8f, 0.2f}, 1.2f},
+                    {{200, 520, LIGHT_RADIUS}, {0.8f, 0.3f, 1.0f}, 1.2f}},
+                   NULL, 0, NULL, 0, NULL, 0, NULL, 0, 0};
+    GenerateOccluders(&scene, num_occluders);
+
+    // headless render
+    if (render_path)
+    {
+        int result = RenderFile(&scene, render_path, render_w, render_h, samples, frames);
+        FreeScene(&scene);
+        return result;
+    }
 
     SDL_Init(SDL_INIT_EVERYTHING);
     SDL_Window *window = SDL_CreateWindow("Ray Tracing", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, WINDOW_WIDTH, WINDOW_HEIGHT, 0);
-    SDL_Surface *surface = SDL_GetWindowSurface(window);
-
-    CIRCLE circle_bright = {200, 250, 75};
-    CIRCLE circle_opaque = {800, 360, 125};
+    SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+    // the per-pixel lighting is shaded into the canvas, then uploaded to the texture
+    SDL_Surface *canvas = SDL_CreateRGBSurfaceWithFormat(0, WINDOW_WIDTH, WINDOW_HEIGHT, 32, SDL_PIXELFORMAT_ARGB8888);
+    SDL_Texture *lighting = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, WINDOW_WIDTH, WINDOW_HEIGHT);
+    SDL_Texture *falloff = CreateFalloffTexture(renderer);
+    float *radiance = (float *)malloc((size_t)WINDOW_WIDTH * WINDOW_HEIGHT * 3 * sizeof(float));
+    if (!canvas || !radiance)
+    {
+        printf("Out of memory\n");
+        return 1;
+    }
+    printf("Drag a light to move it, +/- to double or halve the number of occluders\n");
+    printf("M to switch between lighting every pixel and filling visibility polygons\n");
 
-    SDL_FillRect(surface, NULL, SDL_MapRGB(surface->format, RGBCOLOR_BG_DARK));
-    FillCircle(surface, &circle_bright, SDL_MapRGB(surface->format, RGBCOLOR_CIRCLE_BRIGHT));
-    FillCircle(surface, &circle_opaque, SDL_MapRGB(surface->format, RGBCOLOR_CIRCLE_OPAQUE));
-    CastRays(surface, &circle_bright, &circle_opaque);
-    SDL_UpdateWindowSurface(window);
+    VISIBILITY visibility[NUM_LIGHTS];
+    memset(visibility, 0, sizeof(visibility));
+    GEOMETRY geometry = {NULL, NULL, 0, 0, 0, 0};
 
-    int running = 1;
+    // the per-pixel passes gathered since the scene last changed, and the time they took
+    int running = 1, updated = 1, dragged = -1, mode = MODE_PIXELS, passes = 0;
+    double pass_ms = 0;
     while (running)
     {
         SDL_Event event;
-        int updated = 0;
         while (SDL_PollEvent(&event))
         {
             if (event.type == SDL_QUIT)
                 running = 0;
-            else if (event.type == SDL_MOUSEMOTION && event.motion.state == SDL_PRESSED)
+            else if (event.type == SDL_WINDOWEVENT)
+                updated = 1;
+            else if (event.type == SDL_MOUSEBUTTONDOWN && event.button.button == SDL_BUTTON_LEFT)
+            {
+                // the light nearest the mouse follows it until the button is released
+                double nearest = 1e30;
+                for (int i = 0; i < NUM_LIGHTS; i++)
+                {
+                    double dx = scene.lights[i].circle.x - event.button.x, dy = scene.lights[i].circle.y - event.button.y;
+                    if (dx * dx + dy * dy < nearest)
+                    {
+                        nearest = dx * dx + dy * dy;
+                        dragged = i;
+                    }
+                }
+            }
+            else if (event.type == SDL_MOUSEBUTTONUP && event.button.button == SDL_BUTTON_LEFT)
+                dragged = -1;
+            else if (event.type == SDL_MOUSEMOTION && event.motion.state == SDL_PRESSED && dragged >= 0)
             {
-                circle_bright.x = event.motion.x;
-                circle_bright.y = event.motion.y;
+                scene.lights[dragged].circle.x = SDL_clamp(event.motion.x, 0, WINDOW_WIDTH - 1);
+                scene.lights[dragged].circle.y = SDL_clamp(event.motion.y, 0, WINDOW_HEIGHT - 1);
+                passes = 0;
                 updated = 1;
             }
+            else if (event.type == SDL_KEYDOWN)
+            {
+                SDL_Keycode key = event.key.keysym.sym;
+                int count = scene.num_occluders;
+                if (key == SDLK_PLUS || key == SDLK_EQUALS || key == SDLK_KP_PLUS)
+                    count = SDL_min(count * 2, MAX_OCCLUDERS);
+                else if (key == SDLK_MINUS || key == SDLK_KP_MINUS)
+                    count = SDL_max(count / 2, 1);
+                else if (key == SDLK_m)
+                {
+                    mode = mode == MODE_PIXELS ? MODE_POLYGONS : MODE_PIXELS;
+                    updated = 1;
+                }
+                if (count != scene.num_occluders)
+                {
+                    GenerateOccluders(&scene, count);
+                    passes = 0;
+                    updated = 1;
+                }
+            }
         }
-        if(updated)
+        // the per-pixel lighting takes another sample of the lights each time round until
+        // it has them all, so that the shadows soften without holding up the events
+        int refining = mode == MODE_PIXELS && passes < LIGHT_SAMPLES;
+        if(updated || refining)
         {
-            SDL_FillRect(surface, NULL, SDL_MapRGB(surface->format, RGBCOLOR_BG_DARK));
-            FillCircle(surface, &circle_bright, SDL_MapRGB(surface->format, RGBCOLOR_CIRCLE_BRIGHT));
-            FillCircle(surface, &circle_opaque, SDL_MapRGB(surface->format, RGBCOLOR_CIRCLE_OPAQUE));
-            CastRays(surface, &circle_bright, &circle_opaque);
-            SDL_UpdateWindowSurface(window);
+            char title[160];
+            if (mode == MODE_PIXELS)
+            {
+                if (refining)
+                {
+                    if (!passes)
+                        pass_ms = 0;
+                    pass_ms += RenderPixels(&scene, canvas, radiance, passes++, 0, 0, 1);
+                }
+                SDL_UpdateTexture(lighting, NULL, canvas->pixels, canvas->pitch);
+                SDL_RenderCopy(renderer, lighting, NULL, NULL);
+                snprintf(title, sizeof(title),
+                         "Ray Tracing - per pixel - %d lights, %d occluders (%d primitives) - %d/%d samples, %.1f M samples/s",
+                         NUM_LIGHTS, scene.num_occluders, scene.num_primitives, passes, LIGHT_SAMPLES,
+                         (double)passes * NUM_LIGHTS * WINDOW_WIDTH * WINDOW_HEIGHT / SDL_max(pass_ms, 1e-3) / 1000);
+            }
+            else
+            {
+                double ms = RenderPolygons(renderer, &scene, visibility, falloff, &geometry);
+                snprintf(title, sizeof(title), "Ray Tracing - visibility polygons - %d lights, %d occluders (%d primitives) - %.1f ms",
+                         NUM_LIGHTS, scene.num_occluders, scene.num_primitives, ms);
+            }
+            DrawScene(renderer, &scene, &geometry);
+            SDL_RenderPresent(renderer);
+            SDL_SetWindowTitle(window, title);
+            updated = 0;
         }
-        SDL_Delay(10);
+        if (!refining)
+            SDL_Delay(10);
     }
 
+    FreeScene(&scene);
+    for (int i = 0; i < NUM_LIGHTS; i++)
+        free(visibility[i].points);
+    free(geometry.vertices);
+    free(geometry.indices);
+    free(radiance);
+    SDL_FreeSurface(canvas);
+    if (falloff)
+        SDL_DestroyTexture(falloff);
+    SDL_DestroyTexture(lighting);
+    SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
     SDL_Quit();
     return 0;
 }
 
-void FillCircle(SDL_Surface *surface, CIRCLE *circle, int color)
+float Random(unsigned *state)
+{
+    *state = *state * 1664525 + 1013904223;
+    return (*state >> 8) / 16777216.0f;
+}
+
+// Scatters count occluders over the window, away from where the lights start, and
+// builds the hierarchy their primitives are looked up in. The more of them there
+// are the smaller they get, so that they cover about the same part of the window.
+void GenerateOccluders(SCENE *scene, int count)
+{
+    float Random(unsigned *);
+    void BuildBvh(SCENE *);
+    void FindCrossings(SCENE *);
+    void FreeScene(SCENE *);
+
+    FreeScene(scene);
+    scene->generation++;
+    scene->occluders = (OCCLUDER *)malloc(count * sizeof(OCCLUDER));
+    scene->primitives = (PRIMITIVE *)malloc((size_t)count * MAX_POLYGON_POINTS * sizeof(PRIMITIVE));
+    scene->nodes = (BVH_NODE *)malloc((size_t)count * MAX_POLYGON_POINTS * 2 * sizeof(BVH_NODE));
+    if (!scene->occluders || !scene->primitives || !scene->nodes)
+    {
+        FreeScene(scene);
+        return;
+    }
+    unsigned state = 12345;
+    double size = SDL_max(16 * SDL_sqrt((double)DEFAULT_OCCLUDERS / count), 2);
+    while (scene->num_occluders < count)
+    {
+        OCCLUDER *occluder = &scene->occluders[scene->num_occluders];
+        double x = Random(&state) * WINDOW_WIDTH, y = Random(&state) * WINDOW_HEIGHT;
+        double r = size * (0.4 + Random(&state) * 0.6);
+        int clear = 1;
+        for (int i = 0; i < NUM_LIGHTS && clear; i++)
+        {
+            double dx = scene->lights[i].circle.x - x, dy = scene->lights[i].circle.y - y;
+            clear = dx * dx + dy * dy > (r + 3 * LIGHT_RADIUS) * (r + 3 * LIGHT_RADIUS);
+        }
+        if (!clear)
+            continue;
+
+        float kind = Random(&state), angle = Random(&state) * 2 * (float)M_PI;
+        occluder->circle = (CIRCLE){x, y, r};
+        if (kind < 0.4f)
+        {
+            occluder->type = OCCLUDER_CIRCLE;
+            occluder->num_points = 0;
+        }
+        else if (kind < 0.7f)
+        {
+            occluder->type = OCCLUDER_SEGMENT;
+            occluder->num_points = 2;
+            occluder->points[0] = (SDL_FPoint){(float)(x - SDL_cos(angle) * r * 1.5), (float)(y - SDL_sin(angle) * r * 1.5)};
+            occluder->points[1] = (SDL_FPoint){(float)(x + SDL_cos(angle) * r * 1.5), (float)(y + SDL_sin(angle) * r * 1.5)};
+        }
+        else
+        {
+            occluder->type = OCCLUDER_POLYGON;
+            occluder->num_points = 3 + (int)(Random(&state) * 4);
+            for (int i = 0; i < occluder->num_points; i++)
+            {
+                double a = angle + 2 * M_PI * i / occluder->num_points, d = r * (0.7 + Random(&state) * 0.3);
+                occluder->points[i] = (SDL_FPoint){(float)(x + SDL_cos(a) * d), (float)(y + SDL_sin(a) * d)};
+            }
+        }
+
+        if (occluder->type == OCCLUDER_CIRCLE)
+            scene->primitives[scene->num_primitives++] = (PRIMITIVE){OCCLUDER_CIRCLE, (float)x, (float)y, (float)x, (float)y, (float)r};
+        for (int i = 0; i < occluder->num_points - (occluder->type == OCCLUDER_SEGMENT); i++)
+        {
+            SDL_FPoint a = occluder->points[i], b = occluder->points[(i + 1) % occluder->num_points];
+            scene->primitives[scene->num_primitives++] = (PRIMITIVE){OCCLUDER_SEGMENT, a.x, a.y, b.x, b.y, 0};
+        }
+        scene->num_occluders++;
+    }
+    BuildBvh(scene);
+    FindCrossings(scene);
+}
+
+void FreeScene(SCENE *scene)
+{
+    free(scene->occluders);
+    free(scene->primitives);
+    free(scene->nodes);
+    free(scene->crossings);
+    scene->occluders = NULL;
+    scene->primitives = NULL;
+    scene->nodes = NULL;
+    scene->crossings = NULL;
+    scene->num_occluders = scene->num_primitives = scene->num_nodes = scene->num_crossings = 0;
+}
+
+// Renders the scene to PPM files of any size, TILE_SIZE rows at a time so that memory
+// stays bounded however large they are: a band gathers all its passes on every core,
+// its rows are written out and its buffers go to the next band. The window's part of
+// the scene is fitted to the image and centred. With more than one frame, path holds
+// one %d or %0Nd for the frame number and the lights circle round where they are.
+int RenderFile(SCENE *scene, const char *path, int width, int height, int samples, int frames)
+{
+    double RenderPixels(SCENE *, SDL_Surface *, float *, int, float, float, float);
+    void DrawSceneRows(SDL_Surface *, const SCENE *, float, float, float);
+
+    if (width <= 0 || height <= 0)
+    {
+        printf("Invalid size %dx%d\n", width, height);
+        return 1;
+    }
+    // the frame number goes where the path has its placeholder, and nothing else in the
+    // path is taken as a format
+    int prefix = 0, digits = 0;
+    const char *suffix = "";
+    if (frames > 1)
+    {
+        const char *percent = strchr(path, '%');
+        const char *end = percent ? percent + 1 : NULL;
+        if (end && *end == '0')
+        {
+            while (*end >= '0' && *end <= '9')
+                digits = digits * 10 + *end++ - '0';
+        }
+        if (!end || *end != 'd' || digits > 32 || strchr(end, '%'))
+        {
+            printf("With more than one frame, the file name needs one %%d or %%0Nd for the frame number\n");
+            return 1;
+        }
+        prefix = (int)(percent - path);
+        suffix = end + 1;
+    }
+    SDL_Surface *band = SDL_CreateRGBSurfaceWithFormat(0, width, SDL_min(TILE_SIZE, height), 32, SDL_PIXELFORMAT_ARGB8888);
+    float *radiance = (float *)malloc((size_t)width * TILE_SIZE * 3 * sizeof(float));
+    Uint8 *row = (Uint8 *)malloc((size_t)width * 3);
+    if (!band || !radiance || !row)
+    {
+        printf("Out of memory\n");
+        if (band)
+            SDL_FreeSurface(band);
+        free(radiance);
+        free(row);
+        return 1;
+    }
+
+    float scale = SDL_max((float)WINDOW_WIDTH / width, (float)WINDOW_HEIGHT / height);
+    float origin_x = (WINDOW_WIDTH - width * scale) / 2, origin_y = (WINDOW_HEIGHT - height * scale) / 2;
+    CIRCLE places[NUM_LIGHTS];
+    for (int l = 0; l < NUM_LIGHTS; l++)
+        places[l] = scene->lights[l].circle;
+    int result = 0;
+    Uint64 start = SDL_GetPerformanceCounter();
+    for (int f = 0; f < frames && !result; f++)
+    {
+        Uint64 frame_start = SDL_GetPerformanceCounter();
+        char name[1024];
+        if (frames > 1)
+            snprintf(name, sizeof(name), "%.*s%0*d%s", prefix, path, digits, f, suffix);
+        else
+            snprintf(name, sizeof(name), "%s", path);
+        for (int l = 0; l < NUM_LIGHTS; l++)
+        {
+            double angle = 2 * M_PI * f / frames + l;
+            scene->lights[l].circle.x = places[l].x + SDL_cos(angle) * 2 * LIGHT_RADIUS;
+            scene->lights[l].circle.y = places[l].y + SDL_sin(angle) * 2 * LIGHT_RADIUS;
+        }
+        FILE *file = fopen(name, "wb");
+        if (!file)
+        {
+            printf("Could not write %s\n", name);
+            result = 1;
+            break;
+        }
+        fprintf(file, "P6\n%d %d\n255\n", width, height);
+
+        for (int top = 0; top < height && !result; top += TILE_SIZE)
+        {
+            int rows = SDL_min(TILE_SIZE, height - top);
+            if (rows != band->h)
+            {
+                SDL_FreeSurface(band);
+                band = SDL_CreateRGBSurfaceWithFormat(0, width, rows, 32, SDL_PIXELFORMAT_ARGB8888);
+                if (!band)
+                {
+                    printf("Out of memory\n");
+                    result = 1;
+                    break;
+                }
+            }
+            for (int pass = 0; pass < samples; pass++)
+                RenderPixels(scene, band, radiance, pass, origin_x, origin_y + top * scale, scale);
+            DrawSceneRows(band, scene, origin_x, origin_y + top * scale, scale);
+            for (int y = 0; y < rows && !result; y++)
+            {
+                const Uint32 *pixels = (const Uint32 *)((const Uint8 *)band->pixels + (size_t)y * band->pitch);
+                for (int x = 0; x < width; x++)
+                {
+                    row[x * 3] = (Uint8)(pixels[x] >> 16);
+                    row[x * 3 + 1] = (Uint8)(pixels[x] >> 8);
+                    row[x * 3 + 2] = (Uint8)pixels[x];
+                }
+                if (fwrite(row, 3, width, file) != (size_t)width)
+                {
+                    printf("Could not write %s\n", name);
+                    result = 1;
+                }
+            }
+        }
+        if (fclose(file) && !result)
+        {
+            printf("Could not write %s\n", name);
+            result = 1;
+        }
+        double seconds = (double)(SDL_GetPerformanceCounter() - frame_start) / SDL_GetPerformanceFrequency();
+        if (!result)
+            printf("%s: %dx%d, %d samples in %.2f s - %.1f Mpixels/s, %.1f M samples/s\n", name, width, height, samples, seconds,
+                   width * (double)height / seconds / 1e6, width * (double)height * samples * NUM_LIGHTS / seconds / 1e6);
+    }
+    double seconds = (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+    if (!result && frames > 1)
+        printf("%d frames in %.2f s - %.2f frames/s\n", frames, seconds, frames / seconds);
+
+    for (int l = 0; l < NUM_LIGHTS; l++)
+        scene->lights[l].circle = places[l];
+    if (band)
+        SDL_FreeSurface(band);
+    free(radiance);
+    free(row);
+    return result;
+}
+
+// Draws the occluders in black and the lights in their colours over a band of an
+// image, as DrawScene does over the window, by filling the spans of each row they cover.
+void DrawSceneRows(SDL_Surface *band, const SCENE *scene, float origin_x, float origin_y, float scale)
+{
+    void FillSceneSpan(SDL_Surface *, int, float, float, float, float, Uint32);
+
+    Uint32 black = SDL_MapRGB(band->format, RGBCOLOR_OCCLUDER);
+    for (int y = 0; y < band->h; y++)
+    {
+        float scene_y = origin_y + y * scale;
+        for (int i = 0; i < scene->num_occluders; i++)
+        {
+            const OCCLUDER *occluder = &scene->occluders[i];
+            if (SDL_fabs(occluder->circle.y - scene_y) > occluder->circle.r * 1.5 + SEGMENT_WIDTH)
+                continue;
+            if (occluder->type == OCCLUDER_CIRCLE)
+            {
+                double dy = occluder->circle.y - scene_y, r = occluder->circle.r;
+                if (dy * dy <= r * r)
+                    FillSceneSpan(band, y, (float)(occluder->circle.x - SDL_sqrt(r * r - dy * dy)),
+                                  (float)(occluder->circle.x + SDL_sqrt(r * r - dy * dy)), origin_x, scale, black);
+                continue;
+            }
+            // a segment is filled as the quad DrawScene draws for it
+            const SDL_FPoint *points = occluder->points;
+            int count = occluder->num_points;
+            SDL_FPoint quad[4];
+            if (occluder->type == OCCLUDER_SEGMENT)
+            {
+                SDL_FPoint a = occluder->points[0], b = occluder->points[1];
+                float dx = b.x - a.x, dy = b.y - a.y, length = SDL_sqrtf(dx * dx + dy * dy);
+                float nx = length > 0 ? -dy / length * SEGMENT_WIDTH / 2 : 0, ny = length > 0 ? dx / length * SEGMENT_WIDTH / 2 : 0;
+                quad[0] = (SDL_FPoint){a.x + nx, a.y + ny};
+                quad[1] = (SDL_FPoint){b.x + nx, b.y + ny};
+                quad[2] = (SDL_FPoint){b.x - nx, b.y - ny};
+                quad[3] = (SDL_FPoint){a.x - nx, a.y - ny};
+                points = quad;
+                count = 4;
+            }
+            float crossings[MAX_POLYGON_POINTS];
+            int num_crossings = 0;
+            for (int k = 0; k < count; k++)
+            {
+                SDL_FPoint a = points[k], b = points[(k + 1) % count];
+                if ((a.y <= scene_y) != (b.y <= scene_y))
+                {
+                    float x = a.x + (scene_y - a.y) / (b.y - a.y) * (b.x - a.x);
+                    int j = num_crossings++;
+                    while (j > 0 && crossings[j - 1] > x)
+                    {
+                        crossings[j] = crossings[j - 1];
+                        j--;
+                    }
+                    crossings[j] = x;
+                }
+            }
+            for (int k = 0; k + 1 < num_crossings; k += 2)
+                FillSceneSpan(band, y, crossings[k], crossings[k + 1], origin_x, scale, black);
+        }
+        for (int i = 0; i < NUM_LIGHTS; i++)
+        {
+            const LIGHT *light = &scene->lights[i];
+            double dy = light->circle.y - scene_y, r = light->circle.r;
+            if (dy * dy <= r * r)
+                FillSceneSpan(band, y, (float)(light->circle.x - SDL_sqrt(r * r - dy * dy)), (float)(light->circle.x + SDL_sqrt(r * r - dy * dy)),
+                              origin_x, scale,
+                              SDL_MapRGB(band->format, (Uint8)(light->color[0] * 255), (Uint8)(light->color[1] * 255), (Uint8)(light->color[2] * 255)));
+        }
+    }
+}
+
+// fills the pixels of row y that lie from x0 to x1 in the scene
+void FillSceneSpan(SDL_Surface *band, int y, float x0, float x1, float origin_x, float scale, Uint32 color)
+{
+    int first = SDL_max((int)SDL_ceil((x0 - origin_x) / scale), 0), last = SDL_min((int)SDL_floor((x1 - origin_x) / scale), band->w - 1);
+    if (first > last)
+        return;
+    SDL_Rect span = {first, y, last - first + 1, 1};
+    SDL_FillRect(band, &span, color);
+}
+
+int ComparePrimitivesX(const void *a, const void *b)
+{
+    float ca = ((const PRIMITIVE *)a)->x0 + ((const PRIMITIVE *)a)->x1, cb = ((const PRIMITIVE *)b)->x0 + ((const PRIMITIVE *)b)->x1;
+    return (ca > cb) - (ca < cb);
+}
+
+int ComparePrimitivesY(const void *a, const void *b)
+{
+    float ca = ((const PRIMITIVE *)a)->y0 + ((const PRIMITIVE *)a)->y1, cb = ((const PRIMITIVE *)b)->y0 + ((const PRIMITIVE *)b)->y1;
+    return (ca > cb) - (ca < cb);
+}
+
+void BuildBvh(SCENE *scene)
+{
+    void BuildBvhNode(SCENE *, int, int);
+
+    scene->num_nodes = 0;
+    if (scene->num_primitives)
+        BuildBvhNode(scene, 0, scene->num_primitives);
+}
+
+// Bounds the primitives first up to first + count, and unless they are few enough for
+// a leaf, splits them in half along the longer side of the box around their centres.
+void BuildBvhNode(SCENE *scene, int first, int count)
+{
+    int index = scene->num_nodes++;
+    BVH_NODE *node = &scene->nodes[index];
+    float centre_box[4] = {1e30f, 1e30f, -1e30f, -1e30f};
+    *node = (BVH_NODE){1e30f, 1e30f, -1e30f, -1e30f, first, count};
+    for (int i = first; i < first + count; i++)
+    {
+        const PRIMITIVE *p = &scene->primitives[i];
+        node->min_x = SDL_min(node->min_x, SDL_min(p->x0, p->x1) - p->r);
+        node->min_y = SDL_min(node->min_y, SDL_min(p->y0, p->y1) - p->r);
+        node->max_x = SDL_max(node->max_x, SDL_max(p->x0, p->x1) + p->r);
+        node->max_y = SDL_max(node->max_y, SDL_max(p->y0, p->y1) + p->r);
+        centre_box[0] = SDL_min(centre_box[0], p->x0 + p->x1);
+        centre_box[1] = SDL_min(centre_box[1], p->y0 + p->y1);
+        centre_box[2] = SDL_max(centre_box[2], p->x0 + p->x1);
+        centre_box[3] = SDL_max(centre_box[3], p->y0 + p->y1);
+    }
+    if (count <= BVH_LEAF_SIZE)
+        return;
+
+    int by_x = centre_box[2] - centre_box[0] >= centre_box[3] - centre_box[1];
+    qsort(scene->primitives + first, count, sizeof(PRIMITIVE), by_x ? ComparePrimitivesX : ComparePrimitivesY);
+    node->count = 0;
+    BuildBvhNode(scene, first, count / 2);
+    scene->nodes[index].first = scene->num_nodes;
+    BuildBvhNode(scene, first + count / 2, count - count / 2);
+}
+
+// Lights every pixel of the canvas for one more pass, with its top left pixel at the
+// scene's origin_x, origin_y and scale scene units between pixels. Returns the
+// milliseconds it took.
+double RenderPixels(SCENE *scene, SDL_Surface *canvas, float *radiance, int pass, float origin_x, float origin_y, float scale)
+{
+    int LightTiles(void *);
+    SDL_FPoint SampleLight(const CIRCLE *, int, int);
+
+    Uint64 start = SDL_GetPerformanceCounter();
+    FRAME frame = {scene, canvas, radiance, {{0, 0}}, pass, origin_x, origin_y, scale, {0}, (canvas->w + TILE_SIZE - 1) / TILE_SIZE, 0};
+    for (int l = 0; l < NUM_LIGHTS; l++)
+        frame.samples[l] = SampleLight(&scene->lights[l].circle, pass, l);
+    frame.num_tiles = frame.tiles_x * ((canvas->h + TILE_SIZE - 1) / TILE_SIZE);
+
+    SDL_Thread *threads[MAX_THREADS];
+    int num_threads = SDL_clamp(SDL_GetCPUCount(), 1, MAX_THREADS);
+    SDL_LockSurface(canvas);
+    for (int i = 1; i < num_threads; i++)
+        threads[i] = SDL_CreateThread(LightTiles, "lighting", &frame);
+    LightTiles(&frame);
+    for (int i = 1; i < num_threads; i++)
+    {
+        if (threads[i])
+            SDL_WaitThread(threads[i], NULL);
+    }
+    SDL_UnlockSurface(canvas);
+    return (double)(SDL_GetPerformanceCounter() - start) * 1000 / SDL_GetPerformanceFrequency();
+}
+
+// A point on a light's disc for one pass. The passes take the disc's rings of equal
+// area in bit-reversed order and go round it by the golden angle, jittered a little,
+// so that the samples so far are spread over the disc however few there are.
+SDL_FPoint SampleLight(const CIRCLE *circle, int pass, int index)
+{
+    float Random(unsigned *);
+
+    unsigned state = (unsigned)(pass * NUM_LIGHTS + index) * 2654435761u;
+    int ring = 0;
+    for (int bit = 1, k = pass; bit < LIGHT_SAMPLES; bit <<= 1, k >>= 1)
+        ring = ring << 1 | (k & 1);
+    double r = circle->r * SDL_sqrt((ring + Random(&state)) / LIGHT_SAMPLES);
+    double angle = (pass + index) * GOLDEN_ANGLE + (Random(&state) - 0.5) * 2 * M_PI / LIGHT_SAMPLES;
+    return (SDL_FPoint){(float)(circle->x + SDL_cos(angle) * r), (float)(circle->y + SDL_sin(angle) * r)};
+}
+
+int LightTiles(void *data)
+{
+    void LightTile(FRAME *, int);
+
+    FRAME *frame = (FRAME *)data;
+    for (int tile = SDL_AtomicAdd(&frame->next_tile, 1); tile < frame->num_tiles; tile = SDL_AtomicAdd(&frame->next_tile, 1))
+        LightTile(frame, tile);
+    return 0;
+}
+
+// Adds up the lights over one tile for a pass. The rays from the tile's pixels to a light all lie
+// within half the tile's diagonal of the ray from its centre, so only the primitives
+// that come that close to it are tested per pixel. They are taken from the hierarchy a
+// batch at a time, nearest first, until every pixel is blocked or none are left, which
+// keeps a dense scene from costing much more than a sparse one.
+void LightTile(FRAME *frame, int tile)
 {
-    SDL_Rect pixel_rect = {circle->x, circle->y, 1, 1};
-    for (int x = circle->x - circle->r; x < circle->x + circle->r; x++)
+    int NextCandidates(const SCENE *, BVH_WALK *, float, float, float, float, float, int *);
+    int Blocked(const PRIMITIVE *, float, float, float, float);
+    void ToneMapRow(const float *, const float *, const float *, Uint32 *, int, float);
+#ifdef __SSE2__
+    __m128 BlockedVector(const PRIMITIVE *, __m128, __m128, __m128, __m128, __m128, float, float);
+#endif
+
+    const SCENE *scene = frame->scene;
+    int width = frame->canvas->w, height = frame->canvas->h;
+    int x0 = tile % frame->tiles_x * TILE_SIZE, y0 = tile / frame->tiles_x * TILE_SIZE;
+    int x1 = SDL_min(x0 + TILE_SIZE, width), y1 = SDL_min(y0 + TILE_SIZE, height);
+    float *planes[3] = {frame->radiance, frame->radiance + (size_t)width * height, frame->radiance + (size_t)width * height * 2};
+    for (int y = y0; y < y1; y++)
     {
-        for (int y = circle->y - circle->r; y < circle->y + circle->r; y++)
+        for (int c = 0; c < 3; c++)
         {
-            pixel_rect.x = x;
-            pixel_rect.y = y;
-            double d = SDL_sqrt(SDL_pow(x - circle->x, 2) + SDL_pow(y - circle->y, 2));
-            if (d <= circle->r)
-                SDL_FillRect(surface, &pixel_rect, color);
+            for (int x = x0; x < x1; x++)
+                planes[c][(size_t)y * width + x] = (frame->pass ? planes[c][(size_t)y * width + x] : 0) + (float)AMBIENT;
         }
     }
+
+    float ox = frame->origin_x, oy = frame->origin_y, scale = frame->scale;
+    float centre_x = ox + (x0 + x1 - 1) * 0.5f * scale, centre_y = oy + (y0 + y1 - 1) * 0.5f * scale;
+    float reach = SDL_sqrtf((float)((x1 - x0) * (x1 - x0) + (y1 - y0) * (y1 - y0))) * 0.5f * scale;
+#ifdef __SSE2__
+    const __m128 lanes = _mm_mul_ps(_mm_setr_ps(0, 1, 2, 3), _mm_set1_ps(scale));
+#endif
+    float falloff = (float)(1 / (LIGHT_FALLOFF * LIGHT_FALLOFF));
+    // -1 for the pixels of the tile the light still reaches, 0 for those in shadow
+    Sint32 visible[TILE_SIZE * TILE_SIZE];
+    int candidates[CANDIDATE_BATCH];
+    for (int l = 0; l < NUM_LIGHTS; l++)
+    {
+        const LIGHT *light = &scene->lights[l];
+        float lx = frame->samples[l].x, ly = frame->samples[l].y;
+        float color[3] = {light->color[0] * light->intensity, light->color[1] * light->intensity,
+                          light->color[2] * light->intensity};
+        for (int y = y0; y < y1; y++)
+            memset(visible + (y - y0) * TILE_SIZE, 0xFF, (x1 - x0) * sizeof(Sint32));
+
+        BVH_WALK walk = {{0}, scene->num_nodes ? 1 : 0};
+        int remaining = 1, num_candidates;
+        while (remaining && (num_candidates = NextCandidates(scene, &walk, centre_x, centre_y, reach, lx, ly, candidates)))
+        {
+            remaining = 0;
+            for (int y = y0; y < y1; y++)
+            {
+                Sint32 *row = visible + (y - y0) * TILE_SIZE - x0;
+                int x = x0;
+#ifdef __SSE2__
+                // four pixels at a time, each primitive masking off the ones it blocks
+                const __m128 py = _mm_set1_ps(oy + y * scale), dy = _mm_sub_ps(_mm_set1_ps(ly), py);
+                for (; x + 4 <= x1; x += 4)
+                {
+                    __m128 mask = _mm_loadu_ps((const float *)(row + x));
+                    if (!_mm_movemask_ps(mask))
+                        continue;
+                    __m128 px = _mm_add_ps(_mm_set1_ps(ox + x * scale), lanes);
+                    __m128 dx = _mm_sub_ps(_mm_set1_ps(lx), px);
+                    __m128 dd = _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy));
+                    for (int i = 0; i < num_candidates && _mm_movemask_ps(mask); i++)
+                        mask = _mm_andnot_ps(BlockedVector(&scene->primitives[candidates[i]], px, py, dx, dy, dd, lx, ly), mask);
+                    _mm_storeu_ps((float *)(row + x), mask);
+                    remaining |= _mm_movemask_ps(mask);
+                }
+#endif
+                for (; x < x1; x++)
+                {
+                    for (int i = 0; i < num_candidates && row[x]; i++)
+                        row[x] = Blocked(&scene->primitives[candidates[i]], ox + x * scale, oy + y * scale, lx, ly) ? 0 : -1;
+                    remaining |= row[x];
+                }
+            }
+        }
+
+        for (int y = y0; y < y1; y++)
+        {
+            const Sint32 *mask = visible + (y - y0) * TILE_SIZE - x0;
+            float *row[3] = {planes[0] + (size_t)y * width, planes[1] + (size_t)y * width, planes[2] + (size_t)y * width};
+            int x = x0;
+#ifdef __SSE2__
+            const __m128 one = _mm_set1_ps(1), dy = _mm_set1_ps(ly - (oy + y * scale));
+            for (; x + 4 <= x1; x += 4)
+            {
+                __m128 dx = _mm_sub_ps(_mm_set1_ps(lx), _mm_add_ps(_mm_set1_ps(ox + x * scale), lanes));
+                __m128 dd = _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy));
+                __m128 attenuation = _mm_div_ps(one, _mm_add_ps(one, _mm_mul_ps(dd, _mm_set1_ps(falloff))));
+                attenuation = _mm_and_ps(_mm_loadu_ps((const float *)(mask + x)), attenuation);
+                for (int c = 0; c < 3; c++)
+                    _mm_storeu_ps(row[c] + x, _mm_add_ps(_mm_loadu_ps(row[c] + x), _mm_mul_ps(attenuation, _mm_set1_ps(color[c]))));
+            }
+#endif
+            for (; x < x1; x++)
+            {
+                if (!mask[x])
+                    continue;
+                float dx = lx - (ox + x * scale), dy = ly - (oy + y * scale);
+                float attenuation = 1 / (1 + (dx * dx + dy * dy) * falloff);
+                for (int c = 0; c < 3; c++)
+                    row[c][x] += attenuation * color[c];
+            }
+        }
+    }
+
+    for (int y = y0; y < y1; y++)
+    {
+        size_t offset = (size_t)y * width + x0;
+        ToneMapRow(planes[0] + offset, planes[1] + offset, planes[2] + offset,
+                   (Uint32 *)((Uint8 *)frame->canvas->pixels + (size_t)y * frame->canvas->pitch) + x0, x1 - x0,
+                   1.0f / (frame->pass + 1));
+    }
+}
+
+#ifdef __SSE2__
+// Which of four pixels a primitive blocks the light from, with d from the pixels to
+// the light. The point of a ray closest to a circle's centre, f away, is at f.d / d.d
+// clamped to [0, 1]. A segment blocks when the pixel and the light are on either side
+// of it and its ends on either side of the ray.
+__m128 BlockedVector(const PRIMITIVE *p, __m128 px, __m128 py, __m128 dx, __m128 dy, __m128 dd, float lx, float ly)
+{
+    const __m128 zero = _mm_setzero_ps();
+    if (p->type == OCCLUDER_CIRCLE)
+    {
+        __m128 fx = _mm_sub_ps(_mm_set1_ps(p->x0), px), fy = _mm_sub_ps(_mm_set1_ps(p->y0), py);
+        __m128 fd = _mm_add_ps(_mm_mul_ps(fx, dx), _mm_mul_ps(fy, dy));
+        // at the light's centre dd is 0 and t is not a number, which max turns into 0
+        __m128 t = _mm_min_ps(_mm_max_ps(_mm_div_ps(fd, dd), zero), _mm_set1_ps(1));
+        __m128 ex = _mm_sub_ps(fx, _mm_mul_ps(t, dx)), ey = _mm_sub_ps(fy, _mm_mul_ps(t, dy));
+        return _mm_cmplt_ps(_mm_add_ps(_mm_mul_ps(ex, ex), _mm_mul_ps(ey, ey)), _mm_set1_ps(p->r * p->r));
+    }
+    float sx = p->x1 - p->x0, sy = p->y1 - p->y0, light_side = sx * (ly - p->y0) - sy * (lx - p->x0);
+    __m128 ax = _mm_sub_ps(_mm_set1_ps(p->x0), px), ay = _mm_sub_ps(_mm_set1_ps(p->y0), py);
+    __m128 bx = _mm_sub_ps(_mm_set1_ps(p->x1), px), by = _mm_sub_ps(_mm_set1_ps(p->y1), py);
+    __m128 side_a = _mm_sub_ps(_mm_mul_ps(dx, ay), _mm_mul_ps(dy, ax));
+    __m128 side_b = _mm_sub_ps(_mm_mul_ps(dx, by), _mm_mul_ps(dy, bx));
+    __m128 pixel_side = _mm_sub_ps(_mm_mul_ps(_mm_set1_ps(sy), ax), _mm_mul_ps(_mm_set1_ps(sx), ay));
+    return _mm_and_ps(_mm_cmplt_ps(_mm_mul_ps(side_a, side_b), zero),
+                      _mm_cmplt_ps(_mm_mul_ps(pixel_side, _mm_set1_ps(light_side)), zero));
 }
+#endif
 
-void CastRays(SDL_Surface *surface, CIRCLE *circle_bright, CIRCLE *circle_opaque)
+// whether a primitive blocks the ray from a pixel to a light, as the vector loop works it out
+int Blocked(const PRIMITIVE *p, float x, float y, float lx, float ly)
 {
-    double clamp(double, double, double);
-    int PixelInsideCircle(SDL_Rect, CIRCLE);
+    float dx = lx - x, dy = ly - y;
+    if (p->type == OCCLUDER_CIRCLE)
+    {
+        float fx = p->x0 - x, fy = p->y0 - y, dd = dx * dx + dy * dy;
+        float t = dd > 0 ? SDL_clamp((fx * dx + fy * dy) / dd, 0, 1) : 0;
+        float ex = fx - t * dx, ey = fy - t * dy;
+        return ex * ex + ey * ey < p->r * p->r;
+    }
+    float sx = p->x1 - p->x0, sy = p->y1 - p->y0;
+    float side_a = dx * (p->y0 - y) - dy * (p->x0 - x), side_b = dx * (p->y1 - y) - dy * (p->x1 - x);
+    float pixel_side = sy * (p->x0 - x) - sx * (p->y0 - y), light_side = sx * (ly - p->y0) - sy * (lx - p->x0);
+    return side_a * side_b < 0 && pixel_side * light_side < 0;
+}
 
-    SDL_Rect pixel_rect = {0, 0, 1, 1};
-    for (int i = 0; i < RAYS_SIZE; i++)
+// Reinhard's c / (1 + c) on each channel scaled by exposure, then a gamma of 2, into ARGB8888 pixels
+void ToneMapRow(const float *red, const float *green, const float *blue, Uint32 *pixels, int count, float exposure)
+{
+    int i = 0;
+#ifdef __SSE2__
+    const __m128 one = _mm_set1_ps(1), scale = _mm_set1_ps(255), e = _mm_set1_ps(exposure);
+    const __m128i alpha = _mm_set1_epi32((int)0xFF000000);
+    for (; i + 4 <= count; i += 4)
     {
-        double θ = (double)i / RAYS_SIZE * 2 * PI;
-        double cos_θ = SDL_cos(θ), sin_θ = SDL_sin(θ);
-        for (double r = 0; r < WINDOW_WIDTH; r += THRESHOLD)
+        __m128 r = _mm_mul_ps(_mm_loadu_ps(red + i), e), g = _mm_mul_ps(_mm_loadu_ps(green + i), e);
+        __m128 b = _mm_mul_ps(_mm_loadu_ps(blue + i), e);
+        r = _mm_mul_ps(_mm_sqrt_ps(_mm_div_ps(r, _mm_add_ps(one, r))), scale);
+        g = _mm_mul_ps(_mm_sqrt_ps(_mm_div_ps(g, _mm_add_ps(one, g))), scale);
+        b = _mm_mul_ps(_mm_sqrt_ps(_mm_div_ps(b, _mm_add_ps(one, b))), scale);
+        __m128i pixel = _mm_or_si128(alpha, _mm_slli_epi32(_mm_cvtps_epi32(r), 16));
+        pixel = _mm_or_si128(pixel, _mm_or_si128(_mm_slli_epi32(_mm_cvtps_epi32(g), 8), _mm_cvtps_epi32(b)));
+        _mm_storeu_si128((__m128i *)(pixels + i), pixel);
+    }
+#endif
+    for (; i < count; i++)
+    {
+        float cr = red[i] * exposure, cg = green[i] * exposure, cb = blue[i] * exposure;
+        Uint32 r = (Uint32)(SDL_sqrtf(cr / (1 + cr)) * 255 + 0.5f);
+        Uint32 g = (Uint32)(SDL_sqrtf(cg / (1 + cg)) * 255 + 0.5f);
+        Uint32 b = (Uint32)(SDL_sqrtf(cb / (1 + cb)) * 255 + 0.5f);
+        pixels[i] = 0xFF000000 | r << 16 | g << 8 | b;
+    }
+}
+
+float PointSegmentDistance2(float px, float py, float x0, float y0, float x1, float y1)
+{
+    float sx = x1 - x0, sy = y1 - y0, ss = sx * sx + sy * sy;
+    float t = ss > 0 ? SDL_clamp(((px - x0) * sx + (py - y0) * sy) / ss, 0, 1) : 0;
+    float ex = x0 + t * sx - px, ey = y0 + t * sy - py;
+    return ex * ex + ey * ey;
+}
+
+// squared distance between two segments, 0 where they cross
+float SegmentDistance2(float ax0, float ay0, float ax1, float ay1, float bx0, float by0, float bx1, float by1)
+{
+    float PointSegmentDistance2(float, float, float, float, float, float);
+
+    float side_0 = (ax1 - ax0) * (by0 - ay0) - (ay1 - ay0) * (bx0 - ax0);
+    float side_1 = (ax1 - ax0) * (by1 - ay0) - (ay1 - ay0) * (bx1 - ax0);
+    float side_2 = (bx1 - bx0) * (ay0 - by0) - (by1 - by0) * (ax0 - bx0);
+    float side_3 = (bx1 - bx0) * (ay1 - by0) - (by1 - by0) * (ax1 - bx0);
+    if (side_0 * side_1 < 0 && side_2 * side_3 < 0)
+        return 0;
+    return SDL_min(SDL_min(PointSegmentDistance2(ax0, ay0, bx0, by0, bx1, by1), PointSegmentDistance2(ax1, ay1, bx0, by0, bx1, by1)),
+                   SDL_min(PointSegmentDistance2(bx0, by0, ax0, ay0, ax1, ay1), PointSegmentDistance2(bx1, by1, ax0, ay0, ax1, ay1)));
+}
+
+// whether the segment from (x0, y0) to (x1, y1) passes through a box
+int SegmentHitsBox(float x0, float y0, float x1, float y1, float min_x, float min_y, float max_x, float max_y)
+{
+    float t0 = 0, t1 = 1;
+    float starts[2] = {x0, y0}, deltas[2] = {x1 - x0, y1 - y0}, mins[2] = {min_x, min_y}, maxs[2] = {max_x, max_y};
+    for (int axis = 0; axis < 2; axis++)
+    {
+        if (deltas[axis] == 0)
         {
-            int x = r * cos_θ + circle_bright->x;
-            int y = r * sin_θ + circle_bright->y;
+            if (starts[axis] < mins[axis] || starts[axis] > maxs[axis])
+                return 0;
+            continue;
+        }
+        float a = (mins[axis] - starts[axis]) / deltas[axis], b = (maxs[axis] - starts[axis]) / deltas[axis];
+        t0 = SDL_max(t0, SDL_min(a, b));
+        t1 = SDL_min(t1, SDL_max(a, b));
+        if (t0 > t1)
+            return 0;
+    }
+    return 1;
+}
 
-            if ((x < 0 && y < 0) || (x >= WINDOW_WIDTH && y >= WINDOW_HEIGHT))
-                break;
+// Carries on a walk of the hierarchy for the primitives that come within reach of the
+// segment from (x, y) to the light, nearer child first so that they come roughly
+// nearest first. Returns how many were found, up to CANDIDATE_BATCH, and 0 once the
+// walk is over.
+int NextCandidates(const SCENE *scene, BVH_WALK *walk, float x, float y, float reach, float lx, float ly, int *candidates)
+{
+    float SegmentDistance2(float, float, float, float, float, float, float, float);
+    float PointSegmentDistance2(float, float, float, float, float, float);
+    int SegmentHitsBox(float, float, float, float, float, float, float, float);
+    float BoxDistance2(const BVH_NODE *, float, float);
+
+    int count = 0;
+    while (walk->top && count + BVH_LEAF_SIZE <= CANDIDATE_BATCH)
+    {
+        int index = walk->stack[--walk->top];
+        const BVH_NODE *node = &scene->nodes[index];
+        if (!SegmentHitsBox(x, y, lx, ly, node->min_x - reach, node->min_y - reach, node->max_x + reach, node->max_y + reach))
+            continue;
+        if (node->count)
+        {
+            for (int i = node->first; i < node->first + node->count; i++)
+            {
+                const PRIMITIVE *p = &scene->primitives[i];
+                float d2 = p->type == OCCLUDER_CIRCLE ? PointSegmentDistance2(p->x0, p->y0, x, y, lx, ly)
+                                                      : SegmentDistance2(p->x0, p->y0, p->x1, p->y1, x, y, lx, ly);
+                if (d2 <= (reach + p->r) * (reach + p->r))
+                    candidates[count++] = i;
+            }
+            continue;
+        }
+        int near = index + 1, far = node->first;
+        if (BoxDistance2(&scene->nodes[far], x, y) < BoxDistance2(&scene->nodes[near], x, y))
+        {
+            near = node->first;
+            far = index + 1;
+        }
+        walk->stack[walk->top++] = far;
+        walk->stack[walk->top++] = near;
+    }
+    return count;
+}
 
-            x = clamp(x, 0, WINDOW_WIDTH - 1);
-            y = clamp(y, 0, WINDOW_HEIGHT - 1);
+// squared distance from a point to a node's box, 0 inside it
+float BoxDistance2(const BVH_NODE *node, float x, float y)
+{
+    float dx = SDL_max(SDL_max(node->min_x - x, x - node->max_x), 0);
+    float dy = SDL_max(SDL_max(node->min_y - y, y - node->max_y), 0);
+    return dx * dx + dy * dy;
+}
 
-            pixel_rect.x = x;
-            pixel_rect.y = y;
+// Finds where the outlines of the primitives cross each other, looking each one's box
+// up in the hierarchy. Where occluders overlap, the outline of the shadow they cast
+// together turns at these points, so the visibility polygons need rays cast at them.
+void FindCrossings(SCENE *scene)
+{
+    int Intersect(const PRIMITIVE *, const PRIMITIVE *, SDL_FPoint *);
 
-            if (PixelInsideCircle(pixel_rect, *circle_bright))
+    int capacity = 0;
+    for (int i = 0; i < scene->num_primitives; i++)
+    {
+        const PRIMITIVE *a = &scene->primitives[i];
+        float min_x = SDL_min(a->x0, a->x1) - a->r, min_y = SDL_min(a->y0, a->y1) - a->r;
+        float max_x = SDL_max(a->x0, a->x1) + a->r, max_y = SDL_max(a->y0, a->y1) + a->r;
+        int stack[BVH_STACK], top = scene->num_nodes ? 1 : 0;
+        stack[0] = 0;
+        while (top)
+        {
+            const BVH_NODE *node = &scene->nodes[stack[--top]];
+            if (node->min_x > max_x || node->max_x < min_x || node->min_y > max_y || node->max_y < min_y)
+                continue;
+            if (!node->count)
+            {
+                stack[top++] = node->first;
+                stack[top++] = (int)(node - scene->nodes) + 1;
                 continue;
-            if (PixelInsideCircle(pixel_rect, *circle_opaque))
-                break;
-            SDL_FillRect(surface, &pixel_rect, SDL_MapRGB(surface->format, RGBCOLOR_BG_LIT));
+            }
+            for (int j = SDL_max(node->first, i + 1); j < node->first + node->count; j++)
+            {
+                SDL_FPoint points[2];
+                int count = Intersect(a, &scene->primitives[j], points);
+                if (scene->num_crossings + count > capacity)
+                {
+                    capacity = SDL_max(capacity * 2, 256);
+                    SDL_FPoint *crossings = (SDL_FPoint *)realloc(scene->crossings, capacity * sizeof(SDL_FPoint));
+                    if (!crossings)
+                        return;
+                    scene->crossings = crossings;
+                }
+                for (int k = 0; k < count; k++)
+                    scene->crossings[scene->num_crossings++] = points[k];
+            }
+        }
+    }
+}
+
+// where the outlines of two primitives cross, up to two points; returns how many
+int Intersect(const PRIMITIVE *a, const PRIMITIVE *b, SDL_FPoint *points)
+{
+    if (a->type == OCCLUDER_CIRCLE && b->type == OCCLUDER_CIRCLE)
+    {
+        float dx = b->x0 - a->x0, dy = b->y0 - a->y0, d = SDL_sqrtf(dx * dx + dy * dy);
+        if (d == 0 || d > a->r + b->r || d < SDL_fabsf(a->r - b->r))
+            return 0;
+        float along = (a->r * a->r - b->r * b->r + d * d) / (2 * d);
+        float across = SDL_sqrtf(SDL_max(a->r * a->r - along * along, 0));
+        float mx = a->x0 + dx * along / d, my = a->y0 + dy * along / d;
+        points[0] = (SDL_FPoint){mx - dy * across / d, my + dx * across / d};
+        points[1] = (SDL_FPoint){mx + dy * across / d, my - dx * across / d};
+        return 2;
+    }
+    if (a->type == OCCLUDER_CIRCLE)
+    {
+        const PRIMITIVE *swap = a;
+        a = b;
+        b = swap;
+    }
+    float sx = a->x1 - a->x0, sy = a->y1 - a->y0;
+    if (b->type == OCCLUDER_CIRCLE)
+    {
+        // |a0 + t s - c|^2 = r^2 for t in [0, 1]
+        float fx = a->x0 - b->x0, fy = a->y0 - b->y0;
+        float qa = sx * sx + sy * sy, qb = fx * sx + fy * sy, qc = fx * fx + fy * fy - b->r * b->r;
+        float discriminant = qb * qb - qa * qc;
+        if (qa == 0 || discriminant < 0)
+            return 0;
+        int count = 0;
+        for (int sign = -1; sign <= 1; sign += 2)
+        {
+            float t = (-qb + sign * SDL_sqrtf(discriminant)) / qa;
+            if (t >= 0 && t <= 1)
+                points[count++] = (SDL_FPoint){a->x0 + t * sx, a->y0 + t * sy};
         }
+        return count;
     }
+    float tx = b->x1 - b->x0, ty = b->y1 - b->y0, denominator = sx * ty - sy * tx;
+    if (denominator == 0)
+        return 0;
+    float wx = b->x0 - a->x0, wy = b->y0 - a->y0;
+    float t = (wx * ty - wy * tx) / denominator, u = (wx * sy - wy * sx) / denominator;
+    if (t < 0 || t > 1 || u < 0 || u > 1)
+        return 0;
+    points[0] = (SDL_FPoint){a->x0 + t * sx, a->y0 + t * sy};
+    return 1;
 }
 
-double clamp(double value, double min, double max)
+int CompareFloats(const void *a, const void *b)
 {
-    if (value < min)
-        return min;
-    if (value > max)
-        return max;
-    return value;
+    float fa = *(const float *)a, fb = *(const float *)b;
+    return (fa > fb) - (fa < fb);
 }
 
-int PixelInsideCircle(SDL_Rect pixel, CIRCLE circle)
+// Works out the polygon a light reaches. A ray is cast just either side of the angle to
+// every point the outline of the shadows can turn at: the ends of the segments, the
+// crossings, the corners of the window and the tangents of the circles, with a few
+// angles in between for the side of a circle that faces the light. In angle order the
+// points they hit make the polygon.
+void ComputeVisibility(const SCENE *scene, VISIBILITY *visibility, float lx, float ly)
 {
-    double d = SDL_sqrt(SDL_pow(pixel.x - circle.x, 2) + SDL_pow(pixel.y - circle.y, 2));
-    return d <= circle.r;
-}
\ No newline at end of file
+    float CastRay(const SCENE *, float, float, float, float);
+
+    int capacity = 4 + scene->num_crossings + scene->num_primitives * (CIRCLE_SEGMENTS + 1);
+    float *angles = (float *)malloc(capacity * sizeof(float));
+    visibility->num_points = 0;
+    if (!angles)
+        return;
+    int num_angles = 0;
+    float corners[4][2] = {{0, 0}, {WINDOW_WIDTH, 0}, {WINDOW_WIDTH, WINDOW_HEIGHT}, {0, WINDOW_HEIGHT}};
+    for (int i = 0; i < 4; i++)
+        angles[num_angles++] = (float)SDL_atan2(corners[i][1] - ly, corners[i][0] - lx);
+    for (int i = 0; i < scene->num_crossings; i++)
+        angles[num_angles++] = (float)SDL_atan2(scene->crossings[i].y - ly, scene->crossings[i].x - lx);
+    for (int i = 0; i < scene->num_primitives; i++)
+    {
+        const PRIMITIVE *p = &scene->primitives[i];
+        if (p->type != OCCLUDER_CIRCLE)
+        {
+            angles[num_angles++] = (float)SDL_atan2(p->y0 - ly, p->x0 - lx);
+            angles[num_angles++] = (float)SDL_atan2(p->y1 - ly, p->x1 - lx);
+            continue;
+        }
+        float dx = p->x0 - lx, dy = p->y0 - ly, d = SDL_sqrtf(dx * dx + dy * dy);
+        if (d <= p->r)
+            continue;
+        float base = (float)SDL_atan2(dy, dx), half = (float)SDL_asin(p->r / d);
+        int steps = SDL_clamp((int)(p->r / 2), 1, CIRCLE_SEGMENTS / 2);
+        for (int k = -steps; k <= steps; k++)
+        {
+            float angle = base + half * k / steps;
+            angles[num_angles++] = angle > (float)M_PI ? angle - 2 * (float)M_PI : angle < -(float)M_PI ? angle + 2 * (float)M_PI : angle;
+        }
+    }
+    qsort(angles, num_angles, sizeof(float), CompareFloats);
+
+    int needed = num_angles * 2;
+    if (needed > visibility->capacity)
+    {
+        SDL_FPoint *points = (SDL_FPoint *)realloc(visibility->points, needed * sizeof(SDL_FPoint));
+        if (!points)
+        {
+            free(angles);
+            return;
+        }
+        visibility->points = points;
+        visibility->capacity = needed;
+    }
+    for (int i = 0; i < num_angles; i++)
+    {
+        if (i && angles[i] == angles[i - 1])
+            continue;
+        for (int side = -1; side <= 1; side += 2)
+        {
+            float angle = angles[i] + side * SWEEP_EPSILON, dx = SDL_cosf(angle), dy = SDL_sinf(angle);
+            float t = CastRay(scene, lx, ly, dx, dy);
+            visibility->points[visibility->num_points++] = (SDL_FPoint){lx + t * dx, ly + t * dy};
+        }
+    }
+    free(angles);
+}
+
+// How far a ray from (x, y) along the unit vector (dx, dy) gets before it hits a
+// primitive or leaves the window. Once something is hit, the rest of the walk only
+// looks at the boxes the ray passes through before it.
+float CastRay(const SCENE *scene, float x, float y, float dx, float dy)
+{
+    int SegmentHitsBox(float, float, float, float, float, float, float, float);
+    float BoxDistance2(const BVH_NODE *, float, float);
+
+    float best = 1e30f;
+    if (dx > 0)
+        best = SDL_min(best, (WINDOW_WIDTH - x) / dx);
+    else if (dx < 0)
+        best = SDL_min(best, -x / dx);
+    if (dy > 0)
+        best = SDL_min(best, (WINDOW_HEIGHT - y) / dy);
+    else if (dy < 0)
+        best = SDL_min(best, -y / dy);
+
+    int stack[BVH_STACK], top = scene->num_nodes ? 1 : 0;
+    stack[0] = 0;
+    while (top)
+    {
+        int index = stack[--top];
+        const BVH_NODE *node = &scene->nodes[index];
+        if (!SegmentHitsBox(x, y, x + best * dx, y + best * dy, node->min_x, node->min_y, node->max_x, node->max_y))
+            continue;
+        if (!node->count)
+        {
+            int near = index + 1, far = node->first;
+            if (BoxDistance2(&scene->nodes[far], x, y) < BoxDistance2(&scene->nodes[near], x, y))
+            {
+                near = node->first;
+                far = index + 1;
+            }
+            stack[top++] = far;
+            stack[top++] = near;
+            continue;
+        }
+        for (int i = node->first; i < node->first + node->count; i++)
+        {
+            const PRIMITIVE *p = &scene->primitives[i];
+            if (p->type == OCCLUDER_CIRCLE)
+            {
+                float fx = x - p->x0, fy = y - p->y0;
+                float b = fx * dx + fy * dy, c = fx * fx + fy * fy - p->r * p->r, discriminant = b * b - c;
+                if (c <= 0)
+                    best = 0;
+                else if (discriminant >= 0 && -b - SDL_sqrtf(discriminant) >= 0)
+                    best = SDL_min(best, -b - SDL_sqrtf(discriminant));
+                continue;
+            }
+            float sx = p->x1 - p->x0, sy = p->y1 - p->y0, denominator = dx * sy - dy * sx;
+            if (denominator == 0)
+                continue;
+            float wx = p->x0 - x, wy = p->y0 - y;
+            float t = (wx * sy - wy * sx) / denominator, u = (wx * dy - wy * dx) / denominator;
+            if (t >= 0 && u >= 0 && u <= 1)
+                best = SDL_min(best, t);
+        }
+    }
+    return best;
+}
+
+// makes room for count more vertices and indices; returns 0 when out of memory
+int ReserveGeometry(GEOMETRY *geometry, int vertices, int indices)
+{
+    if (geometry->num_vertices + vertices > geometry->vertex_capacity)
+    {
+        int capacity = SDL_max(geometry->vertex_capacity * 2, geometry->num_vertices + vertices);
+        SDL_Vertex *grown = (SDL_Vertex *)realloc(geometry->vertices, capacity * sizeof(SDL_Vertex));
+        if (!grown)
+            return 0;
+        geometry->vertices = grown;
+        geometry->vertex_capacity = capacity;
+    }
+    if (geometry->num_indices + indices > geometry->index_capacity)
+    {
+        int capacity = SDL_max(geometry->index_capacity * 2, geometry->num_indices + indices);
+        int *grown = (int *)realloc(geometry->indices, capacity * sizeof(int));
+        if (!grown)
+            return 0;
+        geometry->indices = grown;
+        geometry->index_capacity = capacity;
+    }
+    return 1;
+}
+
+// A fan of triangles from the centre to each pair of neighbouring points, closed back
+// to the first. Texture coordinates go out from 0.5 at the centre by scale per pixel.
+void AddFan(GEOMETRY *geometry, SDL_FPoint centre, const SDL_FPoint *points, int count, SDL_Color color, float scale)
+{
+    int ReserveGeometry(GEOMETRY *, int, int);
+
+    if (count < 2 || !ReserveGeometry(geometry, count + 1, count * 3))
+        return;
+    int first = geometry->num_vertices;
+    geometry->vertices[geometry->num_vertices++] = (SDL_Vertex){centre, color, {0.5f, 0.5f}};
+    for (int i = 0; i < count; i++)
+    {
+        SDL_FPoint uv = {0.5f + (points[i].x - centre.x) * scale, 0.5f + (points[i].y - centre.y) * scale};
+        geometry->vertices[geometry->num_vertices++] = (SDL_Vertex){points[i], color, uv};
+        geometry->indices[geometry->num_indices++] = first;
+        geometry->indices[geometry->num_indices++] = first + 1 + i;
+        geometry->indices[geometry->num_indices++] = first + 1 + (i + 1) % count;
+    }
+}
+
+// The falloff of a light from its centre out to the window's diagonal, as it comes out
+// once tone mapped over the ambient light. Adding the lights up after tone mapping is
+// not the same as tone mapping their sum, but it is close while they overlap little.
+SDL_Texture *CreateFalloffTexture(SDL_Renderer *renderer)
+{
+    SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "linear");
+    SDL_Texture *texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STATIC, FALLOFF_TEXTURE_SIZE, FALLOFF_TEXTURE_SIZE);
+    Uint32 *pixels = (Uint32 *)malloc(FALLOFF_TEXTURE_SIZE * FALLOFF_TEXTURE_SIZE * sizeof(Uint32));
+    if (!texture || !pixels)
+    {
+        free(pixels);
+        return texture;
+    }
+    double diagonal = SDL_sqrt((double)WINDOW_WIDTH * WINDOW_WIDTH + (double)WINDOW_HEIGHT * WINDOW_HEIGHT);
+    double ambient = SDL_sqrt(AMBIENT / (1 + AMBIENT));
+    for (int y = 0; y < FALLOFF_TEXTURE_SIZE; y++)
+    {
+        for (int x = 0; x < FALLOFF_TEXTURE_SIZE; x++)
+        {
+            double dx = (x + 0.5) / FALLOFF_TEXTURE_SIZE - 0.5, dy = (y + 0.5) / FALLOFF_TEXTURE_SIZE - 0.5;
+            double d = SDL_sqrt(dx * dx + dy * dy) * 2 * diagonal / LIGHT_FALLOFF;
+            double c = AMBIENT + FALLOFF_INTENSITY / (1 + d * d);
+            Uint32 value = (Uint32)((SDL_sqrt(c / (1 + c)) - ambient) * 255 + 0.5);
+            pixels[y * FALLOFF_TEXTURE_SIZE + x] = 0xFF000000 | value << 16 | value << 8 | value;
+        }
+    }
+    SDL_UpdateTexture(texture, NULL, pixels, FALLOFF_TEXTURE_SIZE * sizeof(Uint32));
+    SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_ADD);
+    free(pixels);
+    return texture;
+}
+
+// Fills each light's visibility polygon with its falloff, added over the ambient light,
+// working a polygon out again only when its light or the occluders have moved. Returns
+// the milliseconds that took.
+double RenderPolygons(SDL_Renderer *renderer, const SCENE *scene, VISIBILITY *visibility, SDL_Texture *falloff, GEOMETRY *geometry)
+{
+    void ComputeVisibility(const SCENE *, VISIBILITY *, float, float);
+    void AddFan(GEOMETRY *, SDL_FPoint, const SDL_FPoint *, int, SDL_Color, float);
+
+    Uint64 start = SDL_GetPerformanceCounter();
+    float scale = (float)(0.5 / SDL_sqrt((double)WINDOW_WIDTH * WINDOW_WIDTH + (double)WINDOW_HEIGHT * WINDOW_HEIGHT));
+    Uint8 ambient = (Uint8)(SDL_sqrt(AMBIENT / (1 + AMBIENT)) * 255 + 0.5);
+    geometry->num_vertices = geometry->num_indices = 0;
+    for (int l = 0; l < NUM_LIGHTS; l++)
+    {
+        const LIGHT *light = &scene->lights[l];
+        VISIBILITY *v = &visibility[l];
+        if (v->x != light->circle.x || v->y != light->circle.y || v->generation != scene->generation)
+        {
+            ComputeVisibility(scene, v, (float)light->circle.x, (float)light->circle.y);
+            v->x = light->circle.x;
+            v->y = light->circle.y;
+            v->generation = scene->generation;
+        }
+        SDL_Color color;
+        color.r = (Uint8)SDL_min(light->color[0] * light->intensity / FALLOFF_INTENSITY * 255 + 0.5, 255);
+        color.g = (Uint8)SDL_min(light->color[1] * light->intensity / FALLOFF_INTENSITY * 255 + 0.5, 255);
+        color.b = (Uint8)SDL_min(light->color[2] * light->intensity / FALLOFF_INTENSITY * 255 + 0.5, 255);
+        color.a = 255;
+        AddFan(geometry, (SDL_FPoint){(float)light->circle.x, (float)light->circle.y}, v->points, v->num_points, color, scale);
+    }
+    double ms = (SDL_GetPerformanceCounter() - start) * 1000.0 / SDL_GetPerformanceFrequency();
+
+    SDL_SetRenderDrawColor(renderer, ambient, ambient, ambient, 255);
+    SDL_RenderClear(renderer);
+    if (falloff)
+        SDL_RenderGeometry(renderer, falloff, geometry->vertices, geometry->num_vertices, geometry->indices, geometry->num_indices);
+    return ms;
+}
+
+// draws the occluders in black and the lights in their colours over the lighting
+void DrawScene(SDL_Renderer *renderer, const SCENE *scene, GEOMETRY *geometry)
+{
+    void AddCircle(GEOMETRY *, const CIRCLE *, SDL_Color);
+    void AddFan(GEOMETRY *, SDL_FPoint, const SDL_FPoint *, int, SDL_Color, float);
+    int ReserveGeometry(GEOMETRY *, int, int);
+
+    SDL_Color black = {RGBCOLOR_OCCLUDER, 255};
+    geometry->num_vertices = geometry->num_indices = 0;
+    for (int i = 0; i < scene->num_occluders; i++)
+    {
+        const OCCLUDER *occluder = &scene->occluders[i];
+        if (occluder->type == OCCLUDER_CIRCLE)
+            AddCircle(geometry, &occluder->circle, black);
+        else if (occluder->type == OCCLUDER_POLYGON)
+            AddFan(geometry, (SDL_FPoint){(float)occluder->circle.x, (float)occluder->circle.y}, occluder->points,
+                   occluder->num_points, black, 0);
+        else if (ReserveGeometry(geometry, 4, 6))
+        {
+            // a quad SEGMENT_WIDTH pixels wide along the segment
+            SDL_FPoint a = occluder->points[0], b = occluder->points[1];
+            float dx = b.x - a.x, dy = b.y - a.y, length = SDL_sqrtf(dx * dx + dy * dy);
+            float nx = length > 0 ? -dy / length * SEGMENT_WIDTH / 2 : 0, ny = length > 0 ? dx / length * SEGMENT_WIDTH / 2 : 0;
+            int first = geometry->num_vertices;
+            SDL_FPoint corners[4] = {{a.x + nx, a.y + ny}, {b.x + nx, b.y + ny}, {b.x - nx, b.y - ny}, {a.x - nx, a.y - ny}};
+            int quad[6] = {0, 1, 2, 0, 2, 3};
+            for (int k = 0; k < 4; k++)
+                geometry->vertices[geometry->num_vertices++] = (SDL_Vertex){corners[k], black, {0, 0}};
+            for (int k = 0; k < 6; k++)
+                geometry->indices[geometry->num_indices++] = first + quad[k];
+        }
+    }
+    for (int i = 0; i < NUM_LIGHTS; i++)
+    {
+        const LIGHT *light = &scene->lights[i];
+        SDL_Color color = {(Uint8)(light->color[0] * 255), (Uint8)(light->color[1] * 255), (Uint8)(light->color[2] * 255), 255};
+        AddCircle(geometry, &light->circle, color);
+    }
+    SDL_RenderGeometry(renderer, NULL, geometry->vertices, geometry->num_vertices, geometry->indices, geometry->num_indices);
+}
+
+void AddCircle(GEOMETRY *geometry, const CIRCLE *circle, SDL_Color color)
+{
+    void AddFan(GEOMETRY *, SDL_FPoint, const SDL_FPoint *, int, SDL_Color, float);
+
+    SDL_FPoint points[CIRCLE_SEGMENTS];
+    for (int i = 0; i < CIRCLE_SEGMENTS; i++)
+    {
+        double a = 2 * M_PI * i / CIRCLE_SEGMENTS;
+        points[i] = (SDL_FPoint){(float)(circle->x + SDL_cos(a) * circle->r), (float)(circle->y + SDL_sin(a) * circle->r)};
+    }
+    AddFan(geometry, (SDL_FPoint){(float)circle->x, (float)circle->y}, points, CIRCLE_SEGMENTS, color, 0);
+}
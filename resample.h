@@ -0,0 +1,374 @@
+#ifndef RESAMPLE_H
+#define RESAMPLE_H
+
+// Separable image resampling with a bilinear, bicubic or Lanczos-3 filter. Each
+// output column and row gets its filter weights worked out once; the source rows
+// are then filtered horizontally into floats and those columns vertically into the
+// destination, both passes split into bands of rows across threads. Source pixels
+// have 3 or 4 channels of 8 bits and come a row at a time from a callback, which is
+// called from several threads at once; destination pixels have 4 channels in the
+// same order, the fourth opaque when the source has none.
+//
+//     if (!resampleImage(FILTER_LANCZOS3, readRow, image, src_w, src_h, 3, dst, dst_w * 4, dst_w, dst_h))
+//         printf("Out of memory\n");
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <SDL2/SDL.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define RESAMPLE_SSE2 1
+#endif
+
+#define MAX_RESAMPLE_THREADS 16
+// below this many destination pixels an image is resampled on the calling thread
+#define PARALLEL_RESAMPLE_PIXELS (1 << 16)
+
+enum RESAMPLE_FILTER
+{
+    FILTER_BILINEAR,
+    FILTER_BICUBIC,
+    FILTER_LANCZOS3,
+    NUM_FILTERS
+};
+
+static const char *filter_names[NUM_FILTERS] = {"bilinear", "bicubic", "Lanczos-3"};
+
+// how many threads resampleImage uses, all available when 0
+static int resample_threads = 0;
+
+// Along one axis, the source pixels each destination pixel is made of: taps of them
+// from first, with weights summing to 1. Pixels the filter does not reach near the
+// edges have a weight of 0, so every destination pixel has the same number of taps.
+typedef struct
+{
+    int taps;
+    int *first;
+    float *weights;
+} FILTER_WEIGHTS;
+
+typedef void (*RESAMPLE_READ)(void *data, int y, Uint8 *row);
+
+typedef struct
+{
+    FILTER_WEIGHTS x_weights, y_weights;
+    RESAMPLE_READ read_row;
+    void *data;
+    int src_w, src_bytes, dst_w;
+    // source rows row0 up to row1 filtered horizontally, dst_w * 4 floats each
+    float *columns;
+    int row0, row1;
+    Uint8 *dst;
+    int dst_pitch;
+} RESAMPLE;
+
+typedef struct
+{
+    RESAMPLE *resample;
+    int y0, y1;
+} RESAMPLE_JOB;
+
+static inline double filterKernel(int filter, double x);
+static inline double filterSupport(int filter);
+static inline int initFilterWeights(FILTER_WEIGHTS *weights, int filter, int src_size, int dst_size);
+static inline void freeFilterWeights(FILTER_WEIGHTS *weights);
+static inline int horizontalJob(void *data);
+static inline int verticalJob(void *data);
+static inline int runResampleJobs(RESAMPLE *resample, SDL_ThreadFunction job, int y0, int y1, int num_threads);
+static inline int resampleImage(int filter, RESAMPLE_READ read_row, void *data, int src_w, int src_h, int src_bytes,
+                                Uint8 *dst, int dst_pitch, int dst_w, int dst_h);
+static inline void benchReadRow(void *data, int y, Uint8 *row);
+static inline void benchResample(int src_w, int src_h);
+
+static inline double filterKernel(int filter, double x)
+{
+    x = SDL_fabs(x);
+    if (filter == FILTER_BILINEAR)
+        return x < 1 ? 1 - x : 0;
+    if (filter == FILTER_BICUBIC)
+    {
+        // Keys' cubic with a = -0.5, which is Catmull-Rom
+        if (x < 1)
+            return (1.5 * x - 2.5) * x * x + 1;
+        if (x < 2)
+            return ((-0.5 * x + 2.5) * x - 4) * x + 2;
+        return 0;
+    }
+    if (x < 1e-8)
+        return 1;
+    if (x >= 3)
+        return 0;
+    return 3 * SDL_sin(M_PI * x) * SDL_sin(M_PI * x / 3) / (M_PI * M_PI * x * x);
+}
+
+static inline double filterSupport(int filter)
+{
+    return filter == FILTER_BILINEAR ? 1 : filter == FILTER_BICUBIC ? 2 : 3;
+}
+
+// When shrinking, the filter is widened by the same factor, so that it averages over
+// every source pixel under a destination pixel instead of skipping most of them.
+static inline int initFilterWeights(FILTER_WEIGHTS *weights, int filter, int src_size, int dst_size)
+{
+    double scale = (double)dst_size / src_size, stretch = SDL_max(1.0, 1 / scale);
+    double support = filterSupport(filter) * stretch;
+    int taps = SDL_min((int)SDL_ceil(support * 2) + 1, src_size);
+    weights->taps = taps;
+    weights->first = (int *)malloc(dst_size * sizeof(int));
+    weights->weights = (float *)malloc((size_t)dst_size * taps * sizeof(float));
+    if (!weights->first || !weights->weights)
+    {
+        freeFilterWeights(weights);
+        return 0;
+    }
+    for (int i = 0; i < dst_size; i++)
+    {
+        double centre = (i + 0.5) / scale;
+        int first = SDL_clamp((int)SDL_floor(centre - support), 0, src_size - taps);
+        float *w = weights->weights + (size_t)i * taps;
+        double sum = 0;
+        for (int j = 0; j < taps; j++)
+        {
+            w[j] = (float)filterKernel(filter, (first + j + 0.5 - centre) / stretch);
+            sum += w[j];
+        }
+        for (int j = 0; j < taps; j++)
+            w[j] = sum != 0 ? (float)(w[j] / sum) : j == 0;
+        weights->first[i] = first;
+    }
+    return 1;
+}
+
+static inline void freeFilterWeights(FILTER_WEIGHTS *weights)
+{
+    free(weights->first);
+    free(weights->weights);
+    weights->first = NULL;
+    weights->weights = NULL;
+}
+
+// filters source rows y0 up to y1 horizontally into resample->columns
+static inline int horizontalJob(void *data)
+{
+    RESAMPLE_JOB *job = (RESAMPLE_JOB *)data;
+    RESAMPLE *resample = job->resample;
+    int src_w = resample->src_w, src_bytes = resample->src_bytes, dst_w = resample->dst_w;
+    int taps = resample->x_weights.taps;
+    Uint8 *row = (Uint8 *)malloc((size_t)src_w * src_bytes);
+    float *pixels = (float *)malloc((size_t)src_w * 4 * sizeof(float));
+    if (!row || !pixels)
+    {
+        free(row);
+        free(pixels);
+        return -1;
+    }
+    for (int y = job->y0; y < job->y1; y++)
+    {
+        resample->read_row(resample->data, y, row);
+        int x = 0;
+#ifdef RESAMPLE_SSE2
+        // four pixels at a time while a whole 16 bytes can be read
+        const __m128i zero = _mm_setzero_si128(), opaque = _mm_setr_epi32(0, 0, 0, src_bytes == 4 ? 0 : 255);
+        for (; x + 6 <= src_w; x += 4)
+        {
+            __m128i bytes = _mm_loadu_si128((const __m128i *)(row + (size_t)x * src_bytes));
+            for (int k = 0; k < 4; k++)
+            {
+                __m128i pixel = _mm_unpacklo_epi16(_mm_unpacklo_epi8(bytes, zero), zero);
+                if (src_bytes == 3)
+                    pixel = _mm_or_si128(_mm_and_si128(pixel, _mm_setr_epi32(-1, -1, -1, 0)), opaque);
+                _mm_storeu_ps(pixels + (x + k) * 4, _mm_cvtepi32_ps(pixel));
+                bytes = _mm_srli_si128(bytes, 3);
+                if (src_bytes == 4)
+                    bytes = _mm_srli_si128(bytes, 1);
+            }
+        }
+#endif
+        for (; x < src_w; x++)
+        {
+            const Uint8 *p = row + (size_t)x * src_bytes;
+            pixels[x * 4] = p[0];
+            pixels[x * 4 + 1] = p[1];
+            pixels[x * 4 + 2] = p[2];
+            pixels[x * 4 + 3] = src_bytes == 4 ? p[3] : 255;
+        }
+
+        float *out = resample->columns + (size_t)(y - resample->row0) * dst_w * 4;
+        for (x = 0; x < dst_w; x++)
+        {
+            const float *w = resample->x_weights.weights + (size_t)x * taps;
+            const float *p = pixels + resample->x_weights.first[x] * 4;
+#ifdef RESAMPLE_SSE2
+            // one pixel's four channels per vector
+            __m128 sum[2] = {_mm_setzero_ps(), _mm_setzero_ps()};
+            int j = 0;
+            for (; j + 2 <= taps; j += 2)
+            {
+                sum[0] = _mm_add_ps(sum[0], _mm_mul_ps(_mm_loadu_ps(p + j * 4), _mm_load1_ps(w + j)));
+                sum[1] = _mm_add_ps(sum[1], _mm_mul_ps(_mm_loadu_ps(p + j * 4 + 4), _mm_load1_ps(w + j + 1)));
+            }
+            if (j < taps)
+                sum[0] = _mm_add_ps(sum[0], _mm_mul_ps(_mm_loadu_ps(p + j * 4), _mm_load1_ps(w + j)));
+            _mm_storeu_ps(out + x * 4, _mm_add_ps(sum[0], sum[1]));
+#else
+            float sum[4] = {0, 0, 0, 0};
+            for (int j = 0; j < taps; j++)
+            {
+                for (int c = 0; c < 4; c++)
+                    sum[c] += p[j * 4 + c] * w[j];
+            }
+            for (int c = 0; c < 4; c++)
+                out[x * 4 + c] = sum[c];
+#endif
+        }
+    }
+    free(row);
+    free(pixels);
+    return 0;
+}
+
+// filters the columns vertically into destination rows y0 up to y1
+static inline int verticalJob(void *data)
+{
+    RESAMPLE_JOB *job = (RESAMPLE_JOB *)data;
+    RESAMPLE *resample = job->resample;
+    int taps = resample->y_weights.taps, count = resample->dst_w * 4;
+    for (int y = job->y0; y < job->y1; y++)
+    {
+        const float *w = resample->y_weights.weights + (size_t)y * taps;
+        const float *rows = resample->columns + (size_t)(resample->y_weights.first[y] - resample->row0) * count;
+        Uint8 *dst = resample->dst + (size_t)y * resample->dst_pitch;
+        int i = 0;
+#ifdef RESAMPLE_SSE2
+        // four pixels at a time, rounded, clamped and packed back to bytes
+        for (; i + 16 <= count; i += 16)
+        {
+            __m128 sum[4] = {_mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps()};
+            for (int j = 0; j < taps; j++)
+            {
+                const float *p = rows + (size_t)j * count + i;
+                __m128 weight = _mm_set1_ps(w[j]);
+                for (int k = 0; k < 4; k++)
+                    sum[k] = _mm_add_ps(sum[k], _mm_mul_ps(_mm_loadu_ps(p + k * 4), weight));
+            }
+            __m128i lo = _mm_packs_epi32(_mm_cvtps_epi32(sum[0]), _mm_cvtps_epi32(sum[1]));
+            __m128i hi = _mm_packs_epi32(_mm_cvtps_epi32(sum[2]), _mm_cvtps_epi32(sum[3]));
+            _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(lo, hi));
+        }
+#endif
+        for (; i < count; i++)
+        {
+            float sum = 0.5f;
+            for (int j = 0; j < taps; j++)
+                sum += rows[(size_t)j * count + i] * w[j];
+            dst[i] = sum <= 0 ? 0 : sum >= 255 ? 255 : (Uint8)sum;
+        }
+    }
+    return 0;
+}
+
+// runs a job over rows y0 up to y1, split into bands across threads, returning 0 if any band failed
+static inline int runResampleJobs(RESAMPLE *resample, SDL_ThreadFunction job, int y0, int y1, int num_threads)
+{
+    RESAMPLE_JOB jobs[MAX_RESAMPLE_THREADS];
+    SDL_Thread *threads[MAX_RESAMPLE_THREADS];
+    num_threads = SDL_clamp(SDL_min(num_threads, y1 - y0), 1, MAX_RESAMPLE_THREADS);
+    for (int i = 0; i < num_threads; i++)
+    {
+        jobs[i] = (RESAMPLE_JOB){resample, y0 + (int)((Sint64)(y1 - y0) * i / num_threads),
+                                 y0 + (int)((Sint64)(y1 - y0) * (i + 1) / num_threads)};
+        threads[i] = i ? SDL_CreateThread(job, "resample", &jobs[i]) : NULL;
+    }
+    int failed = job(&jobs[0]) != 0;
+    for (int i = 1; i < num_threads; i++)
+    {
+        int status = 0;
+        if (threads[i])
+            SDL_WaitThread(threads[i], &status);
+        else
+            status = job(&jobs[i]);
+        failed |= status != 0;
+    }
+    return !failed;
+}
+
+// scales a src_w x src_h image to dst_w x dst_h, returning 0 if memory ran out
+static inline int resampleImage(int filter, RESAMPLE_READ read_row, void *data, int src_w, int src_h, int src_bytes,
+                                Uint8 *dst, int dst_pitch, int dst_w, int dst_h)
+{
+    if (src_w <= 0 || src_h <= 0 || dst_w <= 0 || dst_h <= 0)
+        return 1;
+    RESAMPLE resample = {{0}, {0}, read_row, data, src_w, src_bytes, dst_w, NULL, 0, 0, dst, dst_pitch};
+    if (!initFilterWeights(&resample.x_weights, filter, src_w, dst_w) ||
+        !initFilterWeights(&resample.y_weights, filter, src_h, dst_h))
+    {
+        freeFilterWeights(&resample.x_weights);
+        return 0;
+    }
+    // only the source rows some destination row is made of
+    resample.row0 = resample.y_weights.first[0];
+    resample.row1 = resample.y_weights.first[dst_h - 1] + resample.y_weights.taps;
+    resample.columns = (float *)malloc((size_t)(resample.row1 - resample.row0) * dst_w * 4 * sizeof(float));
+    int done = 0;
+    if (resample.columns)
+    {
+        int num_threads = resample_threads ? resample_threads : SDL_GetCPUCount();
+        if ((Sint64)dst_w * dst_h < PARALLEL_RESAMPLE_PIXELS)
+            num_threads = 1;
+        // the vertical pass would read columns a failed horizontal band never wrote
+        done = runResampleJobs(&resample, horizontalJob, resample.row0, resample.row1, num_threads) &&
+               runResampleJobs(&resample, verticalJob, 0, dst_h, num_threads);
+    }
+    free(resample.columns);
+    freeFilterWeights(&resample.x_weights);
+    freeFilterWeights(&resample.y_weights);
+    return done;
+}
+
+static inline void benchReadRow(void *data, int y, Uint8 *row)
+{
+    const int *width = (const int *)data;
+    for (int x = 0; x < *width * 3; x++)
+        row[x] = (Uint8)((x * 7 + y * 13) ^ (x * y >> 5));
+}
+
+// prints how long each filter takes to scale a src_w x src_h image to a few common sizes
+static inline void benchResample(int src_w, int src_h)
+{
+    const int sizes[][2] = {{1280, 720}, {1920, 1080}, {src_w / 4, src_h / 4}, {src_w * 2, src_h * 2}};
+    int max_threads = SDL_clamp(SDL_GetCPUCount(), 1, MAX_RESAMPLE_THREADS);
+    printf("Resampling %dx%d RGB24, %d threads at most\n", src_w, src_h, max_threads);
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        // the largest size with the source's aspect that fits
+        double fit = SDL_min((double)sizes[s][0] / src_w, (double)sizes[s][1] / src_h);
+        int dst_w = SDL_max((int)(src_w * fit + 0.5), 1), dst_h = SDL_max((int)(src_h * fit + 0.5), 1);
+        Uint8 *dst = (Uint8 *)malloc((size_t)dst_w * dst_h * 4);
+        if (!dst)
+            continue;
+        for (int filter = 0; filter < NUM_FILTERS; filter++)
+        {
+            double best[2] = {1e30, 1e30};
+            for (int threaded = 0; threaded < 2; threaded++)
+            {
+                resample_threads = threaded ? max_threads : 1;
+                for (int run = 0; run < 5; run++)
+                {
+                    Uint64 start = SDL_GetPerformanceCounter();
+                    resampleImage(filter, benchReadRow, &src_w, src_w, src_h, 3, dst, dst_w * 4, dst_w, dst_h);
+                    best[threaded] = SDL_min(best[threaded], (double)(SDL_GetPerformanceCounter() - start) /
+                                                                 SDL_GetPerformanceFrequency());
+                }
+            }
+            printf("  -> %4dx%-4d %-10s %7.2f ms, %7.2f ms threaded\n", dst_w, dst_h, filter_names[filter], best[0] * 1000,
+                   best[1] * 1000);
+        }
+        free(dst);
+    }
+    resample_threads = 0;
+}
+
+#endif
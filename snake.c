@@ -1,23 +1,27 @@
 #include <SDL2/SDL.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
 #define WIDTH 800
 #define HEIGHT 600
 #define TILE_SIZE 25
-#define ROWS HEIGHT / TILE_SIZE
-#define COLS WIDTH / TILE_SIZE
+#define ROWS (HEIGHT / TILE_SIZE)
+#define COLS (WIDTH / TILE_SIZE)
+#define NUM_TILES (ROWS * COLS)
 #define FRAME_RATE 4
 #define RGB_SNAKE 0, 255, 0
 #define RGB_FOOD 255, 0, 0
 #define RGB_BG 0, 0, 0
 #define START_POS 200, 200
-
-typedef struct NODE
-{
-    int x, y;
-    struct NODE *next, *prev;
-} NODE;
+#define MAX_THREADS 64
+#define BENCH_GAMES 4096
+#define BENCH_STEPS 2000
+#define AUTOPILOT_FRAME_RATE 30
+#define TOURNAMENT_GAMES 64
+#define TOURNAMENT_MAX_MOVES 2000000
+#define UNREACHABLE 0xffff
+#define SHORTCUT_BUFFER 3
 
 typedef enum
 {
@@ -25,6 +29,7 @@ typedef enum
     DOWN,
     LEFT,
     RIGHT,
+    NUM_DIRS
 } DIR;
 
 typedef enum
@@ -34,33 +39,182 @@ typedef enum
     FOOD,
 } TILE_STATE;
 
-NODE *head = NULL, *tail = NULL;
-int *tiles;
+typedef enum
+{
+    STEP_MOVED,
+    STEP_ATE,
+    STEP_DIED,
+    STEP_WON,
+} STEP_RESULT;
+
+// num_games independent games in structure-of-arrays layout: per-game values are
+// arrays indexed by game, per-tile data is one NUM_TILES block per game.
+// Bodies are ring buffers of tile indices (tail at body[tail_pos]) and empty
+// tiles are an indexed set (free_slot maps a tile back into free_tiles).
+typedef struct
+{
+    int num_games;
+    Uint8 *tiles;
+    Uint16 *body;
+    Uint16 *free_tiles;
+    Uint16 *free_slot;
+    int *tail_pos, *length, *num_free;
+    int *score, *food, *vacated;
+    Uint8 *dir;
+    Uint64 *rng;
+} SNAKE_ENV;
+
+typedef enum
+{
+    AI_CYCLE,
+    AI_SHORTCUT,
+} AI_MODE;
+
+// per-game planner state, NUM_TILES blocks per game like SNAKE_ENV. dist is the
+// BFS distance from the food to every tile through non-snake tiles, kept up to
+// date move by move; the other blocks are scratch space for those updates
+typedef struct
+{
+    int num_games;
+    AI_MODE mode;
+    Uint16 *dist;
+    Uint16 *queue;
+    Uint16 *seeds;
+    Uint16 *bucket_counts;
+    Uint8 *affected;
+    int *field_food;
+} AUTOPILOT;
+
+typedef void (*WORK_FUNC)(void *, int, int);
+
+typedef struct WORKER_POOL WORKER_POOL;
+
+typedef struct
+{
+    WORKER_POOL *pool;
+    int index;
+} WORKER;
 
-void InsertFirstAndFill(SDL_Surface *, int, int);
-void DeleteLastAndClear(SDL_Surface *);
-void GenerateAndFillFoodCoords(SDL_Surface *, int *, int *, int *);
+// persistent threads that each run one slice of [0, count) per RunParallel call
+struct WORKER_POOL
+{
+    int num_threads;
+    SDL_Thread *threads[MAX_THREADS];
+    WORKER workers[MAX_THREADS];
+    SDL_mutex *mutex;
+    SDL_cond *work_ready, *work_done;
+    int generation, pending, quit;
+    WORK_FUNC work;
+    void *data;
+    int count;
+};
+
+typedef struct
+{
+    SNAKE_ENV *env;
+    const Uint8 *actions;
+    Uint8 *results;
+} STEP_JOB;
+
+typedef struct
+{
+    SNAKE_ENV *env;
+    AUTOPILOT *ai;
+    Uint64 max_moves;
+    Uint64 *moves, *decision_ticks;
+    Uint8 *won;
+} TOURNAMENT_JOB;
+
+// Hamiltonian cycle through every tile: cycle_order is a tile's position on it
+int cycle_order[NUM_TILES];
+int cycle_next[NUM_TILES];
+
+Uint64 NextRandom(Uint64 *);
+SNAKE_ENV *CreateEnv(int, Uint64);
+void DestroyEnv(SNAKE_ENV *);
+void ResetGame(SNAKE_ENV *, int);
+STEP_RESULT StepGame(SNAKE_ENV *, int, int);
+void StepEnv(SNAKE_ENV *, const Uint8 *, Uint8 *, WORKER_POOL *);
+void StepEnvRange(void *, int, int);
+void RemoveFreeTile(SNAKE_ENV *, int, int);
+void AddFreeTile(SNAKE_ENV *, int, int);
+int PlaceFood(SNAKE_ENV *, int);
+int GetHead(SNAKE_ENV *, int);
 int GetIndexFromCoords(int, int);
+WORKER_POOL *CreateWorkerPool(int);
+void DestroyWorkerPool(WORKER_POOL *);
+void RunParallel(WORKER_POOL *, WORK_FUNC, void *, int);
+int WorkerMain(void *);
+void FillTile(SDL_Surface *, int, Uint32);
+int RunBenchmark(int, int, int, Uint64);
+int GetNeighbour(int, int);
+void InitCycle();
+int CycleDistance(int, int);
+AUTOPILOT *CreateAutopilot(int, AI_MODE);
+void DestroyAutopilot(AUTOPILOT *);
+void RebuildDistanceField(AUTOPILOT *, SNAKE_ENV *, int);
+void BlockTile(AUTOPILOT *, SNAKE_ENV *, int, int);
+void UnblockTile(AUTOPILOT *, SNAKE_ENV *, int, int);
+int ChooseMove(AUTOPILOT *, SNAKE_ENV *, int);
+STEP_RESULT StepAutopilot(AUTOPILOT *, SNAKE_ENV *, int);
+void PlayTournamentRange(void *, int, int);
+int RunTournament(int, int, Uint64, AI_MODE, Uint64);
 
-int main()
+int main(int argc, char **argv)
 {
+    int bench = 0, tournament = 0, autopilot = 0, games = 0, steps = BENCH_STEPS, threads = SDL_GetCPUCount();
+    Uint64 seed = time(NULL), max_moves = TOURNAMENT_MAX_MOVES;
+    AI_MODE mode = AI_SHORTCUT;
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--bench"))
+            bench = 1;
+        else if (!strcmp(argv[i], "--tournament"))
+            tournament = 1;
+        else if (!strcmp(argv[i], "--autopilot"))
+            autopilot = 1;
+        else if (!strcmp(argv[i], "--ai") && i + 1 < argc)
+            mode = !strcmp(argv[++i], "cycle") ? AI_CYCLE : AI_SHORTCUT;
+        else if (!strcmp(argv[i], "--max-moves") && i + 1 < argc)
+            max_moves = strtoull(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "--games") && i + 1 < argc)
+            games = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--steps") && i + 1 < argc)
+            steps = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--threads") && i + 1 < argc)
+            threads = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--seed") && i + 1 < argc)
+            seed = strtoull(argv[++i], NULL, 10);
+        else
+        {
+            printf("Usage: ./snake [--autopilot] [--ai cycle|shortcut]\n"
+                   "       ./snake --bench [--games N] [--steps N] [--threads N] [--seed N]\n"
+                   "       ./snake --tournament [--ai cycle|shortcut] [--games N] [--max-moves N] [--threads N] [--seed N]\n");
+            return 0;
+        }
+    }
+
+    InitCycle();
+    if (bench)
+        return RunBenchmark(games ? games : BENCH_GAMES, steps, threads, seed);
+    if (tournament)
+        return RunTournament(games ? games : TOURNAMENT_GAMES, threads, seed, mode, max_moves);
+
     SDL_Init(SDL_INIT_EVERYTHING);
     SDL_Window *window = SDL_CreateWindow("Snake", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, WIDTH, HEIGHT, 0);
     SDL_Surface *surface = SDL_GetWindowSurface(window);
 
-    srand(time(NULL));
-    tiles = (int *)calloc(ROWS * COLS, sizeof(int));
+    SNAKE_ENV *env = CreateEnv(1, seed);
+    AUTOPILOT *ai = CreateAutopilot(1, mode);
+    RebuildDistanceField(ai, env, 0);
+    FillTile(surface, GetHead(env, 0), SDL_MapRGB(surface->format, RGB_SNAKE));
+    FillTile(surface, env->food[0], SDL_MapRGB(surface->format, RGB_FOOD));
 
-    InsertFirstAndFill(surface, START_POS);
     DIR dir = RIGHT;
-    int food_x, food_y;
-    GenerateAndFillFoodCoords(surface, tiles, &food_x, &food_y);
-
-    int running = 1, score = 0;
+    int running = 1, won = 0;
     while (running)
     {
         SDL_Event event;
-        int next_x = head->x, next_y = head->y;
         while (SDL_PollEvent(&event))
         {
             if (event.type == SDL_QUIT)
@@ -85,115 +239,724 @@ int main()
                 case SDLK_RIGHT:
                     dir = RIGHT;
                     break;
+                case SDLK_p:
+                    autopilot = !autopilot;
+                    break;
                 }
             }
         }
 
-        switch (dir)
+        // the planner's distance field follows every move, including manual ones
+        STEP_RESULT result;
+        if (autopilot)
         {
-        case UP:
-            next_y -= TILE_SIZE;
-            break;
-        case DOWN:
-            next_y += TILE_SIZE;
-            break;
-        case LEFT:
-            next_x -= TILE_SIZE;
-            break;
-        case RIGHT:
-            next_x += TILE_SIZE;
-            break;
+            result = StepAutopilot(ai, env, 0);
+            dir = env->dir[0];
         }
-
-        if (next_x >= WIDTH || next_x < 0 || next_y >= HEIGHT || next_y < 0 || tiles[GetIndexFromCoords(next_x, next_y)] == SNAKE)
+        else
+        {
+            result = StepGame(env, 0, dir);
+            if (result == STEP_ATE)
+                RebuildDistanceField(ai, env, 0);
+            else if (result == STEP_MOVED)
+            {
+                BlockTile(ai, env, 0, GetHead(env, 0));
+                UnblockTile(ai, env, 0, env->vacated[0]);
+            }
+        }
+        if (result == STEP_DIED)
             break;
 
-        InsertFirstAndFill(surface, next_x, next_y);
+        // the game logic reports which tiles changed, so only those are redrawn
+        FillTile(surface, GetHead(env, 0), SDL_MapRGB(surface->format, RGB_SNAKE));
+        if (env->vacated[0] >= 0)
+            FillTile(surface, env->vacated[0], SDL_MapRGB(surface->format, RGB_BG));
+        if (result == STEP_ATE)
+            FillTile(surface, env->food[0], SDL_MapRGB(surface->format, RGB_FOOD));
 
-        if (head->x == food_x && head->y == food_y)
+        SDL_UpdateWindowSurface(window);
+        if (result == STEP_WON)
         {
-            GenerateAndFillFoodCoords(surface, tiles, &food_x, &food_y);
-            score++;
+            won = 1;
+            break;
         }
-        else
-            DeleteLastAndClear(surface);
-
-        SDL_UpdateWindowSurface(window);
-        SDL_Delay(1000 / FRAME_RATE);
+        SDL_Delay(1000 / (autopilot ? AUTOPILOT_FRAME_RATE : FRAME_RATE));
     }
 
-    printf("GAME OVER!\nScore = %d\n", score);
+    printf("%s\nScore = %d\n", won ? "YOU WIN!" : "GAME OVER!", env->score[0]);
+    DestroyAutopilot(ai);
+    DestroyEnv(env);
     SDL_Delay(1000);
     SDL_DestroyWindow(window);
     SDL_Quit();
     return 0;
 }
 
-void InsertFirstAndFill(SDL_Surface *surface, int x, int y)
+// splitmix64: one independent stream per game, seeded from the game index
+Uint64 NextRandom(Uint64 *state)
 {
-    NODE *p = (NODE *)malloc(sizeof(NODE));
-    p->x = x;
-    p->y = y;
-    p->next = p->prev = NULL;
+    Uint64 z = (*state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
 
-    if (!head && !tail)
+SNAKE_ENV *CreateEnv(int num_games, Uint64 seed)
+{
+    SNAKE_ENV *env = (SNAKE_ENV *)calloc(1, sizeof(SNAKE_ENV));
+    env->num_games = num_games;
+    env->tiles = (Uint8 *)calloc((size_t)num_games * NUM_TILES, sizeof(Uint8));
+    env->body = (Uint16 *)calloc((size_t)num_games * NUM_TILES, sizeof(Uint16));
+    env->free_tiles = (Uint16 *)calloc((size_t)num_games * NUM_TILES, sizeof(Uint16));
+    env->free_slot = (Uint16 *)calloc((size_t)num_games * NUM_TILES, sizeof(Uint16));
+    env->tail_pos = (int *)calloc(num_games, sizeof(int));
+    env->length = (int *)calloc(num_games, sizeof(int));
+    env->num_free = (int *)calloc(num_games, sizeof(int));
+    env->score = (int *)calloc(num_games, sizeof(int));
+    env->food = (int *)calloc(num_games, sizeof(int));
+    env->vacated = (int *)calloc(num_games, sizeof(int));
+    env->dir = (Uint8 *)calloc(num_games, sizeof(Uint8));
+    env->rng = (Uint64 *)calloc(num_games, sizeof(Uint64));
+
+    for (int g = 0; g < num_games; g++)
     {
-        head = p;
-        tail = p;
+        env->rng[g] = seed ^ ((Uint64)g * 0xD1B54A32D192ED03ull);
+        ResetGame(env, g);
     }
+    return env;
+}
+
+void DestroyEnv(SNAKE_ENV *env)
+{
+    free(env->tiles);
+    free(env->body);
+    free(env->free_tiles);
+    free(env->free_slot);
+    free(env->tail_pos);
+    free(env->length);
+    free(env->num_free);
+    free(env->score);
+    free(env->food);
+    free(env->vacated);
+    free(env->dir);
+    free(env->rng);
+    free(env);
+}
+
+void ResetGame(SNAKE_ENV *env, int g)
+{
+    Uint8 *tiles = env->tiles + (size_t)g * NUM_TILES;
+    Uint16 *free_tiles = env->free_tiles + (size_t)g * NUM_TILES;
+    Uint16 *free_slot = env->free_slot + (size_t)g * NUM_TILES;
+
+    static Uint16 identity[NUM_TILES];
+    if (!identity[NUM_TILES - 1])
+        for (int i = 0; i < NUM_TILES; i++)
+            identity[i] = i;
+
+    memset(tiles, EMPTY, NUM_TILES);
+    memcpy(free_tiles, identity, sizeof(identity));
+    memcpy(free_slot, identity, sizeof(identity));
+    env->num_free[g] = NUM_TILES;
+
+    int start = GetIndexFromCoords(START_POS);
+    RemoveFreeTile(env, g, start);
+    tiles[start] = SNAKE;
+    env->body[(size_t)g * NUM_TILES] = start;
+    env->tail_pos[g] = 0;
+    env->length[g] = 1;
+    env->score[g] = 0;
+    env->vacated[g] = -1;
+    env->dir[g] = RIGHT;
+    PlaceFood(env, g);
+}
+
+// moves game g one tile; actions outside DIR keep the current direction
+STEP_RESULT StepGame(SNAKE_ENV *env, int g, int action)
+{
+    Uint8 *tiles = env->tiles + (size_t)g * NUM_TILES;
+    Uint16 *body = env->body + (size_t)g * NUM_TILES;
+
+    if (action >= 0 && action < NUM_DIRS)
+        env->dir[g] = action;
+
+    int head = GetHead(env, g);
+    int row = head / COLS, col = head % COLS;
+    switch (env->dir[g])
+    {
+    case UP:
+        row--;
+        break;
+    case DOWN:
+        row++;
+        break;
+    case LEFT:
+        col--;
+        break;
+    case RIGHT:
+        col++;
+        break;
+    }
+
+    env->vacated[g] = -1;
+    if (col >= COLS || col < 0 || row >= ROWS || row < 0)
+        return STEP_DIED;
+    int next = row * COLS + col;
+    if (tiles[next] == SNAKE)
+        return STEP_DIED;
+
+    int ate = tiles[next] == FOOD;
+    if (!ate)
+        RemoveFreeTile(env, g, next);
+    int head_pos = env->tail_pos[g] + env->length[g]++;
+    body[head_pos >= NUM_TILES ? head_pos - NUM_TILES : head_pos] = next;
+    tiles[next] = SNAKE;
+
+    if (ate)
+    {
+        env->score[g]++;
+        return PlaceFood(env, g) ? STEP_ATE : STEP_WON;
+    }
+
+    int tail = body[env->tail_pos[g]];
+    if (++env->tail_pos[g] == NUM_TILES)
+        env->tail_pos[g] = 0;
+    env->length[g]--;
+    tiles[tail] = EMPTY;
+    AddFreeTile(env, g, tail);
+    env->vacated[g] = tail;
+    return STEP_MOVED;
+}
+
+// steps every game from actions[g], writing results[g]; finished games restart
+void StepEnv(SNAKE_ENV *env, const Uint8 *actions, Uint8 *results, WORKER_POOL *pool)
+{
+    STEP_JOB job = {env, actions, results};
+    if (pool)
+        RunParallel(pool, StepEnvRange, &job, env->num_games);
     else
+        StepEnvRange(&job, 0, env->num_games);
+}
+
+void StepEnvRange(void *data, int begin, int end)
+{
+    STEP_JOB *job = (STEP_JOB *)data;
+    for (int g = begin; g < end; g++)
+    {
+        STEP_RESULT result = StepGame(job->env, g, job->actions[g]);
+        if (result == STEP_DIED || result == STEP_WON)
+            ResetGame(job->env, g);
+        job->results[g] = result;
+    }
+}
+
+// swaps the last free tile into the removed tile's slot
+void RemoveFreeTile(SNAKE_ENV *env, int g, int tile)
+{
+    Uint16 *free_tiles = env->free_tiles + (size_t)g * NUM_TILES;
+    Uint16 *free_slot = env->free_slot + (size_t)g * NUM_TILES;
+    int slot = free_slot[tile];
+    int last = free_tiles[--env->num_free[g]];
+    free_tiles[slot] = last;
+    free_slot[last] = slot;
+}
+
+void AddFreeTile(SNAKE_ENV *env, int g, int tile)
+{
+    Uint16 *free_tiles = env->free_tiles + (size_t)g * NUM_TILES;
+    Uint16 *free_slot = env->free_slot + (size_t)g * NUM_TILES;
+    free_tiles[env->num_free[g]] = tile;
+    free_slot[tile] = env->num_free[g]++;
+}
+
+// returns 0 when there is no empty tile left to place food on
+int PlaceFood(SNAKE_ENV *env, int g)
+{
+    if (!env->num_free[g])
+        return 0;
+
+    // multiply-shift maps 32 random bits uniformly onto [0, num_free) without a division
+    Uint32 r = NextRandom(env->rng + g) >> 32;
+    int tile = env->free_tiles[(size_t)g * NUM_TILES + (int)(((Uint64)r * env->num_free[g]) >> 32)];
+    RemoveFreeTile(env, g, tile);
+    env->tiles[(size_t)g * NUM_TILES + tile] = FOOD;
+    env->food[g] = tile;
+    return 1;
+}
+
+int GetHead(SNAKE_ENV *env, int g)
+{
+    int head_pos = env->tail_pos[g] + env->length[g] - 1;
+    return env->body[(size_t)g * NUM_TILES + (head_pos >= NUM_TILES ? head_pos - NUM_TILES : head_pos)];
+}
+
+int GetIndexFromCoords(int x, int y)
+{
+    return y / TILE_SIZE * COLS + x / TILE_SIZE;
+}
+
+WORKER_POOL *CreateWorkerPool(int num_threads)
+{
+    WORKER_POOL *pool = (WORKER_POOL *)calloc(1, sizeof(WORKER_POOL));
+    pool->num_threads = SDL_clamp(num_threads, 1, MAX_THREADS);
+    pool->mutex = SDL_CreateMutex();
+    pool->work_ready = SDL_CreateCond();
+    pool->work_done = SDL_CreateCond();
+    for (int i = 0; i < pool->num_threads; i++)
+    {
+        pool->workers[i] = (WORKER){pool, i};
+        pool->threads[i] = SDL_CreateThread(WorkerMain, "snake worker", pool->workers + i);
+    }
+    return pool;
+}
+
+void DestroyWorkerPool(WORKER_POOL *pool)
+{
+    SDL_LockMutex(pool->mutex);
+    pool->quit = 1;
+    SDL_CondBroadcast(pool->work_ready);
+    SDL_UnlockMutex(pool->mutex);
+    for (int i = 0; i < pool->num_threads; i++)
+        SDL_WaitThread(pool->threads[i], NULL);
+    SDL_DestroyCond(pool->work_ready);
+    SDL_DestroyCond(pool->work_done);
+    SDL_DestroyMutex(pool->mutex);
+    free(pool);
+}
+
+// runs work over [0, count) split into one contiguous slice per thread and waits for all of them
+void RunParallel(WORKER_POOL *pool, WORK_FUNC work, void *data, int count)
+{
+    SDL_LockMutex(pool->mutex);
+    pool->work = work;
+    pool->data = data;
+    pool->count = count;
+    pool->pending = pool->num_threads;
+    pool->generation++;
+    SDL_CondBroadcast(pool->work_ready);
+    while (pool->pending)
+        SDL_CondWait(pool->work_done, pool->mutex);
+    SDL_UnlockMutex(pool->mutex);
+}
+
+int WorkerMain(void *data)
+{
+    WORKER *worker = (WORKER *)data;
+    WORKER_POOL *pool = worker->pool;
+    int seen = 0;
+
+    SDL_LockMutex(pool->mutex);
+    while (1)
+    {
+        while (pool->generation == seen && !pool->quit)
+            SDL_CondWait(pool->work_ready, pool->mutex);
+        if (pool->quit)
+            break;
+        seen = pool->generation;
+        int begin = (Sint64)pool->count * worker->index / pool->num_threads;
+        int end = (Sint64)pool->count * (worker->index + 1) / pool->num_threads;
+        SDL_UnlockMutex(pool->mutex);
+
+        pool->work(pool->data, begin, end);
+
+        SDL_LockMutex(pool->mutex);
+        if (--pool->pending == 0)
+            SDL_CondSignal(pool->work_done);
+    }
+    SDL_UnlockMutex(pool->mutex);
+    return 0;
+}
+
+void FillTile(SDL_Surface *surface, int tile, Uint32 color)
+{
+    SDL_Rect rect = {tile % COLS * TILE_SIZE, tile / COLS * TILE_SIZE, TILE_SIZE, TILE_SIZE};
+    SDL_FillRect(surface, &rect, color);
+}
+
+// headless: every game follows a random policy that mostly keeps its direction and never reverses
+int RunBenchmark(int num_games, int num_steps, int num_threads, Uint64 seed)
+{
+    SNAKE_ENV *env = CreateEnv(num_games, seed);
+    WORKER_POOL *pool = num_threads > 1 ? CreateWorkerPool(num_threads) : NULL;
+    Uint8 *actions = (Uint8 *)malloc(num_games);
+    Uint8 *results = (Uint8 *)malloc(num_games);
+    Uint64 policy_rng = seed;
+    Uint64 episodes = 0, total_score = 0;
+
+    printf("Snake benchmark: %d games x %d steps on %d thread(s)\n", num_games, num_steps, pool ? pool->num_threads : 1);
+
+    Uint64 start = SDL_GetPerformanceCounter();
+    for (int s = 0; s < num_steps; s++)
     {
-        p->next = head;
-        head->prev = p;
-        head = p;
+        for (int g = 0; g < num_games; g++)
+        {
+            // UP/DOWN and LEFT/RIGHT are adjacent, so the reverse of a direction is dir ^ 1
+            Uint64 r = NextRandom(&policy_rng) % 8;
+            actions[g] = r < NUM_DIRS && r != (env->dir[g] ^ 1u) ? r : NUM_DIRS;
+        }
+        StepEnv(env, actions, results, pool);
+        for (int g = 0; g < num_games; g++)
+            if (results[g] == STEP_DIED || results[g] == STEP_WON)
+                episodes++;
+        for (int g = 0; g < num_games; g++)
+            total_score += results[g] == STEP_ATE;
     }
+    double secs = (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
 
-    tiles[GetIndexFromCoords(head->x, head->y)] = SNAKE;
+    double game_steps = (double)num_games * num_steps;
+    printf("%.0f game-steps in %.3f s: %.4g game-steps/s\n", game_steps, secs, secs > 0 ? game_steps / secs : 0);
+    printf("%llu episodes finished, %llu food eaten\n", (unsigned long long)episodes, (unsigned long long)total_score);
 
-    SDL_Rect rect = {head->x, head->y, TILE_SIZE, TILE_SIZE};
-    SDL_FillRect(surface, &rect, SDL_MapRGB(surface->format, RGB_SNAKE));
+    if (pool)
+        DestroyWorkerPool(pool);
+    free(actions);
+    free(results);
+    DestroyEnv(env);
+    return 0;
 }
 
-void DeleteLastAndClear(SDL_Surface *surface)
+// -1 when the move leaves the board
+int GetNeighbour(int tile, int dir)
 {
-    if (!tail)
+    int row = tile / COLS, col = tile % COLS;
+    switch (dir)
+    {
+    case UP:
+        return row > 0 ? tile - COLS : -1;
+    case DOWN:
+        return row < ROWS - 1 ? tile + COLS : -1;
+    case LEFT:
+        return col > 0 ? tile - 1 : -1;
+    default:
+        return col < COLS - 1 ? tile + 1 : -1;
+    }
+}
+
+// boustrophedon over columns 1..COLS-1, returning up column 0; needs an even number of rows
+void InitCycle()
+{
+    int order = 0;
+    for (int row = 0; row < ROWS; row++)
+    {
+        if (row % 2 == 0)
+            for (int col = row ? 1 : 0; col < COLS; col++)
+                cycle_order[row * COLS + col] = order++;
+        else
+            for (int col = COLS - 1; col >= 1; col--)
+                cycle_order[row * COLS + col] = order++;
+    }
+    for (int row = ROWS - 1; row >= 1; row--)
+        cycle_order[row * COLS] = order++;
+
+    for (int tile = 0; tile < NUM_TILES; tile++)
+        for (int dir = 0; dir < NUM_DIRS; dir++)
+        {
+            int n = GetNeighbour(tile, dir);
+            if (n >= 0 && cycle_order[n] == (cycle_order[tile] + 1) % NUM_TILES)
+                cycle_next[tile] = n;
+        }
+}
+
+// steps from a to b going forwards along the cycle
+int CycleDistance(int a, int b)
+{
+    int d = cycle_order[b] - cycle_order[a];
+    return d < 0 ? d + NUM_TILES : d;
+}
+
+AUTOPILOT *CreateAutopilot(int num_games, AI_MODE mode)
+{
+    AUTOPILOT *ai = (AUTOPILOT *)calloc(1, sizeof(AUTOPILOT));
+    ai->num_games = num_games;
+    ai->mode = mode;
+    ai->dist = (Uint16 *)calloc((size_t)num_games * NUM_TILES, sizeof(Uint16));
+    ai->queue = (Uint16 *)calloc((size_t)num_games * NUM_TILES, sizeof(Uint16));
+    ai->seeds = (Uint16 *)calloc((size_t)num_games * NUM_TILES, sizeof(Uint16));
+    ai->bucket_counts = (Uint16 *)calloc((size_t)num_games * (NUM_TILES + 1), sizeof(Uint16));
+    ai->affected = (Uint8 *)calloc((size_t)num_games * NUM_TILES, sizeof(Uint8));
+    ai->field_food = (int *)calloc(num_games, sizeof(int));
+    return ai;
+}
+
+void DestroyAutopilot(AUTOPILOT *ai)
+{
+    free(ai->dist);
+    free(ai->queue);
+    free(ai->seeds);
+    free(ai->bucket_counts);
+    free(ai->affected);
+    free(ai->field_food);
+    free(ai);
+}
+
+void RebuildDistanceField(AUTOPILOT *ai, SNAKE_ENV *env, int g)
+{
+    const Uint8 *tiles = env->tiles + (size_t)g * NUM_TILES;
+    Uint16 *dist = ai->dist + (size_t)g * NUM_TILES;
+    Uint16 *queue = ai->queue + (size_t)g * NUM_TILES;
+
+    memset(dist, 0xff, NUM_TILES * sizeof(Uint16));
+    int food = env->food[g], head = 0, end = 0;
+    dist[food] = 0;
+    queue[end++] = food;
+    while (head < end)
+    {
+        int u = queue[head++];
+        for (int dir = 0; dir < NUM_DIRS; dir++)
+        {
+            int v = GetNeighbour(u, dir);
+            if (v >= 0 && tiles[v] != SNAKE && dist[v] == UNREACHABLE)
+            {
+                dist[v] = dist[u] + 1;
+                queue[end++] = v;
+            }
+        }
+    }
+    ai->field_food[g] = food;
+}
+
+// tile has just become snake: only tiles whose every shortest path ran through it
+// change, so those are found level by level and re-seeded from their unaffected border
+void BlockTile(AUTOPILOT *ai, SNAKE_ENV *env, int g, int tile)
+{
+    const Uint8 *tiles = env->tiles + (size_t)g * NUM_TILES;
+    Uint16 *dist = ai->dist + (size_t)g * NUM_TILES;
+    Uint16 *queue = ai->queue + (size_t)g * NUM_TILES;
+    Uint16 *seeds = ai->seeds + (size_t)g * NUM_TILES;
+    Uint16 *counts = ai->bucket_counts + (size_t)g * (NUM_TILES + 1);
+    Uint8 *affected = ai->affected + (size_t)g * NUM_TILES;
+
+    if (dist[tile] == UNREACHABLE)
         return;
 
-    SDL_Rect rect = {tail->x, tail->y, TILE_SIZE, TILE_SIZE};
-    SDL_FillRect(surface, &rect, SDL_MapRGB(surface->format, RGB_BG));
+    int head = 0, end = 0;
+    affected[tile] = 1;
+    queue[end++] = tile;
+    while (head < end)
+    {
+        int u = queue[head++];
+        for (int dir = 0; dir < NUM_DIRS; dir++)
+        {
+            int v = GetNeighbour(u, dir);
+            if (v < 0 || tiles[v] == SNAKE || affected[v] || dist[v] != dist[u] + 1)
+                continue;
+            int supported = 0;
+            for (int d = 0; d < NUM_DIRS && !supported; d++)
+            {
+                int w = GetNeighbour(v, d);
+                supported = w >= 0 && w != tile && tiles[w] != SNAKE && !affected[w] && dist[w] + 1 == dist[v];
+            }
+            if (!supported)
+            {
+                affected[v] = 1;
+                queue[end++] = v;
+            }
+        }
+    }
+
+    // queue[1..end) now holds the affected free tiles; seed each from unaffected neighbours
+    int num_affected = end;
+    dist[tile] = UNREACHABLE;
+    affected[tile] = 0;
+    memset(counts, 0, (NUM_TILES + 1) * sizeof(Uint16));
+    for (int i = 1; i < num_affected; i++)
+    {
+        int v = queue[i], best = UNREACHABLE;
+        for (int dir = 0; dir < NUM_DIRS; dir++)
+        {
+            int w = GetNeighbour(v, dir);
+            if (w >= 0 && tiles[w] != SNAKE && !affected[w] && dist[w] != UNREACHABLE && dist[w] + 1 < best)
+                best = dist[w] + 1;
+        }
+        dist[v] = best;
+        counts[best == UNREACHABLE ? NUM_TILES : best]++;
+    }
+    for (int i = 1; i < num_affected; i++)
+        affected[queue[i]] = 0;
+
+    // counting sort of the seeds by distance, then a BFS that merges the sorted
+    // seeds with its own FIFO so tiles are still settled in distance order
+    for (int d = 1; d <= NUM_TILES; d++)
+        counts[d] += counts[d - 1];
+    for (int i = num_affected - 1; i >= 1; i--)
+    {
+        int v = queue[i];
+        seeds[--counts[dist[v] == UNREACHABLE ? NUM_TILES : dist[v]]] = v;
+    }
+    int num_seeds = num_affected - 1, next_seed = 0;
+    head = end = 0;
+    while (next_seed < num_seeds || head < end)
+    {
+        int u;
+        if (head < end && (next_seed == num_seeds || dist[queue[head]] <= dist[seeds[next_seed]]))
+            u = queue[head++];
+        else
+            u = seeds[next_seed++];
+        if (dist[u] == UNREACHABLE)
+            break;
+        for (int dir = 0; dir < NUM_DIRS; dir++)
+        {
+            int v = GetNeighbour(u, dir);
+            if (v >= 0 && tiles[v] != SNAKE && dist[v] > dist[u] + 1)
+            {
+                dist[v] = dist[u] + 1;
+                queue[end++] = v;
+            }
+        }
+    }
+}
 
-    tiles[GetIndexFromCoords(tail->x, tail->y)] = EMPTY;
+// tile has just been freed: distances can only shrink, spreading out from it
+void UnblockTile(AUTOPILOT *ai, SNAKE_ENV *env, int g, int tile)
+{
+    const Uint8 *tiles = env->tiles + (size_t)g * NUM_TILES;
+    Uint16 *dist = ai->dist + (size_t)g * NUM_TILES;
+    Uint16 *queue = ai->queue + (size_t)g * NUM_TILES;
 
-    if (head == tail)
+    int best = UNREACHABLE;
+    for (int dir = 0; dir < NUM_DIRS; dir++)
     {
-        free(tail);
-        head = tail = NULL;
+        int w = GetNeighbour(tile, dir);
+        if (w >= 0 && tiles[w] != SNAKE && dist[w] != UNREACHABLE && dist[w] + 1 < best)
+            best = dist[w] + 1;
+    }
+    dist[tile] = best;
+    if (best == UNREACHABLE)
         return;
+
+    int head = 0, end = 0;
+    queue[end++] = tile;
+    while (head < end)
+    {
+        int u = queue[head++];
+        for (int dir = 0; dir < NUM_DIRS; dir++)
+        {
+            int v = GetNeighbour(u, dir);
+            if (v >= 0 && tiles[v] != SNAKE && dist[v] > dist[u] + 1)
+            {
+                dist[v] = dist[u] + 1;
+                queue[end++] = v;
+            }
+        }
+    }
+}
+
+// follows the Hamiltonian cycle, taking a shortcut towards the food when it cannot
+// overtake the tail along the cycle, so the snake can never trap itself
+int ChooseMove(AUTOPILOT *ai, SNAKE_ENV *env, int g)
+{
+    const Uint8 *tiles = env->tiles + (size_t)g * NUM_TILES;
+    const Uint16 *dist = ai->dist + (size_t)g * NUM_TILES;
+    int head = GetHead(env, g);
+    int best = cycle_next[head];
+
+    if (ai->mode == AI_SHORTCUT)
+    {
+        int tail = env->body[(size_t)g * NUM_TILES + env->tail_pos[g]];
+        int to_tail = env->length[g] > 1 ? CycleDistance(head, tail) : NUM_TILES;
+        int to_food = CycleDistance(head, env->food[g]);
+        // shortcuts only while the board is mostly empty; past that the cycle is the safe path
+        int max_jump = env->length[g] < NUM_TILES / 2 ? to_tail - SHORTCUT_BUFFER : 1;
+        int best_dist = dist[best], best_jump = 1;
+
+        for (int dir = 0; dir < NUM_DIRS; dir++)
+        {
+            int n = GetNeighbour(head, dir);
+            if (n < 0 || tiles[n] == SNAKE)
+                continue;
+            int jump = CycleDistance(head, n);
+            if (jump > max_jump || jump > to_food)
+                continue;
+            if (dist[n] < best_dist || (dist[n] == best_dist && jump > best_jump))
+            {
+                best = n;
+                best_dist = dist[n];
+                best_jump = jump;
+            }
+        }
     }
 
-    NODE *p = tail;
-    tail = tail->prev;
-    tail->next = NULL;
-    p->prev = NULL;
-    free(p);
+    for (int dir = 0; dir < NUM_DIRS; dir++)
+        if (GetNeighbour(head, dir) == best)
+            return dir;
+    return env->dir[g];
 }
 
-void GenerateAndFillFoodCoords(SDL_Surface *surface, int *tiles, int *food_x, int *food_y)
+// one decision and move for game g, keeping the distance field in step with the board
+STEP_RESULT StepAutopilot(AUTOPILOT *ai, SNAKE_ENV *env, int g)
 {
-    int x, y;
-    do
+    if (ai->field_food[g] != env->food[g])
+        RebuildDistanceField(ai, env, g);
+
+    STEP_RESULT result = StepGame(env, g, ChooseMove(ai, env, g));
+    if (result == STEP_MOVED)
     {
-        x = rand() % COLS * TILE_SIZE;
-        y = rand() % ROWS * TILE_SIZE;
-    } while (tiles[GetIndexFromCoords(x, y)] != EMPTY);
+        BlockTile(ai, env, g, GetHead(env, g));
+        UnblockTile(ai, env, g, env->vacated[g]);
+    }
+    else if (result == STEP_ATE)
+        RebuildDistanceField(ai, env, g);
+    return result;
+}
 
-    SDL_FillRect(surface, &(SDL_Rect){x, y, TILE_SIZE, TILE_SIZE}, SDL_MapRGB(surface->format, RGB_FOOD));
-    *food_x = x;
-    *food_y = y;
-    tiles[GetIndexFromCoords(x, y)] = FOOD;
+void PlayTournamentRange(void *data, int begin, int end)
+{
+    TOURNAMENT_JOB *job = (TOURNAMENT_JOB *)data;
+    for (int g = begin; g < end; g++)
+    {
+        STEP_RESULT result = STEP_MOVED;
+        Uint64 moves = 0, ticks = 0;
+        while (moves < job->max_moves && result != STEP_DIED && result != STEP_WON)
+        {
+            Uint64 start = SDL_GetPerformanceCounter();
+            result = StepAutopilot(job->ai, job->env, g);
+            ticks += SDL_GetPerformanceCounter() - start;
+            moves++;
+        }
+        job->moves[g] = moves;
+        job->decision_ticks[g] = ticks;
+        job->won[g] = result == STEP_WON;
+    }
 }
 
-int GetIndexFromCoords(int x, int y)
+// headless: plays num_games seeded games to the end with the autopilot
+int RunTournament(int num_games, int num_threads, Uint64 seed, AI_MODE mode, Uint64 max_moves)
 {
-    return y / TILE_SIZE * COLS + x / TILE_SIZE;
-}
\ No newline at end of file
+    SNAKE_ENV *env = CreateEnv(num_games, seed);
+    AUTOPILOT *ai = CreateAutopilot(num_games, mode);
+    WORKER_POOL *pool = num_threads > 1 ? CreateWorkerPool(num_threads) : NULL;
+    TOURNAMENT_JOB job = {env, ai, max_moves, NULL, NULL, NULL};
+    job.moves = (Uint64 *)calloc(num_games, sizeof(Uint64));
+    job.decision_ticks = (Uint64 *)calloc(num_games, sizeof(Uint64));
+    job.won = (Uint8 *)calloc(num_games, sizeof(Uint8));
+
+    printf("Snake tournament: %d games, %s autopilot, %d thread(s), seed %llu\n", num_games, mode == AI_CYCLE ? "cycle" : "shortcut", pool ? pool->num_threads : 1, (unsigned long long)seed);
+
+    Uint64 start = SDL_GetPerformanceCounter();
+    if (pool)
+        RunParallel(pool, PlayTournamentRange, &job, num_games);
+    else
+        PlayTournamentRange(&job, 0, num_games);
+    double secs = (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+
+    Uint64 total_moves = 0, total_ticks = 0, total_score = 0, wins = 0;
+    for (int g = 0; g < num_games; g++)
+    {
+        total_moves += job.moves[g];
+        total_ticks += job.decision_ticks[g];
+        total_score += env->score[g];
+        wins += job.won[g];
+    }
+    printf("average score %.2f (max %d), %llu/%d games won\n", (double)total_score / num_games, NUM_TILES - 1, (unsigned long long)wins, num_games);
+    printf("%llu moves in %.3f s: %.4g moves/s, %.3f us per decision\n", (unsigned long long)total_moves, secs, secs > 0 ? total_moves / secs : 0,
+           total_moves ? (double)total_ticks / SDL_GetPerformanceFrequency() / total_moves * 1e6 : 0);
+
+    if (pool)
+        DestroyWorkerPool(pool);
+    free(job.moves);
+    free(job.decision_ticks);
+    free(job.won);
+    DestroyAutopilot(ai);
+    DestroyEnv(env);
+    return 0;
+}
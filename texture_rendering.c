@@ -1,13 +1,14 @@
 #include <SDL2/SDL.h>
+#include "pixel_convert.h"
+
+SDL_Texture *LoadTexture(SDL_Renderer *renderer, const char *path);
 
 int main()
 {
     SDL_Init(SDL_INIT_VIDEO);
     SDL_Window *window = SDL_CreateWindow("Texture Rendering", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, 1280, 720, 0);
-    SDL_Surface *surface = SDL_LoadBMP("sample_medium.bmp");
     SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
-    SDL_Texture *texture = SDL_CreateTextureFromSurface(renderer, surface);
-    SDL_FreeSurface(surface);
+    SDL_Texture *texture = LoadTexture(renderer, "sample_medium.bmp");
     SDL_Rect src = {500, 400, 400, 300};
     SDL_Rect dest = {0, 0, src.w, src.h};
     SDL_RenderClear(renderer);
@@ -19,4 +20,29 @@ int main()
     SDL_DestroyWindow(window);
     SDL_Quit();
     return 0;
-}
\ No newline at end of file
+}
+
+// 24 and 32-bit bitmaps are converted to ARGB8888 here, anything else is left to SDL
+SDL_Texture *LoadTexture(SDL_Renderer *renderer, const char *path)
+{
+    SDL_Surface *surface = SDL_LoadBMP(path);
+    if (!surface)
+        return NULL;
+    PIXEL_CONVERSION conversion;
+    SDL_Texture *texture = NULL;
+    Uint8 *pixels = NULL;
+    if (initPixelConversion(&conversion, surface->format->format, SDL_PIXELFORMAT_ARGB8888) &&
+        (pixels = (Uint8 *)malloc((size_t)surface->w * surface->h * 4)))
+    {
+        SDL_LockSurface(surface);
+        convertPixelRows(&conversion, (const Uint8 *)surface->pixels, surface->pitch, pixels, surface->w * 4, surface->w, surface->h);
+        SDL_UnlockSurface(surface);
+        texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STATIC, surface->w, surface->h);
+        SDL_UpdateTexture(texture, NULL, pixels, surface->w * 4);
+        free(pixels);
+    }
+    else
+        texture = SDL_CreateTextureFromSurface(renderer, surface);
+    SDL_FreeSurface(surface);
+    return texture;
+}